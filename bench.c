@@ -0,0 +1,1509 @@
+// Benchmarks for libqgen
+//
+// Build and run with `make bench`.
+
+#include "qgen.h"
+#include "bench_rv64.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+
+#ifdef _WIN32
+#include <windows.h>
+typedef HANDLE bench_thread_t;
+typedef SRWLOCK bench_rwlock_t;
+#define BENCH_THREAD_FN DWORD WINAPI
+#define bench_thread_start(t, fn, arg) ((*(t) = CreateThread(NULL, 0, (fn), (arg), 0, NULL)) == NULL)
+#define bench_thread_join(t) (WaitForSingleObject((t), INFINITE), CloseHandle(t))
+#define bench_rwlock_init(l) InitializeSRWLock(l)
+#define bench_rwlock_destroy(l) ((void) (l))
+#define bench_read_lock(l) AcquireSRWLockShared(l)
+#define bench_read_unlock(l) ReleaseSRWLockShared(l)
+#define bench_write_lock(l) AcquireSRWLockExclusive(l)
+#define bench_write_unlock(l) ReleaseSRWLockExclusive(l)
+#else
+#include <pthread.h>
+typedef pthread_t bench_thread_t;
+typedef pthread_rwlock_t bench_rwlock_t;
+#define BENCH_THREAD_FN void *
+#define bench_thread_start(t, fn, arg) pthread_create((t), NULL, (fn), (arg))
+#define bench_thread_join(t) pthread_join((t), NULL)
+#define bench_rwlock_init(l) pthread_rwlock_init((l), NULL)
+#define bench_rwlock_destroy(l) pthread_rwlock_destroy(l)
+#define bench_read_lock(l) pthread_rwlock_rdlock(l)
+#define bench_read_unlock(l) pthread_rwlock_unlock(l)
+#define bench_write_lock(l) pthread_rwlock_wrlock(l)
+#define bench_write_unlock(l) pthread_rwlock_unlock(l)
+#endif
+
+static uint64_t bench_rng_state = 0x9E3779B97F4A7C15ULL;
+
+// Set by --json, the corpus suite then prints one JSON object per line and nothing else runs
+static int bench_json;
+
+static uint64_t bench_rand(void) {
+    // xorshift64*
+    bench_rng_state ^= bench_rng_state >> 12;
+    bench_rng_state ^= bench_rng_state << 25;
+    bench_rng_state ^= bench_rng_state >> 27;
+    return bench_rng_state * 0x2545F4914F6CDD1DULL;
+}
+
+static double bench_now(void) {
+    struct timespec ts;
+    timespec_get(&ts, TIME_UTC);
+    return (double) ts.tv_sec + (double) ts.tv_nsec * 1e-9;
+}
+
+// Opcode table-like corpus: a random opcode field of varying length at the top, the rest are operands
+static qgen_bitpattern_t *bench_opcode_patterns(size_t count, int width) {
+    qgen_bitpattern_t *patterns = qgen_new_array_list(count, sizeof(qgen_bitpattern_t));
+    char pattern[129];
+    for (size_t i = 0; i < count; i++) {
+        int opcode_bits = 16 + (int) (bench_rand() % (width / 2));
+        for (int j = 0; j < width; j++) {
+            if (j < opcode_bits) pattern[j] = (bench_rand() & 1) ? '1' : '0';
+            else pattern[j] = (bench_rand() % 8 == 0) ? ((bench_rand() & 1) ? '1' : '0') : 'x';
+        }
+        pattern[width] = '\0';
+        qgen_bitpattern_t bp = qgen_strz2bp(pattern);
+        qgen_al_push((void **) &patterns, &bp);
+    }
+    return patterns;
+}
+
+// ACL-like corpus: source and destination prefixes drawn from small pools, a port and a protocol, any field may be a
+// wildcard. Rules overlap a lot, so wildcards get replicated down both sides of many splits.
+static qgen_bitpattern_t *bench_acl_patterns(size_t count, size_t pool) {
+    char prefixes[2][64][33];
+    for (int f = 0; f < 2; f++) {
+        for (size_t i = 0; i < pool; i++) {
+            int length = 8 * (1 + (int) (bench_rand() % 3));
+            for (int j = 0; j < 32; j++) {
+                prefixes[f][i][j] = j < length ? ((bench_rand() & 1) ? '1' : '0') : 'x';
+            }
+            prefixes[f][i][32] = '\0';
+        }
+    }
+    qgen_bitpattern_t *patterns = qgen_new_array_list(count, sizeof(qgen_bitpattern_t));
+    char pattern[129];
+    for (size_t i = 0; i < count; i++) {
+        char *p = pattern;
+        for (int f = 0; f < 2; f++) {
+            const char *prefix = prefixes[f][bench_rand() % pool];
+            for (int j = 0; j < 32; j++) {
+                *p++ = bench_rand() % 4 ? prefix[j] : 'x';
+            }
+        }
+        int port = bench_rand() % 2;
+        uint64_t port_value = bench_rand() % 16;
+        for (int j = 0; j < 16; j++) {
+            *p++ = port ? ((port_value >> (j % 4)) & 1 ? '1' : '0') : 'x';
+        }
+        int protocol = (int) (bench_rand() % 3);
+        for (int j = 0; j < 8; j++) {
+            *p++ = protocol == 0 ? 'x' : ((protocol == 1 ? 6 : 17) >> (7 - j)) & 1 ? '1' : '0';
+        }
+        *p = '\0';
+        qgen_bitpattern_t bp = qgen_strz2bp(pattern);
+        qgen_al_push((void **) &patterns, &bp);
+    }
+    return patterns;
+}
+
+// Decoder-like corpus: a major opcode field of which at most 64 values are used, several instructions per major
+// opcode. Tables on the major opcode leave the unused values with identical empty subtrees.
+static qgen_bitpattern_t *bench_sparse_patterns(size_t count, int width, int major_bits) {
+    qgen_bitpattern_t *patterns = qgen_new_array_list(count, sizeof(qgen_bitpattern_t));
+    uint64_t used[64];
+    for (int m = 0; m < 64; m++) {
+        used[m] = bench_rand() % (1ULL << major_bits);
+    }
+    char pattern[129];
+    for (size_t i = 0; i < count; i++) {
+        uint64_t major = used[bench_rand() % 64];
+        for (int j = 0; j < width; j++) {
+            if (j < major_bits) pattern[j] = (major >> j) & 1 ? '1' : '0';
+            else pattern[j] = bench_rand() % 3 ? ((bench_rand() & 1) ? '1' : '0') : 'x';
+        }
+        pattern[width] = '\0';
+        qgen_bitpattern_t bp = qgen_strz2bp(pattern);
+        qgen_al_push((void **) &patterns, &bp);
+    }
+    return patterns;
+}
+
+// Uniformly random patterns, every bit is a wildcard with the given percentage. Rules barely share structure, so the
+// tree grows quickly with the pattern count.
+static qgen_bitpattern_t *bench_wildcard_patterns(size_t count, int width, int wildcard_percent) {
+    qgen_bitpattern_t *patterns = qgen_new_array_list(count, sizeof(qgen_bitpattern_t));
+    char pattern[129];
+    for (size_t i = 0; i < count; i++) {
+        for (int j = 0; j < width; j++) {
+            pattern[j] = (int) (bench_rand() % 100) < wildcard_percent ? 'x' : ((bench_rand() & 1) ? '1' : '0');
+        }
+        pattern[width] = '\0';
+        qgen_bitpattern_t bp = qgen_strz2bp(pattern);
+        qgen_al_push((void **) &patterns, &bp);
+    }
+    return patterns;
+}
+
+// Builds a 32-bit pattern from an instruction match and mask
+static qgen_bitpattern_t bench_encoding(uint32_t match, uint32_t mask) {
+    char pattern[33];
+    for (int j = 0; j < 32; j++) {
+        uint32_t bit = 1U << (31 - j);
+        pattern[j] = (mask & bit) ? ((match & bit) ? '1' : '0') : 'x';
+    }
+    pattern[32] = '\0';
+    return qgen_strz2bp(pattern);
+}
+
+static qgen_bitpattern_t *bench_rv64_patterns(size_t *count) {
+    *count = BENCH_RV64_COUNT;
+    qgen_bitpattern_t *patterns = qgen_new_array_list(*count, sizeof(qgen_bitpattern_t));
+    for (size_t i = 0; i < *count; i++) {
+        qgen_bitpattern_t bp = bench_encoding(bench_rv64_encodings[i][0], bench_rv64_encodings[i][1]);
+        qgen_al_push((void **) &patterns, &bp);
+    }
+    return patterns;
+}
+
+static int bench_popcount(uint64_t x) {
+    int count = 0;
+    for (; x; x &= x - 1) count++;
+    return count;
+}
+
+static int bench_fixed_bits(const qgen_bitpattern_t *bp) {
+    return bench_popcount(bp->mask_low) + bench_popcount(bp->mask_high);
+}
+
+static int bench_compare_specific(const void *a, const void *b) {
+    return bench_fixed_bits(b) - bench_fixed_bits(a);
+}
+
+// A64-like corpus: op0 in bits 25-28 picks one of eight encoding groups, every group decodes its own set of opcode
+// bits and leaves the rest to registers and immediates. Variants fixing more bits come first, like aliases in real
+// decoders.
+static qgen_bitpattern_t *bench_a64_patterns(size_t count) {
+    uint32_t op0[8], decode[8];
+    for (int g = 0; g < 8; g++) {
+        op0[g] = (uint32_t) g * 2 + (uint32_t) (bench_rand() & 1);
+        decode[g] = 0;
+        while (bench_popcount(decode[g]) < 14) {
+            decode[g] |= (1U << (bench_rand() % 32)) & ~(0xfU << 25);
+        }
+    }
+    qgen_bitpattern_t *patterns = qgen_new_array_list(count, sizeof(qgen_bitpattern_t));
+    for (size_t i = 0; i < count; i++) {
+        int g = (int) (bench_rand() % 8);
+        uint32_t mask = 0xfU << 25;
+        for (int bit = 0; bit < 32; bit++) {
+            if ((decode[g] >> bit) & 1 && bench_rand() % 10 < 7) mask |= 1U << bit;
+        }
+        uint32_t match = ((op0[g] << 25) | (uint32_t) bench_rand()) & mask;
+        qgen_bitpattern_t bp = bench_encoding(match, mask);
+        qgen_al_push((void **) &patterns, &bp);
+    }
+    qsort(patterns, count, sizeof(qgen_bitpattern_t), bench_compare_specific);
+    return patterns;
+}
+
+// Keys are random instances of random patterns, with a few misses sprinkled in
+static void bench_keys(qgen_bitpattern_t *patterns, size_t pattern_count, uint64_t *high, uint64_t *low, size_t n) {
+    for (size_t i = 0; i < n; i++) {
+        qgen_bitpattern_t bp = patterns[bench_rand() % pattern_count];
+        high[i] = (bench_rand() & ~bp.mask_high) | bp.active_high;
+        low[i] = (bench_rand() & ~bp.mask_low) | bp.active_low;
+        if (bench_rand() % 16 == 0) low[i] = bench_rand();
+    }
+}
+
+static double bench_single(qgen_otree_t *tree, const uint64_t *high, const uint64_t *low, intptr_t *out, size_t n, int rounds) {
+    double best = 1e30;
+    for (int r = 0; r < rounds; r++) {
+        double start = bench_now();
+        for (size_t i = 0; i < n; i++) {
+            out[i] = qgen_tree_dispatch(tree, high[i], low[i]);
+        }
+        double end = bench_now();
+        if (end - start < best) best = end - start;
+    }
+    return best;
+}
+
+static double bench_batch(qgen_otree_t *tree, const uint64_t *high, const uint64_t *low, intptr_t *out, size_t n, int rounds) {
+    double best = 1e30;
+    for (int r = 0; r < rounds; r++) {
+        double start = bench_now();
+        qgen_tree_dispatch_batch(tree, high, low, out, n);
+        double end = bench_now();
+        if (end - start < best) best = end - start;
+    }
+    return best;
+}
+
+static void bench_dispatch(const char *name, size_t pattern_count, int width, size_t key_count, int rounds) {
+    qgen_bitpattern_t *patterns = bench_opcode_patterns(pattern_count, width);
+    qgen_otree_t *tree = qgen_generate_tree(patterns);
+    if (tree == NULL) {
+        perror("qgen_generate_tree");
+        exit(1);
+    }
+
+    uint64_t *high = malloc(key_count * sizeof(uint64_t));
+    uint64_t *low = malloc(key_count * sizeof(uint64_t));
+    intptr_t *single = malloc(key_count * sizeof(intptr_t));
+    intptr_t *batch = malloc(key_count * sizeof(intptr_t));
+    bench_keys(patterns, pattern_count, high, low, key_count);
+
+    double best_single = bench_single(tree, high, low, single, key_count, rounds);
+    double best_batch = bench_batch(tree, high, low, batch, key_count, rounds);
+
+    if (memcmp(single, batch, key_count * sizeof(intptr_t)) != 0) {
+        fprintf(stderr, "%s: batched dispatch disagrees with qgen_tree_dispatch\n", name);
+        exit(1);
+    }
+
+    printf(
+        "%-24s patterns=%-7zu width=%-3d single=%7.2f ns/op  batch=%7.2f ns/op  speedup=%.2fx\n",
+        name, pattern_count, width,
+        best_single * 1e9 / key_count, best_batch * 1e9 / key_count, best_single / best_batch
+    );
+
+    // Frozen leaves, one kernel at a time
+    static const char *isa_names[] = {"auto", "scalar", "sse2", "avx2", "avx512"};
+    for (int isa = QGEN_ISA_SCALAR; isa <= QGEN_ISA_AVX512; isa++) {
+        if (qgen_tree_freeze(tree, isa) != 0) continue;
+        double best_frozen = bench_single(tree, high, low, batch, key_count, rounds);
+        if (memcmp(single, batch, key_count * sizeof(intptr_t)) != 0) {
+            fprintf(stderr, "%s: frozen %s leaves disagree with qgen_tree_dispatch\n", name, isa_names[isa]);
+            exit(1);
+        }
+        printf("%-24s frozen leaves %-6s   single=%7.2f ns/op\n", name, isa_names[isa], best_frozen * 1e9 / key_count);
+    }
+
+    free(high);
+    free(low);
+    free(single);
+    free(batch);
+    qgen_free_tree(tree);
+    qgen_free_array_list(patterns);
+}
+
+// Skewed traffic, a few hot patterns take most of the keys. Compares the plain tree against one built from the
+// profile of a first sample, timed on a second sample drawn from the same distribution.
+static void bench_profile(const char *name, size_t pattern_count, int width, size_t key_count, int rounds) {
+    qgen_bitpattern_t *patterns = bench_opcode_patterns(pattern_count, width);
+    qgen_otree_t *plain = qgen_generate_tree(patterns);
+    if (plain == NULL) {
+        perror("qgen_generate_tree");
+        exit(1);
+    }
+
+    size_t hot_count = pattern_count / 100 + 1;
+    uint64_t *high = malloc(key_count * sizeof(uint64_t));
+    uint64_t *low = malloc(key_count * sizeof(uint64_t));
+    intptr_t *expected = malloc(key_count * sizeof(intptr_t));
+    intptr_t *out = malloc(key_count * sizeof(intptr_t));
+    uint64_t *hits = calloc(pattern_count, sizeof(uint64_t));
+    for (int sample = 0; sample < 2; sample++) {
+        for (size_t i = 0; i < key_count; i++) {
+            // 90% of the keys come from the last 1% of the patterns, which the plain tree scans last in their buckets
+            size_t pick = bench_rand() % 10 ? pattern_count - 1 - bench_rand() % hot_count : bench_rand() % pattern_count;
+            bench_keys(&patterns[pick], 1, &high[i], &low[i], 1);
+        }
+        if (sample == 0) qgen_tree_count_hits(plain, high, low, key_count, hits);
+    }
+    qgen_otree_t *weighted = qgen_generate_tree_weighted(patterns, hits);
+    if (weighted == NULL) {
+        perror("qgen_generate_tree_weighted");
+        exit(1);
+    }
+
+    double best_plain = bench_single(plain, high, low, expected, key_count, rounds);
+    double best_weighted = bench_single(weighted, high, low, out, key_count, rounds);
+    if (memcmp(expected, out, key_count * sizeof(intptr_t)) != 0) {
+        fprintf(stderr, "%s: profile-guided tree disagrees with the plain tree\n", name);
+        exit(1);
+    }
+
+    printf(
+        "%-24s patterns=%-7zu width=%-3d plain=%7.2f ns/op  weighted=%7.2f ns/op  speedup=%.2fx\n",
+        name, pattern_count, width,
+        best_plain * 1e9 / key_count, best_weighted * 1e9 / key_count, best_plain / best_weighted
+    );
+
+    free(high);
+    free(low);
+    free(expected);
+    free(out);
+    free(hits);
+    qgen_free_tree(plain);
+    qgen_free_tree(weighted);
+    qgen_free_array_list(patterns);
+}
+
+// Serial against parallel generation, both have to produce trees that dispatch the same
+static void bench_generate(const char *name, size_t pattern_count, int width, size_t key_count) {
+    qgen_bitpattern_t *patterns = bench_opcode_patterns(pattern_count, width);
+
+    double start = bench_now();
+    qgen_otree_t *serial = qgen_generate_tree(patterns);
+    double serial_time = bench_now() - start;
+    start = bench_now();
+    qgen_otree_t *parallel = qgen_generate_tree_parallel(patterns, 0);
+    double parallel_time = bench_now() - start;
+    if (serial == NULL || parallel == NULL) {
+        perror("qgen_generate_tree");
+        exit(1);
+    }
+
+    uint64_t *high = malloc(key_count * sizeof(uint64_t));
+    uint64_t *low = malloc(key_count * sizeof(uint64_t));
+    bench_keys(patterns, pattern_count, high, low, key_count);
+    for (size_t i = 0; i < key_count; i++) {
+        if (qgen_tree_dispatch(serial, high[i], low[i]) != qgen_tree_dispatch(parallel, high[i], low[i])) {
+            fprintf(stderr, "%s: parallel tree disagrees with the serial tree\n", name);
+            exit(1);
+        }
+    }
+
+    printf(
+        "%-24s patterns=%-7zu width=%-3d serial=%8.2f ms  parallel=%8.2f ms  speedup=%.2fx\n",
+        name, pattern_count, width, serial_time * 1e3, parallel_time * 1e3, serial_time / parallel_time
+    );
+
+    free(high);
+    free(low);
+    qgen_free_tree(serial);
+    qgen_free_tree(parallel);
+    qgen_free_array_list(patterns);
+}
+
+// Small updates against a full rebuild, the updated tree has to dispatch like one generated from scratch
+static void bench_update(const char *name, size_t pattern_count, int width, size_t update_count, size_t key_count) {
+    qgen_bitpattern_t *patterns = bench_opcode_patterns(pattern_count + update_count, width);
+    qgen_bitpattern_t *initial = qgen_new_array_list(pattern_count, sizeof(qgen_bitpattern_t));
+    for (size_t i = 0; i < pattern_count; i++) qgen_al_push((void **) &initial, &patterns[i]);
+    qgen_otree_t *tree = qgen_generate_tree(initial);
+    if (tree == NULL) {
+        perror("qgen_generate_tree");
+        exit(1);
+    }
+
+    // Every update inserts one new pattern and removes one of the original ones
+    double start = bench_now();
+    for (size_t i = 0; i < update_count; i++) {
+        if (qgen_tree_insert(tree, patterns[pattern_count + i]) < 0 || qgen_tree_remove(tree, i * 2) != 0) {
+            perror("qgen_tree_insert");
+            exit(1);
+        }
+    }
+    double update_time = bench_now() - start;
+
+    // The rebuilt set leaves out the removed patterns, remaining keeps its indices in the updated tree
+    qgen_bitpattern_t *current = qgen_new_array_list(pattern_count, sizeof(qgen_bitpattern_t));
+    intptr_t *remaining = malloc(pattern_count * sizeof(intptr_t));
+    size_t remaining_count = 0;
+    for (size_t i = 0; i < pattern_count + update_count; i++) {
+        if (i % 2 == 0 && i < update_count * 2) continue;
+        remaining[remaining_count++] = (intptr_t) i;
+        qgen_al_push((void **) &current, &patterns[i]);
+    }
+    start = bench_now();
+    qgen_otree_t *rebuilt = qgen_generate_tree(current);
+    double rebuild_time = bench_now() - start;
+    if (rebuilt == NULL) {
+        perror("qgen_generate_tree");
+        exit(1);
+    }
+
+    uint64_t *high = malloc(key_count * sizeof(uint64_t));
+    uint64_t *low = malloc(key_count * sizeof(uint64_t));
+    bench_keys(patterns, pattern_count + update_count, high, low, key_count);
+    for (size_t i = 0; i < key_count; i++) {
+        intptr_t expected = qgen_tree_dispatch(rebuilt, high[i], low[i]);
+        if (expected >= 0) expected = remaining[expected];
+        if (qgen_tree_dispatch(tree, high[i], low[i]) != expected) {
+            fprintf(stderr, "%s: updated tree disagrees with the rebuilt tree\n", name);
+            exit(1);
+        }
+    }
+
+    printf(
+        "%-24s patterns=%-7zu width=%-3d update=%8.2f us/op  rebuild=%8.2f ms  degradation=%.3f\n",
+        name, pattern_count, width, update_time * 1e6 / update_count, rebuild_time * 1e3, qgen_tree_degradation(tree)
+    );
+
+    free(high);
+    free(low);
+    qgen_free_tree(tree);
+    free(remaining);
+    qgen_free_tree(rebuilt);
+    qgen_free_array_list(initial);
+    qgen_free_array_list(current);
+    qgen_free_array_list(patterns);
+}
+
+// One-hot patterns all overlap, so no bit splits them and both generating and inserting them leave a leaf longer
+// than QGEN_BUCKET_MAX_LENGTH. Scans of it have to land in the last histogram slot. Skipped without QGEN_STATS.
+static void bench_stats_long_bucket(const char *name, size_t pattern_count, size_t generated_count) {
+    qgen_bitpattern_t *patterns = qgen_new_array_list(pattern_count, sizeof(qgen_bitpattern_t));
+    for (size_t i = 0; i < generated_count; i++) {
+        qgen_bitpattern_t one_hot = {.width = (uint8_t) pattern_count, .mask_low = 1ULL << i, .active_low = 1ULL << i};
+        qgen_al_push((void **) &patterns, &one_hot);
+    }
+    qgen_otree_t *tree = qgen_generate_tree(patterns);
+    if (tree == NULL) {
+        perror("qgen_generate_tree");
+        exit(1);
+    }
+    for (size_t i = generated_count; i < pattern_count; i++) {
+        qgen_bitpattern_t one_hot = {.width = (uint8_t) pattern_count, .mask_low = 1ULL << i, .active_low = 1ULL << i};
+        if (qgen_tree_insert(tree, one_hot) < 0) {
+            perror("qgen_tree_insert");
+            exit(1);
+        }
+    }
+    qgen_stats_t *stats = qgen_stats_new(tree);
+    if (stats == NULL && errno == ENOSYS) {
+        qgen_free_tree(tree);
+        qgen_free_array_list(patterns);
+        return;
+    }
+    qgen_stats_t *other = qgen_stats_new(tree);
+    if (stats == NULL || other == NULL) {
+        perror("qgen_stats_new");
+        exit(1);
+    }
+
+    // A miss scans the whole leaf, the last pattern is matched after all of them
+    qgen_stats_bind(stats);
+    intptr_t miss = qgen_tree_dispatch(tree, 0, 0);
+    qgen_stats_bind(other);
+    intptr_t last = qgen_tree_dispatch(tree, 0, 1ULL << (pattern_count - 1));
+    qgen_stats_bind(NULL);
+    if (miss != -1 || last != (intptr_t) pattern_count - 1 || qgen_stats_merge(stats, other) != 0) {
+        fprintf(stderr, "%s: unexpected dispatch results %lld %lld\n", name, (long long) miss, (long long) last);
+        exit(1);
+    }
+
+    const char *filename = "qgen_bench_stats.txt";
+    if (qgen_stats_export(stats, filename) != 0) {
+        perror("qgen_stats_export");
+        exit(1);
+    }
+    FILE *f = fopen(filename, "r");
+    char line[512];
+    uint64_t longest = 0;
+    while (f && fgets(line, sizeof(line), f)) {
+        // The last number of a bucket line is the slot of the longest scans
+        char *last_field = strrchr(line, ' ');
+        if (strncmp(line, "bucket ", 7) == 0 && last_field) longest += strtoull(last_field + 1, NULL, 10);
+    }
+    if (f) fclose(f);
+    remove(filename);
+    if (longest != 2) {
+        fprintf(stderr, "%s: %llu scans in the last histogram slot, expected 2\n", name, (unsigned long long) longest);
+        exit(1);
+    }
+    printf("%-24s patterns=%-7zu generated=%-7zu long scans=%llu\n", name, pattern_count, generated_count, (unsigned long long) longest);
+
+    qgen_stats_free(stats);
+    qgen_stats_free(other);
+    qgen_free_tree(tree);
+    qgen_free_array_list(patterns);
+}
+
+// Loading validates every node of the file, so a child, bucket or split bit out of range fails with EILSEQ even
+// without checksums. The tree gets updated first, which leaves children after their parents.
+static void bench_load_corrupt(const char *name, size_t pattern_count, int width, size_t update_count, size_t key_count) {
+    qgen_bitpattern_t *patterns = bench_opcode_patterns(pattern_count + update_count, width);
+    qgen_bitpattern_t *initial = qgen_new_array_list(pattern_count, sizeof(qgen_bitpattern_t));
+    for (size_t i = 0; i < pattern_count; i++) qgen_al_push((void **) &initial, &patterns[i]);
+    qgen_otree_t *tree = qgen_generate_tree(initial);
+    if (tree == NULL) {
+        perror("qgen_generate_tree");
+        exit(1);
+    }
+    for (size_t i = 0; i < update_count; i++) {
+        if (qgen_tree_insert(tree, patterns[pattern_count + i]) < 0) {
+            perror("qgen_tree_insert");
+            exit(1);
+        }
+    }
+
+    const char *filename = "qgen_bench_tree.qgt";
+    if (qgen_save_tree(tree, filename, QGEN_FILE_CHECKSUM_NONE) != 0) {
+        perror("qgen_save_tree");
+        exit(1);
+    }
+    double start = bench_now();
+    qgen_otree_t *loaded = qgen_load_tree(filename);
+    double load_time = bench_now() - start;
+    start = bench_now();
+    qgen_otree_t *mapped = qgen_map_tree(filename);
+    double map_time = bench_now() - start;
+    if (loaded == NULL || mapped == NULL) {
+        perror("qgen_load_tree");
+        exit(1);
+    }
+    uint64_t *high = malloc(key_count * sizeof(uint64_t));
+    uint64_t *low = malloc(key_count * sizeof(uint64_t));
+    bench_keys(patterns, pattern_count + update_count, high, low, key_count);
+    for (size_t i = 0; i < key_count; i++) {
+        intptr_t expected = qgen_tree_dispatch(tree, high[i], low[i]);
+        if (qgen_tree_dispatch(loaded, high[i], low[i]) != expected || qgen_tree_dispatch(mapped, high[i], low[i]) != expected) {
+            fprintf(stderr, "%s: loaded tree disagrees with the updated one\n", name);
+            exit(1);
+        }
+    }
+    qgen_free_tree(loaded);
+    qgen_free_tree(mapped);
+
+    // Break one node at a time, spread over the whole node table
+    FILE *f = fopen(filename, "r+b");
+    qgen_file_header_t header;
+    if (f == NULL || fread(&header, sizeof(header), 1, f) != 1) {
+        perror(filename);
+        exit(1);
+    }
+    size_t step = header.node_count / 64 + 1, rejected = 0;
+    for (size_t i = 0; i < header.node_count; i += step) {
+        uint64_t node, broken;
+        long offset = (long) header.node_offset + (long) (i * sizeof(uint64_t));
+        fseek(f, offset, SEEK_SET);
+        if (fread(&node, sizeof(node), 1, f) != 1) {
+            perror(filename);
+            exit(1);
+        }
+        if (QGEN_NODE_IS_LEAF(node)) {
+            broken = QGEN_NODE_LEAF(0, header.bucket_count);
+        } else if (QGEN_NODE_IS_TABLE(node)) {
+            continue;
+        } else {
+            broken = (node & ~0xffffULL) | 0xffff;
+        }
+        fseek(f, offset, SEEK_SET);
+        fwrite(&broken, sizeof(broken), 1, f);
+        fflush(f);
+        errno = 0;
+        loaded = qgen_load_tree(filename);
+        int load_errno = errno;
+        errno = 0;
+        mapped = qgen_map_tree(filename);
+        if (loaded != NULL || mapped != NULL || load_errno != EILSEQ || errno != EILSEQ) {
+            fprintf(stderr, "%s: node %zu broken in the file but the tree still loaded\n", name, i);
+            exit(1);
+        }
+        rejected++;
+        fseek(f, offset, SEEK_SET);
+        fwrite(&node, sizeof(node), 1, f);
+        fflush(f);
+    }
+    fclose(f);
+    remove(filename);
+
+    printf(
+        "%-24s patterns=%-7zu nodes=%-7u load=%8.2f ms  map=%8.2f ms  rejected=%zu\n",
+        name, pattern_count + update_count, header.node_count, load_time * 1e3, map_time * 1e3, rejected
+    );
+
+    free(high);
+    free(low);
+    qgen_free_tree(tree);
+    qgen_free_array_list(initial);
+    qgen_free_array_list(patterns);
+}
+
+// Reference for the trees, the first pattern in index order that matches the key, -1 if none does
+static intptr_t bench_linear_match(const qgen_bitpattern_t *patterns, size_t pattern_count, uint64_t high, uint64_t low) {
+    for (size_t p = 0; p < pattern_count; p++) {
+        if ((high & patterns[p].mask_high) == patterns[p].active_high && (low & patterns[p].mask_low) == patterns[p].active_low) {
+            return (intptr_t) p;
+        }
+    }
+    return -1;
+}
+
+// Hash-consed generation, checked against a linear scan of the patterns. Takes ownership of patterns.
+static void bench_sharing(const char *name, qgen_bitpattern_t *patterns, size_t pattern_count, size_t key_count) {
+    double start = bench_now();
+    qgen_otree_t *tree = qgen_generate_tree(patterns);
+    double generate_time = bench_now() - start;
+    qgen_sharing_t sharing;
+    if (tree == NULL || qgen_tree_sharing(tree, &sharing) != 0) {
+        perror("qgen_generate_tree");
+        exit(1);
+    }
+
+    uint64_t *high = malloc(key_count * sizeof(uint64_t));
+    uint64_t *low = malloc(key_count * sizeof(uint64_t));
+    bench_keys(patterns, pattern_count, high, low, key_count);
+    for (size_t i = 0; i < key_count; i++) {
+        if (qgen_tree_dispatch(tree, high[i], low[i]) != bench_linear_match(patterns, pattern_count, high[i], low[i])) {
+            fprintf(stderr, "%s: shared tree disagrees with a linear scan\n", name);
+            exit(1);
+        }
+    }
+
+    printf(
+        "%-24s patterns=%-7zu nodes=%llu/%llu buckets=%llu/%llu stored/unshared  generate=%8.2f ms\n",
+        name, pattern_count,
+        (unsigned long long) sharing.nodes, (unsigned long long) sharing.unshared_nodes,
+        (unsigned long long) sharing.buckets, (unsigned long long) sharing.unshared_buckets, generate_time * 1e3
+    );
+
+    free(high);
+    free(low);
+    qgen_free_tree(tree);
+    qgen_free_array_list(patterns);
+}
+
+// Trees past 65536 nodes need wide nodes where a child index doesn't fit 16 bits, smaller ones stay compact
+static void bench_wide(const char *name, size_t pattern_count, int width, size_t key_count, int rounds) {
+    qgen_bitpattern_t *patterns = bench_wildcard_patterns(pattern_count, width, 20);
+    qgen_otree_t *tree = qgen_generate_tree(patterns);
+    qgen_sharing_t sharing;
+    if (tree == NULL || qgen_tree_sharing(tree, &sharing) != 0) {
+        perror("qgen_generate_tree");
+        exit(1);
+    }
+
+    uint64_t *high = malloc(key_count * sizeof(uint64_t));
+    uint64_t *low = malloc(key_count * sizeof(uint64_t));
+    intptr_t *out = malloc(key_count * sizeof(intptr_t));
+    bench_keys(patterns, pattern_count, high, low, key_count);
+    double best_single = bench_single(tree, high, low, out, key_count, rounds);
+    // A linear scan over every pattern is slow, a sample of the keys is enough
+    for (size_t i = 0; i < key_count; i += 64) {
+        if (out[i] != bench_linear_match(patterns, pattern_count, high[i], low[i])) {
+            fprintf(stderr, "%s: tree disagrees with a linear scan\n", name);
+            exit(1);
+        }
+    }
+
+    printf(
+        "%-24s patterns=%-7zu nodes=%-7llu buckets=%-7llu wide=%-6zu single=%7.2f ns/op\n",
+        name, pattern_count, (unsigned long long) sharing.nodes, (unsigned long long) sharing.buckets,
+        qgen_tree_wide_nodes(tree), best_single * 1e9 / key_count
+    );
+
+    free(high);
+    free(low);
+    free(out);
+    qgen_free_tree(tree);
+    qgen_free_array_list(patterns);
+}
+
+// Most specific rule wins, the way ACLs and longest-prefix tables resolve. Part of the rules are inserted after
+// generation, then first-match and all-matches dispatch are both checked against a linear scan.
+static void bench_priority(const char *name, size_t pattern_count, size_t insert_count, size_t key_count, int rounds) {
+    qgen_bitpattern_t *all = bench_acl_patterns(pattern_count + insert_count, 32);
+    qgen_prioritize_specific(all);
+    qgen_bitpattern_t *base = qgen_new_array_list(pattern_count, sizeof(qgen_bitpattern_t));
+    for (size_t i = 0; i < pattern_count; i++) qgen_al_push((void **) &base, &all[i]);
+    qgen_otree_t *tree = qgen_generate_tree(base);
+    if (tree == NULL) {
+        perror("qgen_generate_tree");
+        exit(1);
+    }
+    for (size_t i = pattern_count; i < pattern_count + insert_count; i++) {
+        if (qgen_tree_insert(tree, all[i]) != (intptr_t) i) {
+            perror("qgen_tree_insert");
+            exit(1);
+        }
+    }
+    size_t total = pattern_count + insert_count;
+
+    uint64_t *high = malloc(key_count * sizeof(uint64_t));
+    uint64_t *low = malloc(key_count * sizeof(uint64_t));
+    intptr_t *out = malloc(key_count * sizeof(intptr_t));
+    bench_keys(all, total, high, low, key_count);
+    double best_single = bench_single(tree, high, low, out, key_count, rounds);
+    size_t matches[64];
+    size_t match_total = 0;
+    double best_all = 1e30;
+    for (int r = 0; r < rounds; r++) {
+        size_t sum = 0;
+        double start = bench_now();
+        for (size_t i = 0; i < key_count; i++) {
+            sum += qgen_tree_dispatch_all(tree, high[i], low[i], matches, 64);
+        }
+        double end = bench_now();
+        if (end - start < best_all) best_all = end - start;
+        match_total = sum;
+    }
+
+    // The reference takes every match in resolution order: highest priority first, then lowest index
+    for (size_t i = 0; i < key_count; i += 16) {
+        size_t expected[64], expected_count = 0;
+        for (uint32_t priority = 129; priority-- > 0; ) {
+            for (size_t p = 0; p < total; p++) {
+                if (all[p].priority != priority) continue;
+                if ((high[i] & all[p].mask_high) != all[p].active_high || (low[i] & all[p].mask_low) != all[p].active_low) continue;
+                if (expected_count < 64) expected[expected_count] = p;
+                expected_count++;
+            }
+        }
+        size_t count = qgen_tree_dispatch_all(tree, high[i], low[i], matches, 64);
+        intptr_t first = expected_count ? (intptr_t) expected[0] : -1;
+        if (out[i] != first || count != expected_count || memcmp(matches, expected, (count < 64 ? count : 64) * sizeof(size_t)) != 0) {
+            fprintf(stderr, "%s: tree disagrees with a linear scan\n", name);
+            exit(1);
+        }
+    }
+
+    printf(
+        "%-24s patterns=%-7zu inserted=%-5zu single=%7.2f ns/op  all=%7.2f ns/op  matches/key=%.2f\n",
+        name, pattern_count, insert_count, best_single * 1e9 / key_count, best_all * 1e9 / key_count,
+        (double) match_total / key_count
+    );
+
+    free(high);
+    free(low);
+    free(out);
+    qgen_free_tree(tree);
+    qgen_free_array_list(base);
+    qgen_free_array_list(all);
+}
+
+// IPv6 5-tuple rules, 296 bits: source and destination prefixes from small pools, optional ports and protocol
+static qgen_wide_pattern_t *bench_ipv6_patterns(size_t count, size_t pool) {
+    char prefixes[2][64][129];
+    for (int f = 0; f < 2; f++) {
+        for (size_t i = 0; i < pool; i++) {
+            int length = 16 * (1 + (int) (bench_rand() % 4));
+            for (int j = 0; j < 128; j++) {
+                prefixes[f][i][j] = j < length ? ((bench_rand() & 1) ? '1' : '0') : 'x';
+            }
+            prefixes[f][i][128] = '\0';
+        }
+    }
+    qgen_wide_pattern_t *patterns = qgen_new_array_list(count, sizeof(qgen_wide_pattern_t));
+    char pattern[297];
+    for (size_t i = 0; i < count; i++) {
+        char *p = pattern;
+        for (int f = 0; f < 2; f++) {
+            memcpy(p, prefixes[f][bench_rand() % pool], 128);
+            p += 128;
+        }
+        for (int port = 0; port < 2; port++) {
+            int fixed = bench_rand() % 2;
+            uint64_t value = bench_rand() % 1024;
+            for (int j = 0; j < 16; j++) {
+                *p++ = fixed ? ((value >> (15 - j)) & 1 ? '1' : '0') : 'x';
+            }
+        }
+        int protocol = (int) (bench_rand() % 3);
+        for (int j = 0; j < 8; j++) {
+            *p++ = protocol == 0 ? 'x' : ((protocol == 1 ? 6 : 17) >> (7 - j)) & 1 ? '1' : '0';
+        }
+        qgen_wide_pattern_t wp = qgen_str2wp(296, pattern);
+        qgen_al_push((void **) &patterns, &wp);
+    }
+    return patterns;
+}
+
+static void bench_wide_keys(const char *name, size_t pattern_count, size_t key_count, int rounds) {
+    qgen_wide_pattern_t *patterns = bench_ipv6_patterns(pattern_count, 48);
+    double start = bench_now();
+    qgen_otree_t *tree = qgen_generate_tree_wide(patterns);
+    double build_time = bench_now() - start;
+    qgen_tree_info_t info;
+    if (tree == NULL || qgen_tree_info(tree, &info) != 0) {
+        perror("qgen_generate_tree_wide");
+        exit(1);
+    }
+
+    size_t words = (qgen_tree_max_width(tree) + 63) / 64;
+    uint64_t *keys = malloc(key_count * words * sizeof(uint64_t));
+    intptr_t *out = malloc(key_count * sizeof(intptr_t));
+    for (size_t i = 0; i < key_count; i++) {
+        const qgen_wide_pattern_t *bp = &patterns[bench_rand() % pattern_count];
+        for (size_t w = 0; w < words; w++) {
+            keys[i * words + w] = (bench_rand() & ~bp->mask[w]) | bp->active[w];
+        }
+        if (bench_rand() % 16 == 0) keys[i * words] = bench_rand();
+    }
+    double best = 1e30;
+    for (int r = 0; r < rounds; r++) {
+        start = bench_now();
+        for (size_t i = 0; i < key_count; i++) {
+            out[i] = qgen_tree_dispatch_wide(tree, &keys[i * words]);
+        }
+        double end = bench_now();
+        if (end - start < best) best = end - start;
+    }
+    for (size_t i = 0; i < key_count; i += 64) {
+        intptr_t expected = -1;
+        for (size_t p = 0; p < pattern_count && expected < 0; p++) {
+            size_t w = 0;
+            while (w < words && (keys[i * words + w] & patterns[p].mask[w]) == patterns[p].active[w]) w++;
+            if (w == words) expected = (intptr_t) p;
+        }
+        if (out[i] != expected) {
+            fprintf(stderr, "%s: tree disagrees with a linear scan\n", name);
+            exit(1);
+        }
+    }
+
+    printf(
+        "%-24s patterns=%-7zu width=%-4u build=%8.2f ms  nodes=%-7llu depth=%5.2f/%-3u single=%7.2f ns/op\n",
+        name, pattern_count, (unsigned) qgen_tree_max_width(tree), build_time * 1e3,
+        (unsigned long long) info.nodes, info.average_depth, (unsigned) info.max_depth, best * 1e9 / key_count
+    );
+
+    free(keys);
+    free(out);
+    qgen_free_tree(tree);
+    qgen_free_array_list(patterns);
+}
+
+// Operand names of the register, immediate and function slots of a RISC-V encoding, bits 31-25, 24-20, 19-15,
+// 14-12 and 11-7. Slots sharing a name are one field, like the split immediates of stores and branches.
+static const char *bench_rv64_slot_names(uint32_t opcode, int slot) {
+    static const char *r_type[] = {"funct7", "rs2", "rs1", "funct3", "rd"};
+    static const char *i_type[] = {"imm", "imm", "rs1", "funct3", "rd"};
+    static const char *s_type[] = {"imm", "rs2", "rs1", "funct3", "imm"};
+    static const char *u_type[] = {"imm", "imm", "imm", "imm", "rd"};
+    switch (opcode) {
+        case 0x03: case 0x0f: case 0x13: case 0x1b: case 0x67: case 0x73: return i_type[slot];
+        case 0x23: case 0x63: return s_type[slot];
+        case 0x17: case 0x37: case 0x6f: return u_type[slot];
+        default: return r_type[slot];
+    }
+}
+
+static const int bench_rv64_slots[5][2] = {{25, 7}, {20, 5}, {15, 5}, {12, 3}, {7, 5}};
+
+// Writes the pattern string of an encoding, slots left entirely open become named fields
+static void bench_rv64_field_pattern(uint32_t match, uint32_t mask, char *pattern) {
+    char *p = pattern;
+    for (int s = 0; s < 5; s++) {
+        int low = bench_rv64_slots[s][0], length = bench_rv64_slots[s][1];
+        uint32_t slot_mask = ((1U << length) - 1) << low;
+        if ((mask & slot_mask) == 0) {
+            p += sprintf(p, "%s:%d ", bench_rv64_slot_names(match & 0x7f, s), length);
+            continue;
+        }
+        for (int bit = low + length - 1; bit >= low; bit--) {
+            *p++ = (mask >> bit) & 1 ? ((match >> bit) & 1 ? '1' : '0') : 'x';
+        }
+        *p++ = ' ';
+    }
+    for (int bit = 6; bit >= 0; bit--) {
+        *p++ = (mask >> bit) & 1 ? ((match >> bit) & 1 ? '1' : '0') : 'x';
+    }
+    *p = '\0';
+}
+
+// The same fields cut out by hand from the slots, the way a decoder without qgen_tree_decode would
+static void bench_rv64_manual_fields(uint32_t match, uint32_t mask, uint32_t insn, uint64_t *values) {
+    const char *names[5];
+    int count = 0;
+    for (int s = 0; s < 5; s++) {
+        int low = bench_rv64_slots[s][0], length = bench_rv64_slots[s][1];
+        if (mask & (((1U << length) - 1) << low)) continue;
+        const char *slot_name = bench_rv64_slot_names(match & 0x7f, s);
+        int f = 0;
+        while (f < count && strcmp(names[f], slot_name) != 0) f++;
+        if (f == count) {
+            names[count++] = slot_name;
+            values[f] = 0;
+        }
+        values[f] = (values[f] << length) | ((insn >> low) & ((1U << length) - 1));
+    }
+}
+
+static void bench_decode(const char *name, size_t key_count, int rounds) {
+    size_t count = BENCH_RV64_COUNT;
+    qgen_bitpattern_t *patterns = qgen_new_array_list(count, sizeof(qgen_bitpattern_t));
+    qgen_fields_t *fields = qgen_new_array_list(count, sizeof(qgen_fields_t));
+    char pattern[128];
+    for (size_t i = 0; i < count; i++) {
+        qgen_fields_t entry;
+        bench_rv64_field_pattern(bench_rv64_encodings[i][0], bench_rv64_encodings[i][1], pattern);
+        qgen_bitpattern_t bp = qgen_strz2bp_fields(pattern, &entry);
+        qgen_bitpattern_t plain = bench_encoding(bench_rv64_encodings[i][0], bench_rv64_encodings[i][1]);
+        if (bp.width != 32 || bp.mask_low != plain.mask_low || bp.active_low != plain.active_low) {
+            fprintf(stderr, "%s: field pattern %s parsed wrong\n", name, pattern);
+            exit(1);
+        }
+        qgen_al_push((void **) &patterns, &bp);
+        qgen_al_push((void **) &fields, &entry);
+    }
+    qgen_otree_t *tree = qgen_generate_tree(patterns);
+    if (tree == NULL || qgen_tree_set_fields(tree, fields) != 0) {
+        perror("qgen_tree_set_fields");
+        exit(1);
+    }
+
+    uint64_t *keys = malloc(key_count * sizeof(uint64_t));
+    uint64_t (*values)[QGEN_MAX_FIELDS] = malloc(key_count * sizeof(*values));
+    uint64_t (*manual)[QGEN_MAX_FIELDS] = malloc(key_count * sizeof(*manual));
+    for (size_t i = 0; i < key_count; i++) {
+        const uint32_t *encoding = bench_rv64_encodings[bench_rand() % count];
+        keys[i] = (bench_rand() & ~encoding[1] & 0xffffffffULL) | encoding[0];
+    }
+
+    double best_decode = 1e30, best_manual = 1e30;
+    uint64_t sum = 0;
+    for (int r = 0; r < rounds; r++) {
+        double start = bench_now();
+        for (size_t i = 0; i < key_count; i++) {
+            sum += (uint64_t) qgen_tree_decode(tree, 0, keys[i], values[i]);
+        }
+        double end = bench_now();
+        if (end - start < best_decode) best_decode = end - start;
+
+        start = bench_now();
+        for (size_t i = 0; i < key_count; i++) {
+            intptr_t id = qgen_tree_dispatch(tree, 0, keys[i]);
+            if (id >= 0) {
+                bench_rv64_manual_fields(bench_rv64_encodings[id][0], bench_rv64_encodings[id][1], (uint32_t) keys[i], manual[i]);
+            }
+            sum += (uint64_t) id;
+        }
+        end = bench_now();
+        if (end - start < best_manual) best_manual = end - start;
+    }
+    for (size_t i = 0; i < key_count; i++) {
+        const qgen_fields_t *f = qgen_tree_fields(tree, (size_t) qgen_tree_dispatch(tree, 0, keys[i]));
+        if (f && memcmp(values[i], manual[i], f->count * sizeof(uint64_t)) != 0) {
+            fprintf(stderr, "%s: decoded fields disagree with the manual decoder\n", name);
+            exit(1);
+        }
+    }
+
+    printf(
+        "%-24s patterns=%-7zu decode=%7.2f ns/op  manual=%7.2f ns/op  (%llu)\n",
+        name, count, best_decode * 1e9 / key_count, best_manual * 1e9 / key_count, (unsigned long long) (sum & 0xff)
+    );
+
+    free(keys);
+    free(values);
+    free(manual);
+    qgen_free_tree(tree);
+    qgen_free_array_list(patterns);
+    qgen_free_array_list(fields);
+}
+
+// Instruction stream decoding: a buffer of little-endian RV64 instructions walked by qgen_tree_scan, against a loop
+// assembling every word and calling qgen_tree_dispatch
+static void bench_scan(const char *name, size_t instruction_count, int rounds) {
+    size_t rv64_count;
+    qgen_bitpattern_t *patterns = bench_rv64_patterns(&rv64_count);
+    qgen_otree_t *tree = qgen_generate_tree(patterns);
+    if (tree == NULL || qgen_tree_freeze(tree, QGEN_ISA_AUTO) != 0) {
+        perror("qgen_generate_tree");
+        exit(1);
+    }
+
+    uint8_t *stream = malloc(instruction_count * 4);
+    for (size_t i = 0; i < instruction_count; i++) {
+        const uint32_t *encoding = bench_rv64_encodings[bench_rand() % rv64_count];
+        uint32_t insn = ((uint32_t) bench_rand() & ~encoding[1]) | encoding[0];
+        for (int b = 0; b < 4; b++) stream[i * 4 + b] = (uint8_t) (insn >> (8 * b));
+    }
+    intptr_t *out = malloc(instruction_count * sizeof(intptr_t));
+    intptr_t *expected = malloc(instruction_count * sizeof(intptr_t));
+
+    double best_scan = 1e30, best_loop = 1e30;
+    size_t decoded = 0, consumed = 0;
+    for (int r = 0; r < rounds; r++) {
+        double start = bench_now();
+        decoded = qgen_tree_scan(tree, stream, instruction_count * 4, QGEN_SCAN_LE32, out, instruction_count, &consumed);
+        double end = bench_now();
+        if (end - start < best_scan) best_scan = end - start;
+
+        // The loop a caller would write otherwise, advancing by the width of every match
+        start = bench_now();
+        for (size_t i = 0, offset = 0; i < instruction_count; i++) {
+            uint32_t insn = (uint32_t) stream[offset] | (uint32_t) stream[offset + 1] << 8 |
+                            (uint32_t) stream[offset + 2] << 16 | (uint32_t) stream[offset + 3] << 24;
+            expected[i] = qgen_tree_dispatch(tree, 0, insn);
+            offset += patterns[expected[i]].width / 8;
+        }
+        end = bench_now();
+        if (end - start < best_loop) best_loop = end - start;
+    }
+    if (decoded != instruction_count || consumed != instruction_count * 32 ||
+        memcmp(out, expected, instruction_count * sizeof(intptr_t)) != 0) {
+        fprintf(stderr, "%s: scan disagrees with qgen_tree_dispatch\n", name);
+        exit(1);
+    }
+
+    printf(
+        "%-24s records=%-8zu scan=%7.2f ns/op  loop=%7.2f ns/op  speedup=%.2fx\n",
+        name, instruction_count, best_scan * 1e9 / instruction_count, best_loop * 1e9 / instruction_count,
+        best_loop / best_scan
+    );
+
+    free(stream);
+    free(out);
+    free(expected);
+    qgen_free_tree(tree);
+    qgen_free_array_list(patterns);
+}
+
+// Hot swap: reader threads dispatch the same keys over and over while a writer keeps regenerating and publishing the
+// tree, either through a tree handle or behind a reader-writer lock.
+#define BENCH_SWAP_READERS 4
+
+typedef struct bench_swap bench_swap_t;
+
+typedef struct bench_swap_reader {
+    bench_swap_t *swap;
+    int index;
+} bench_swap_reader_t;
+
+struct bench_swap {
+    qgen_bitpattern_t *patterns;
+    const uint64_t *high, *low;
+    size_t key_count;
+    int passes;
+    intptr_t expected; // sum of the dispatch results over the keys
+    qgen_tree_handle_t *handle;
+    bench_rwlock_t lock;
+    qgen_otree_t *tree; // guarded by lock
+    volatile int done[BENCH_SWAP_READERS];
+    int bad;
+    size_t publishes;
+};
+
+static BENCH_THREAD_FN bench_swap_handle_reader(void *arg) {
+    bench_swap_t *swap = ((bench_swap_reader_t *) arg)->swap;
+    qgen_reader_t *reader = qgen_handle_register(swap->handle);
+    for (int pass = 0; pass < swap->passes; pass++) {
+        intptr_t sum = 0;
+        for (size_t i = 0; i < swap->key_count; i++) {
+            sum += qgen_reader_dispatch(reader, swap->high[i], swap->low[i]);
+        }
+        if (sum != swap->expected) swap->bad = 1;
+    }
+    qgen_handle_unregister(reader);
+    swap->done[((bench_swap_reader_t *) arg)->index] = 1;
+    return 0;
+}
+
+static BENCH_THREAD_FN bench_swap_lock_reader(void *arg) {
+    bench_swap_t *swap = ((bench_swap_reader_t *) arg)->swap;
+    for (int pass = 0; pass < swap->passes; pass++) {
+        intptr_t sum = 0;
+        for (size_t i = 0; i < swap->key_count; i++) {
+            bench_read_lock(&swap->lock);
+            sum += qgen_tree_dispatch(swap->tree, swap->high[i], swap->low[i]);
+            bench_read_unlock(&swap->lock);
+        }
+        if (sum != swap->expected) swap->bad = 1;
+    }
+    swap->done[((bench_swap_reader_t *) arg)->index] = 1;
+    return 0;
+}
+
+static void bench_swap_run(bench_swap_t *swap, int locked, double *elapsed) {
+    bench_thread_t threads[BENCH_SWAP_READERS];
+    bench_swap_reader_t args[BENCH_SWAP_READERS];
+    swap->publishes = 0;
+    double start = bench_now();
+    for (int t = 0; t < BENCH_SWAP_READERS; t++) {
+        swap->done[t] = 0;
+        args[t].swap = swap;
+        args[t].index = t;
+        if (bench_thread_start(&threads[t], locked ? bench_swap_lock_reader : bench_swap_handle_reader, &args[t]) != 0) {
+            perror("thread");
+            exit(1);
+        }
+    }
+    // The main thread is the writer until the readers are through
+    for (int t = 0; t < BENCH_SWAP_READERS; ) {
+        if (swap->done[t]) {
+            t++;
+            continue;
+        }
+        qgen_otree_t *tree = qgen_generate_tree(swap->patterns);
+        if (tree == NULL) {
+            perror("qgen_generate_tree");
+            exit(1);
+        }
+        if (locked) {
+            bench_write_lock(&swap->lock);
+            qgen_otree_t *old = swap->tree;
+            swap->tree = tree;
+            bench_write_unlock(&swap->lock);
+            qgen_free_tree(old);
+        } else if (qgen_handle_publish(swap->handle, tree) != 0) {
+            perror("qgen_handle_publish");
+            exit(1);
+        }
+        swap->publishes++;
+    }
+    for (int t = 0; t < BENCH_SWAP_READERS; t++) {
+        bench_thread_join(threads[t]);
+    }
+    *elapsed = bench_now() - start;
+}
+
+static void bench_swap(const char *name, size_t pattern_count, int width, size_t key_count, int passes) {
+    bench_swap_t swap = {0};
+    swap.patterns = bench_opcode_patterns(pattern_count, width);
+    uint64_t *high = malloc(key_count * sizeof(uint64_t));
+    uint64_t *low = malloc(key_count * sizeof(uint64_t));
+    bench_keys(swap.patterns, pattern_count, high, low, key_count);
+    swap.high = high;
+    swap.low = low;
+    swap.key_count = key_count;
+    swap.passes = passes;
+
+    swap.tree = qgen_generate_tree(swap.patterns);
+    qgen_otree_t *first = qgen_generate_tree(swap.patterns);
+    if (swap.tree == NULL || first == NULL) {
+        perror("qgen_generate_tree");
+        exit(1);
+    }
+    for (size_t i = 0; i < key_count; i++) swap.expected += qgen_tree_dispatch(swap.tree, high[i], low[i]);
+    swap.handle = qgen_new_tree_handle(first);
+    bench_rwlock_init(&swap.lock);
+
+    double locked_time, handle_time;
+    bench_swap_run(&swap, 1, &locked_time);
+    size_t locked_publishes = swap.publishes;
+    bench_swap_run(&swap, 0, &handle_time);
+    if (swap.bad) {
+        fprintf(stderr, "%s: a reader saw wrong results\n", name);
+        exit(1);
+    }
+    double dispatches = (double) BENCH_SWAP_READERS * passes * key_count;
+    printf(
+        "%-24s readers=%d  rwlock=%7.2f ns/op (%zu swaps)  handle=%7.2f ns/op (%zu swaps)  speedup=%.2fx\n",
+        name, BENCH_SWAP_READERS, locked_time * 1e9 / dispatches, locked_publishes, handle_time * 1e9 / dispatches,
+        swap.publishes, locked_time / handle_time
+    );
+
+    bench_rwlock_destroy(&swap.lock);
+    qgen_free_tree_handle(swap.handle);
+    qgen_free_tree(swap.tree);
+    free(high);
+    free(low);
+    qgen_free_array_list(swap.patterns);
+}
+
+// One line per corpus for tracking over time: build time, size, depth and dispatch throughput
+static void bench_corpus(const char *name, qgen_bitpattern_t *patterns, size_t pattern_count, size_t key_count, int rounds) {
+    double start = bench_now();
+    qgen_otree_t *tree = qgen_generate_tree(patterns);
+    double build_time = bench_now() - start;
+    qgen_tree_info_t info;
+    if (tree == NULL || qgen_tree_info(tree, &info) != 0) {
+        perror("qgen_generate_tree");
+        exit(1);
+    }
+
+    uint64_t *high = malloc(key_count * sizeof(uint64_t));
+    uint64_t *low = malloc(key_count * sizeof(uint64_t));
+    intptr_t *single = malloc(key_count * sizeof(intptr_t));
+    intptr_t *batch = malloc(key_count * sizeof(intptr_t));
+    bench_keys(patterns, pattern_count, high, low, key_count);
+    double best_single = bench_single(tree, high, low, single, key_count, rounds);
+    double best_batch = bench_batch(tree, high, low, batch, key_count, rounds);
+    if (memcmp(single, batch, key_count * sizeof(intptr_t)) != 0) {
+        fprintf(stderr, "%s: batched dispatch disagrees with qgen_tree_dispatch\n", name);
+        exit(1);
+    }
+
+    const char *format = bench_json
+        ? "{\"corpus\": \"%s\", \"patterns\": %zu, \"width\": %d, \"build_ms\": %.3f, \"nodes\": %llu, \"buckets\": %llu, "
+          "\"bytes\": %llu, \"avg_depth\": %.3f, \"max_depth\": %u, \"single_ns\": %.2f, \"batch_ns\": %.2f}\n"
+        : "%-24s patterns=%-7zu width=%-3d build=%8.2f ms  nodes=%-7llu buckets=%-7llu bytes=%-9llu "
+          "depth=%5.2f/%-3u single=%7.2f ns/op  batch=%7.2f ns/op\n";
+    printf(
+        format, name, pattern_count, (int) qgen_tree_max_width(tree), build_time * 1e3,
+        (unsigned long long) info.nodes, (unsigned long long) info.buckets, (unsigned long long) info.bytes,
+        info.average_depth, (unsigned) info.max_depth, best_single * 1e9 / key_count, best_batch * 1e9 / key_count
+    );
+
+    free(high);
+    free(low);
+    free(single);
+    free(batch);
+    qgen_free_tree(tree);
+    qgen_free_array_list(patterns);
+}
+
+// Split strategies on the same corpus: the greedy score against the cost model with growing lookahead
+static void bench_split(const char *name, qgen_bitpattern_t *patterns, size_t pattern_count, size_t key_count, int rounds) {
+    static const struct {
+        const char *label;
+        qgen_gen_options_t options;
+    } strategies[] = {
+        {"greedy", {.split = QGEN_SPLIT_GREEDY}},
+        {"cost", {.split = QGEN_SPLIT_COST}},
+        {"cost-la2", {.split = QGEN_SPLIT_COST, .lookahead = 2}},
+        {"cost-la3", {.split = QGEN_SPLIT_COST, .lookahead = 3}},
+    };
+    uint64_t *high = malloc(key_count * sizeof(uint64_t));
+    uint64_t *low = malloc(key_count * sizeof(uint64_t));
+    intptr_t *expected = malloc(key_count * sizeof(intptr_t));
+    intptr_t *out = malloc(key_count * sizeof(intptr_t));
+    bench_keys(patterns, pattern_count, high, low, key_count);
+
+    for (size_t s = 0; s < sizeof(strategies) / sizeof(strategies[0]); s++) {
+        double start = bench_now();
+        qgen_otree_t *tree = qgen_generate_tree_ex(patterns, &strategies[s].options);
+        double build_time = bench_now() - start;
+        qgen_tree_info_t info;
+        if (tree == NULL || qgen_tree_info(tree, &info) != 0) {
+            perror("qgen_generate_tree_ex");
+            exit(1);
+        }
+        double best = bench_single(tree, high, low, s == 0 ? expected : out, key_count, rounds);
+        if (s > 0 && memcmp(expected, out, key_count * sizeof(intptr_t)) != 0) {
+            fprintf(stderr, "%s: %s tree disagrees with the greedy one\n", name, strategies[s].label);
+            exit(1);
+        }
+        printf(
+            "%-24s %-9s build=%8.2f ms  nodes=%-7llu buckets=%-7llu bytes=%-9llu depth=%5.2f/%-3u single=%7.2f ns/op\n",
+            name, strategies[s].label, build_time * 1e3, (unsigned long long) info.nodes, (unsigned long long) info.buckets,
+            (unsigned long long) info.bytes, info.average_depth, (unsigned) info.max_depth, best * 1e9 / key_count
+        );
+        qgen_free_tree(tree);
+    }
+
+    free(high);
+    free(low);
+    free(expected);
+    free(out);
+    qgen_free_array_list(patterns);
+}
+
+// Generation against loading the same tree from the cache directory. The first cached call generates and stores the
+// tree unless an earlier run left it behind, the second one has to be a hit.
+static void bench_cache(const char *name, qgen_bitpattern_t *patterns, size_t pattern_count, const char *cache_dir, size_t key_count) {
+    double start = bench_now();
+    qgen_otree_t *generated = qgen_generate_tree(patterns);
+    double generate_time = bench_now() - start;
+    start = bench_now();
+    qgen_otree_t *first = qgen_generate_tree_cached(patterns, cache_dir);
+    double first_time = bench_now() - start;
+    qgen_cache_stats_t before, after;
+    qgen_cache_stats(&before);
+    start = bench_now();
+    qgen_otree_t *cached = qgen_generate_tree_cached(patterns, cache_dir);
+    double cached_time = bench_now() - start;
+    qgen_cache_stats(&after);
+    if (generated == NULL || first == NULL || cached == NULL) {
+        perror("qgen_generate_tree_cached");
+        exit(1);
+    }
+    if (after.hits != before.hits + 1) {
+        fprintf(stderr, "%s: second lookup missed the cache in %s\n", name, cache_dir);
+        exit(1);
+    }
+
+    uint64_t *high = malloc(key_count * sizeof(uint64_t));
+    uint64_t *low = malloc(key_count * sizeof(uint64_t));
+    bench_keys(patterns, pattern_count, high, low, key_count);
+    for (size_t i = 0; i < key_count; i++) {
+        if (qgen_tree_dispatch(generated, high[i], low[i]) != qgen_tree_dispatch(cached, high[i], low[i])) {
+            fprintf(stderr, "%s: cached tree disagrees with the generated one\n", name);
+            exit(1);
+        }
+    }
+
+    printf(
+        "%-24s patterns=%-7zu generate=%8.2f ms  first=%8.2f ms  cached=%8.2f ms  speedup=%.1fx\n",
+        name, pattern_count, generate_time * 1e3, first_time * 1e3, cached_time * 1e3, generate_time / cached_time
+    );
+
+    free(high);
+    free(low);
+    qgen_free_tree(generated);
+    qgen_free_tree(first);
+    qgen_free_tree(cached);
+    qgen_free_array_list(patterns);
+}
+
+// Generation order against the relaid out trees, same keys for all of them
+static void bench_layout(const char *name, qgen_bitpattern_t *patterns, size_t pattern_count, size_t key_count, int rounds) {
+    static const char *layout_names[] = {"generated", "breadth-first", "blocked"};
+    uint64_t *high = malloc(key_count * sizeof(uint64_t));
+    uint64_t *low = malloc(key_count * sizeof(uint64_t));
+    intptr_t *expected = malloc(key_count * sizeof(intptr_t));
+    intptr_t *out = malloc(key_count * sizeof(intptr_t));
+    bench_keys(patterns, pattern_count, high, low, key_count);
+
+    for (int layout = -1; layout <= QGEN_LAYOUT_BLOCKED; layout++) {
+        qgen_otree_t *tree = qgen_generate_tree(patterns);
+        qgen_sharing_t sharing;
+        if (tree == NULL || (layout >= 0 && qgen_tree_relayout(tree, layout) != 0) || qgen_tree_sharing(tree, &sharing) != 0) {
+            perror("qgen_tree_relayout");
+            exit(1);
+        }
+        double best_single = bench_single(tree, high, low, layout < 0 ? expected : out, key_count, rounds);
+        double best_batch = bench_batch(tree, high, low, out, key_count, rounds);
+        if (memcmp(expected, out, key_count * sizeof(intptr_t)) != 0) {
+            fprintf(stderr, "%s: %s layout disagrees with the generated tree\n", name, layout_names[layout + 1]);
+            exit(1);
+        }
+        printf(
+            "%-24s %-13s nodes=%-7llu single=%7.2f ns/op  batch=%7.2f ns/op\n",
+            name, layout_names[layout + 1], (unsigned long long) sharing.nodes,
+            best_single * 1e9 / key_count, best_batch * 1e9 / key_count
+        );
+        qgen_free_tree(tree);
+    }
+
+    free(high);
+    free(low);
+    free(expected);
+    free(out);
+    qgen_free_array_list(patterns);
+}
+
+// Jitted code against qgen_tree_dispatch on the generated tree. A layout of -1 keeps the generated order, otherwise
+// the tree is relaid out first; mapped saves the tree and compiles the read-only mapping of the file instead.
+static void bench_jit(const char *name, size_t pattern_count, int width, int layout, int mapped, size_t key_count, int rounds) {
+    qgen_bitpattern_t *patterns = bench_opcode_patterns(pattern_count, width);
+    qgen_otree_t *tree = qgen_generate_tree(patterns);
+    if (tree == NULL) {
+        perror("qgen_generate_tree");
+        exit(1);
+    }
+
+    uint64_t *high = malloc(key_count * sizeof(uint64_t));
+    uint64_t *low = malloc(key_count * sizeof(uint64_t));
+    intptr_t *expected = malloc(key_count * sizeof(intptr_t));
+    intptr_t *out = malloc(key_count * sizeof(intptr_t));
+    bench_keys(patterns, pattern_count, high, low, key_count);
+    // Fully random keys as well, mostly misses
+    for (size_t i = 0; i < key_count; i += 4) {
+        high[i] = bench_rand();
+        low[i] = bench_rand();
+    }
+    for (size_t i = 0; i < key_count; i++) {
+        expected[i] = qgen_tree_dispatch(tree, high[i], low[i]);
+    }
+
+    if (layout >= 0 && qgen_tree_relayout(tree, layout) != 0) {
+        perror("qgen_tree_relayout");
+        exit(1);
+    }
+    if (mapped) {
+        const char *filename = "qgen_bench_jit.qgt";
+        if (qgen_save_tree(tree, filename, QGEN_FILE_CHECKSUM_NONE) != 0) {
+            perror("qgen_save_tree");
+            exit(1);
+        }
+        qgen_free_tree(tree);
+        tree = qgen_map_tree(filename);
+        if (tree == NULL) {
+            perror("qgen_map_tree");
+            exit(1);
+        }
+        remove(filename);
+    }
+
+    double start = bench_now();
+    qgen_dispatch_fn_t fn = qgen_tree_jit(tree);
+    double jit_time = bench_now() - start;
+    if (fn == NULL) {
+        perror("qgen_tree_jit");
+        exit(1);
+    }
+
+    double best_single = bench_single(tree, high, low, out, key_count, rounds);
+    if (memcmp(expected, out, key_count * sizeof(intptr_t)) != 0) {
+        fprintf(stderr, "%s: tree disagrees with the generated one before jitting\n", name);
+        exit(1);
+    }
+    double best_jit = 1e30;
+    for (int r = 0; r < rounds; r++) {
+        start = bench_now();
+        for (size_t i = 0; i < key_count; i++) {
+            out[i] = fn(tree, high[i], low[i]);
+        }
+        double end = bench_now();
+        if (end - start < best_jit) best_jit = end - start;
+    }
+    if (memcmp(expected, out, key_count * sizeof(intptr_t)) != 0) {
+        fprintf(stderr, "%s: jitted code disagrees with qgen_tree_dispatch\n", name);
+        exit(1);
+    }
+
+    printf(
+        "%-24s patterns=%-7zu width=%-3d single=%7.2f ns/op  jit=%7.2f ns/op  speedup=%.2fx  compile=%8.2f ms\n",
+        name, pattern_count, width, best_single * 1e9 / key_count, best_jit * 1e9 / key_count,
+        best_single / best_jit, jit_time * 1e3
+    );
+
+    free(high);
+    free(low);
+    free(expected);
+    free(out);
+    qgen_free_tree(tree);
+    qgen_free_array_list(patterns);
+}
+
+int main(int argc, char **argv) {
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--json") == 0) {
+            bench_json = 1;
+        } else {
+            fprintf(stderr, "usage: %s [--json]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    size_t rv64_count;
+    qgen_bitpattern_t *rv64 = bench_rv64_patterns(&rv64_count);
+    bench_corpus("rv64ima", rv64, rv64_count, 1 << 20, 5);
+    bench_corpus("a64-like", bench_a64_patterns(1200), 1200, 1 << 20, 5);
+    bench_corpus("acl", bench_acl_patterns(2000, 32), 2000, 1 << 20, 5);
+    bench_corpus("dense-16", bench_wildcard_patterns(1000, 16, 5), 1000, 1 << 20, 5);
+    bench_corpus("dense-32", bench_wildcard_patterns(4000, 32, 5), 4000, 1 << 20, 5);
+    bench_corpus("dense-64", bench_wildcard_patterns(8000, 64, 5), 8000, 1 << 20, 5);
+    bench_corpus("dense-128", bench_wildcard_patterns(8000, 128, 5), 8000, 1 << 20, 5);
+    if (bench_json) return 0;
+
+    bench_dispatch("opcodes-small", 256, 32, 1 << 20, 5);
+    bench_dispatch("opcodes-medium", 4096, 32, 1 << 20, 5);
+    bench_dispatch("opcodes-large", 20000, 64, 1 << 20, 5);
+    bench_profile("profile-medium", 4096, 32, 1 << 20, 5);
+    bench_profile("profile-large", 20000, 64, 1 << 20, 5);
+    bench_generate("generate-large", 20000, 64, 1 << 16);
+    bench_generate("generate-huge", 200000, 96, 1 << 16);
+    bench_update("update-large", 20000, 64, 1000, 1 << 16);
+    bench_stats_long_bucket("stats-long-inserted", 20, 1);
+    bench_stats_long_bucket("stats-long-generated", 20, 20);
+    bench_load_corrupt("load-corrupt", 20000, 64, 1000, 1 << 16);
+    bench_sharing("acl-small", bench_acl_patterns(1000, 8), 1000, 1 << 16);
+    bench_sharing("acl-medium", bench_acl_patterns(1000, 32), 1000, 1 << 16);
+    bench_sharing("sparse-opcodes", bench_sparse_patterns(4096, 32, 8), 4096, 1 << 16);
+    bench_layout("layout-opcodes", bench_opcode_patterns(20000, 64), 20000, 1 << 20, 5);
+    bench_layout("layout-wildcard", bench_wildcard_patterns(8000, 64, 20), 8000, 1 << 20, 5);
+    bench_jit("jit-small", 256, 32, -1, 0, 1 << 20, 5);
+    bench_jit("jit-medium", 4096, 32, -1, 0, 1 << 20, 5);
+    bench_jit("jit-large", 20000, 64, -1, 0, 1 << 20, 5);
+    bench_jit("jit-wide-100", 8000, 100, -1, 0, 1 << 20, 5);
+    bench_jit("jit-wide-128", 8000, 128, -1, 0, 1 << 20, 5);
+    bench_jit("jit-breadth-first", 4096, 64, QGEN_LAYOUT_BREADTH_FIRST, 0, 1 << 20, 5);
+    bench_jit("jit-blocked", 4096, 128, QGEN_LAYOUT_BLOCKED, 0, 1 << 20, 5);
+    bench_jit("jit-mapped", 4096, 128, -1, 1, 1 << 20, 5);
+    bench_wide("wildcard-compact", 30000, 64, 1 << 18, 5);
+    bench_wide("wildcard-wide", 60000, 64, 1 << 18, 5);
+    bench_priority("acl-most-specific", 2000, 200, 1 << 20, 5);
+    bench_swap("swap-opcodes", 4096, 32, 1 << 18, 8);
+    bench_wide_keys("ipv6-5tuple", 4000, 1 << 20, 5);
+    bench_decode("rv64-decode", 1 << 20, 5);
+    bench_scan("rv64-stream", 1 << 20, 5);
+    bench_split("split-wildcard", bench_wildcard_patterns(2000, 64, 30), 2000, 1 << 18, 5);
+    bench_split("split-acl", bench_acl_patterns(1000, 32), 1000, 1 << 18, 5);
+    bench_cache("cache-wildcard", bench_wildcard_patterns(8000, 64, 20), 8000, "qgen_bench_cache", 1 << 16);
+    return 0;
+}
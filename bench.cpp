@@ -0,0 +1,136 @@
+// Benchmark and check of the compile time front end
+//
+// Build and run with `make bench-cpp`. The RV64 decoder set is generated by qgen.hpp during compilation and by
+// qgen_generate_tree at run time, the two trees have to agree node for node before the dispatches are timed.
+
+#include "qgen.hpp"
+#include "bench_rv64.h"
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+namespace {
+
+constexpr std::array<qgen_bitpattern_t, BENCH_RV64_COUNT> make_rv64_patterns() {
+    std::array<qgen_bitpattern_t, BENCH_RV64_COUNT> patterns{};
+    for (size_t i = 0; i < BENCH_RV64_COUNT; i++) {
+        patterns[i].width = 32;
+        patterns[i].mask_low = bench_rv64_encodings[i][1];
+        patterns[i].active_low = bench_rv64_encodings[i][0];
+    }
+    return patterns;
+}
+
+constexpr std::array<qgen_bitpattern_t, BENCH_RV64_COUNT> rv64_patterns = make_rv64_patterns();
+using rv64_tree = qgen::tree<rv64_patterns>;
+
+uint64_t bench_rng_state = 0x9E3779B97F4A7C15ULL;
+
+uint64_t bench_rand() {
+    // xorshift64*, same as bench.c
+    bench_rng_state ^= bench_rng_state >> 12;
+    bench_rng_state ^= bench_rng_state << 25;
+    bench_rng_state ^= bench_rng_state >> 27;
+    return bench_rng_state * 0x2545F4914F6CDD1DULL;
+}
+
+double bench_now() {
+    return std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+[[noreturn]] void bench_fail(const char *what) {
+    std::fprintf(stderr, "rv64-constexpr: %s\n", what);
+    std::exit(1);
+}
+
+// Nodes, tables, bucket ID lists and aligned patterns against the runtime generator
+void bench_compare(qgen_otree_t *tree) {
+    const auto &data = rv64_tree::data;
+    if (tree->width != data.width) bench_fail("width differs");
+    if (tree->node_count != data.nodes.size()) bench_fail("node count differs");
+    for (size_t i = 0; i < data.nodes.size(); i++) {
+        if (tree->nodes[i] != data.nodes[i]) bench_fail("nodes differ");
+    }
+    if (tree->table_length != data.tables.size()) bench_fail("table length differs");
+    for (size_t i = 0; i < data.tables.size(); i++) {
+        if (tree->tables[i] != data.tables[i]) bench_fail("tables differ");
+    }
+    if (tree->bucket_count != rv64_tree::buckets.size()) bench_fail("bucket count differs");
+    for (size_t b = 0; b < rv64_tree::buckets.size(); b++) {
+        const qgen_bucket_t &bucket = rv64_tree::buckets[b];
+        if (tree->buckets[b].pattern_count != bucket.pattern_count) bench_fail("bucket lengths differ");
+        for (size_t i = 0; i < bucket.pattern_count; i++) {
+            if (tree->buckets[b].pattern_ids[i] != bucket.pattern_ids[i]) bench_fail("bucket pattern IDs differ");
+        }
+    }
+    if (tree->pattern_count != data.patterns.size()) bench_fail("pattern count differs");
+    for (size_t i = 0; i < data.patterns.size(); i++) {
+        const qgen_bitpattern_t &a = tree->patterns[i], &b = data.patterns[i];
+        if (a.mask_low != b.mask_low || a.mask_high != b.mask_high || a.active_low != b.active_low || a.active_high != b.active_high) {
+            bench_fail("aligned patterns differ");
+        }
+    }
+}
+
+template <typename Dispatch>
+double bench_time(Dispatch dispatch, const uint64_t *keys, intptr_t *out, size_t n, int rounds) {
+    double best = 1e30;
+    for (int r = 0; r < rounds; r++) {
+        double start = bench_now();
+        for (size_t i = 0; i < n; i++) {
+            out[i] = dispatch(keys[i]);
+        }
+        double end = bench_now();
+        if (end - start < best) best = end - start;
+    }
+    return best;
+}
+
+} // namespace
+
+int main() {
+    qgen_bitpattern_t *patterns = (qgen_bitpattern_t *) qgen_new_array_list(BENCH_RV64_COUNT, sizeof(qgen_bitpattern_t));
+    for (qgen_bitpattern_t bp : rv64_patterns) {
+        qgen_al_push((void **) &patterns, &bp);
+    }
+    qgen_otree_t *tree = qgen_generate_tree(patterns);
+    if (tree == NULL) {
+        std::perror("qgen_generate_tree");
+        return 1;
+    }
+    bench_compare(tree);
+
+    // Encodings of random instructions with random operands, one in four keys is random and mostly a miss
+    const size_t key_count = 1 << 20;
+    const int rounds = 5;
+    uint64_t *keys = (uint64_t *) std::malloc(key_count * sizeof(uint64_t));
+    intptr_t *expected = (intptr_t *) std::malloc(key_count * sizeof(intptr_t));
+    intptr_t *out = (intptr_t *) std::malloc(key_count * sizeof(intptr_t));
+    for (size_t i = 0; i < key_count; i++) {
+        const uint32_t *encoding = bench_rv64_encodings[bench_rand() % BENCH_RV64_COUNT];
+        uint32_t operands = (uint32_t) bench_rand();
+        keys[i] = i % 4 == 0 ? operands : (operands & ~encoding[1]) | encoding[0];
+    }
+
+    double runtime = bench_time([&](uint64_t key) { return qgen_tree_dispatch(tree, 0, key); }, keys, expected, key_count, rounds);
+    double inlined = bench_time([](uint64_t key) { return rv64_tree::dispatch(0, key); }, keys, out, key_count, rounds);
+    if (std::memcmp(expected, out, key_count * sizeof(intptr_t)) != 0) bench_fail("inlined dispatch disagrees with qgen_tree_dispatch");
+    qgen_otree_t view = rv64_tree::view();
+    double viewed = bench_time([&](uint64_t key) { return qgen_tree_dispatch(&view, 0, key); }, keys, out, key_count, rounds);
+    if (std::memcmp(expected, out, key_count * sizeof(intptr_t)) != 0) bench_fail("view disagrees with qgen_tree_dispatch");
+
+    std::printf(
+        "%-24s patterns=%-7zu nodes=%-7zu dispatch=%7.2f ns/op  view=%7.2f ns/op  inlined=%7.2f ns/op  speedup=%.2fx\n",
+        "rv64-constexpr", (size_t) BENCH_RV64_COUNT, rv64_tree::data.nodes.size(), runtime * 1e9 / key_count,
+        viewed * 1e9 / key_count, inlined * 1e9 / key_count, runtime / inlined
+    );
+
+    std::free(keys);
+    std::free(expected);
+    std::free(out);
+    qgen_free_tree(tree);
+    qgen_free_array_list(patterns);
+    return 0;
+}
@@ -0,0 +1,59 @@
+// RV64 decoder corpus shared by bench.c and bench.cpp
+
+#ifndef BENCH_RV64_H
+#define BENCH_RV64_H
+
+#include <stdint.h>
+
+// constexpr in C++ so bench.cpp can build its tree from the table at compile time
+#ifdef __cplusplus
+#define BENCH_RV64_CONST static constexpr
+#else
+#define BENCH_RV64_CONST static const
+#endif
+
+// RV64IMA plus the privileged instructions, {match, mask} as in the RISC-V opcode tables
+BENCH_RV64_CONST uint32_t bench_rv64_encodings[][2] = {
+    // lui, auipc, jal, jalr
+    {0x00000037, 0x0000007f}, {0x00000017, 0x0000007f}, {0x0000006f, 0x0000007f}, {0x00000067, 0x0000707f},
+    // branches
+    {0x00000063, 0x0000707f}, {0x00001063, 0x0000707f}, {0x00004063, 0x0000707f}, {0x00005063, 0x0000707f},
+    {0x00006063, 0x0000707f}, {0x00007063, 0x0000707f},
+    // loads and stores
+    {0x00000003, 0x0000707f}, {0x00001003, 0x0000707f}, {0x00002003, 0x0000707f}, {0x00003003, 0x0000707f},
+    {0x00004003, 0x0000707f}, {0x00005003, 0x0000707f}, {0x00006003, 0x0000707f},
+    {0x00000023, 0x0000707f}, {0x00001023, 0x0000707f}, {0x00002023, 0x0000707f}, {0x00003023, 0x0000707f},
+    // immediate arithmetic, shifts by 6-bit amounts
+    {0x00000013, 0x0000707f}, {0x00002013, 0x0000707f}, {0x00003013, 0x0000707f}, {0x00004013, 0x0000707f},
+    {0x00006013, 0x0000707f}, {0x00007013, 0x0000707f},
+    {0x00001013, 0xfc00707f}, {0x00005013, 0xfc00707f}, {0x40005013, 0xfc00707f},
+    // register arithmetic
+    {0x00000033, 0xfe00707f}, {0x40000033, 0xfe00707f}, {0x00001033, 0xfe00707f}, {0x00002033, 0xfe00707f},
+    {0x00003033, 0xfe00707f}, {0x00004033, 0xfe00707f}, {0x00005033, 0xfe00707f}, {0x40005033, 0xfe00707f},
+    {0x00006033, 0xfe00707f}, {0x00007033, 0xfe00707f},
+    // 32-bit arithmetic
+    {0x0000001b, 0x0000707f}, {0x0000101b, 0xfe00707f}, {0x0000501b, 0xfe00707f}, {0x4000501b, 0xfe00707f},
+    {0x0000003b, 0xfe00707f}, {0x4000003b, 0xfe00707f}, {0x0000103b, 0xfe00707f}, {0x0000503b, 0xfe00707f},
+    {0x4000503b, 0xfe00707f},
+    // fences and system
+    {0x0000000f, 0x0000707f}, {0x0000100f, 0x0000707f}, {0x00000073, 0xffffffff}, {0x00100073, 0xffffffff},
+    {0x30200073, 0xffffffff}, {0x10200073, 0xffffffff}, {0x10500073, 0xffffffff}, {0x12000073, 0xfe007fff},
+    {0x00001073, 0x0000707f}, {0x00002073, 0x0000707f}, {0x00003073, 0x0000707f}, {0x00005073, 0x0000707f},
+    {0x00006073, 0x0000707f}, {0x00007073, 0x0000707f},
+    // multiply and divide
+    {0x02000033, 0xfe00707f}, {0x02001033, 0xfe00707f}, {0x02002033, 0xfe00707f}, {0x02003033, 0xfe00707f},
+    {0x02004033, 0xfe00707f}, {0x02005033, 0xfe00707f}, {0x02006033, 0xfe00707f}, {0x02007033, 0xfe00707f},
+    {0x0200003b, 0xfe00707f}, {0x0200403b, 0xfe00707f}, {0x0200503b, 0xfe00707f}, {0x0200603b, 0xfe00707f},
+    {0x0200703b, 0xfe00707f},
+    // atomics, word then doubleword
+    {0x1000202f, 0xf9f0707f}, {0x1800202f, 0xf800707f}, {0x0800202f, 0xf800707f}, {0x0000202f, 0xf800707f},
+    {0x2000202f, 0xf800707f}, {0x6000202f, 0xf800707f}, {0x4000202f, 0xf800707f}, {0x8000202f, 0xf800707f},
+    {0xa000202f, 0xf800707f}, {0xc000202f, 0xf800707f}, {0xe000202f, 0xf800707f},
+    {0x1000302f, 0xf9f0707f}, {0x1800302f, 0xf800707f}, {0x0800302f, 0xf800707f}, {0x0000302f, 0xf800707f},
+    {0x2000302f, 0xf800707f}, {0x6000302f, 0xf800707f}, {0x4000302f, 0xf800707f}, {0x8000302f, 0xf800707f},
+    {0xa000302f, 0xf800707f}, {0xc000302f, 0xf800707f}, {0xe000302f, 0xf800707f},
+};
+
+#define BENCH_RV64_COUNT (sizeof(bench_rv64_encodings) / sizeof(bench_rv64_encodings[0]))
+
+#endif
@@ -4,69 +4,258 @@
 #include <string.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <errno.h>
+#include <assert.h>
 
-qgen_bitpattern_t qgen_str2bp(size_t length, const char *pattern) {
-    qgen_bitpattern_t bp = {0};
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
 
-    for (size_t i = 0; i < length; i++) {
-        int u64_pos = bp.width >= 64; // 1 for high 64 bits, 0 for low 64 bits
-
-        switch (pattern[i]) {
-            case '1':
-                // Set both active and mask bits
-                if (u64_pos) {
-                    bp.active_high <<= 1;
-                    bp.mask_high <<= 1;
-                    bp.active_high |= bp.active_low >> 63;
-                    bp.mask_high |= bp.mask_low >> 63;
-                }
-                bp.active_low <<= 1;
-                bp.mask_low <<= 1;
+// Minimal threading layer for the parallel generator
+#ifdef _WIN32
+typedef HANDLE qgen_thread_t;
+typedef SRWLOCK qgen_mutex_t;
+typedef CONDITION_VARIABLE qgen_cond_t;
+#define qgen_mutex_init(m) InitializeSRWLock(m)
+#define qgen_mutex_destroy(m) ((void) (m))
+#define qgen_mutex_lock(m) AcquireSRWLockExclusive(m)
+#define qgen_mutex_unlock(m) ReleaseSRWLockExclusive(m)
+#define qgen_cond_init(c) InitializeConditionVariable(c)
+#define qgen_cond_destroy(c) ((void) (c))
+#define qgen_cond_wait(c, m) SleepConditionVariableSRW((c), (m), INFINITE, 0)
+#define qgen_cond_broadcast(c) WakeAllConditionVariable(c)
+#define qgen_thread_start(t, fn, arg) ((*(t) = CreateThread(NULL, 0, (fn), (arg), 0, NULL)) == NULL)
+#define qgen_thread_join(t) (WaitForSingleObject((t), INFINITE), CloseHandle(t))
+#else
+#include <pthread.h>
+typedef pthread_t qgen_thread_t;
+typedef pthread_mutex_t qgen_mutex_t;
+typedef pthread_cond_t qgen_cond_t;
+#define qgen_mutex_init(m) pthread_mutex_init((m), NULL)
+#define qgen_mutex_destroy(m) pthread_mutex_destroy(m)
+#define qgen_mutex_lock(m) pthread_mutex_lock(m)
+#define qgen_mutex_unlock(m) pthread_mutex_unlock(m)
+#define qgen_cond_init(c) pthread_cond_init((c), NULL)
+#define qgen_cond_destroy(c) pthread_cond_destroy(c)
+#define qgen_cond_wait(c, m) pthread_cond_wait((c), (m))
+#define qgen_cond_broadcast(c) pthread_cond_broadcast(c)
+#define qgen_thread_start(t, fn, arg) pthread_create((t), NULL, (fn), (arg))
+#define qgen_thread_join(t) pthread_join((t), NULL)
+#endif
 
-                bp.active_low |= 1;
-                bp.mask_low |= 1;
-                break;
-            case '0':
-                // Set only the MASK bit (active bit remains 0 from initialization)
-                if (u64_pos) {
-                    bp.active_high <<= 1;
-                    bp.mask_high <<= 1;
-                    bp.active_high |= bp.active_low >> 63;
-                    bp.mask_high |= bp.mask_low >> 63;
-                }
-                bp.active_low <<= 1;
-                bp.mask_low <<= 1;
-                
-                bp.mask_low |= 1;
-                break;
-            case 'x':
-            case 'X':
-            case '*':
-                if (u64_pos) {
-                    bp.active_high <<= 1;
-                    bp.mask_high <<= 1;
-                    bp.active_high |= bp.active_low >> 63;
-                    bp.mask_high |= bp.mask_low >> 63;
-                }
-                bp.active_low <<= 1;
-                bp.mask_low <<= 1;
-                break;
-            default: 
-                // Ignored other characters (including '\0')
-                continue;
+// Acquire/release accesses for the tree handle, plain loads and stores on x86 and never a read-modify-write.
+// qgen_atomic_inc is only used for counters off the dispatch path.
+#if defined(_MSC_VER) && defined(_M_ARM64)
+// /volatile:iso is the default on ARM64, so volatile accesses have no ordering there. Every use is 64 bits wide,
+// pointer loads are cast back at the call site.
+#include <intrin.h>
+#define qgen_load_acquire(p) __ldar64((unsigned __int64 volatile *) (p))
+#define qgen_store_release(p, v) __stlr64((unsigned __int64 volatile *) (p), (unsigned __int64) (v))
+#define qgen_fence() MemoryBarrier()
+#define qgen_atomic_inc(p) InterlockedIncrement64((volatile LONG64 *) (p))
+#elif defined(_MSC_VER)
+// volatile accesses are acquire/release with /volatile:ms, the default for x86 and x64
+#define qgen_load_acquire(p) (*(p))
+#define qgen_store_release(p, v) (*(p) = (v))
+#define qgen_fence() MemoryBarrier()
+#define qgen_atomic_inc(p) InterlockedIncrement64((volatile LONG64 *) (p))
+#else
+#define qgen_load_acquire(p) __atomic_load_n((p), __ATOMIC_ACQUIRE)
+#define qgen_store_release(p, v) __atomic_store_n((p), (v), __ATOMIC_RELEASE)
+#define qgen_fence() __atomic_thread_fence(__ATOMIC_SEQ_CST)
+#define qgen_atomic_inc(p) __atomic_add_fetch((p), 1, __ATOMIC_RELAXED)
+#endif
+
+// Hides a value from the optimizer so it can't be replaced by an equal one the code has to wait for
+#if defined(__GNUC__) || defined(__clang__)
+#define QGEN_OPAQUE(x) __asm__("" : "+r"(x))
+#else
+#define QGEN_OPAQUE(x) ((void) (x))
+#endif
+
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86)
+#define QGEN_X86
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#define QGEN_TARGET(isa)
+#else
+#define QGEN_TARGET(isa) __attribute__((target(isa)))
+#endif
+#endif
+
+static inline unsigned qgen_log2_floor64(uint64_t x) {
+#ifdef _MSC_VER
+    unsigned long idx;
+    _BitScanReverse64(&idx, x);
+    return (unsigned) idx;
+#else
+    return 63 - (unsigned) __builtin_clzll(x);
+#endif
+}
+
+static inline unsigned qgen_ctz32(uint32_t x) {
+#ifdef _MSC_VER
+    unsigned long idx;
+    _BitScanForward(&idx, x);
+    return (unsigned) idx;
+#else
+    return (unsigned) __builtin_ctz(x);
+#endif
+}
+
+static inline unsigned qgen_popcount64(uint64_t x) {
+#ifdef _MSC_VER
+    // __popcnt64 needs POPCNT support, which MSVC doesn't check for
+    x = x - ((x >> 1) & 0x5555555555555555ULL);
+    x = (x & 0x3333333333333333ULL) + ((x >> 2) & 0x3333333333333333ULL);
+    x = (x + (x >> 4)) & 0x0F0F0F0F0F0F0F0FULL;
+    return (unsigned) ((x * 0x0101010101010101ULL) >> 56);
+#else
+    return (unsigned) __builtin_popcountll(x);
+#endif
+}
+
+static FILE *qgen_fopen(const char *filename, const char *mode) {
+#ifdef _MSC_VER
+    FILE *f = NULL;
+    errno = fopen_s(&f, filename, mode);
+    return f;
+#else
+    return fopen(filename, mode);
+#endif
+}
+
+static inline int qgen_is_bit_char(char c) {
+    return c == '0' || c == '1' || c == 'x' || c == 'X' || c == '*';
+}
+
+static inline int qgen_is_name_char(char c, int first) {
+    return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || c == '_' || (!first && c >= '0' && c <= '9');
+}
+
+// Length of the field token starting at pattern[i], 0 if there is none there. *bits gets its width. A name made of
+// bit characters only, like xx or x01, stays a run of bits so that "xxxx:0101" keeps parsing as 8 bits.
+static size_t qgen_field_token(const char *pattern, size_t length, size_t i, size_t *bits) {
+    size_t j = i;
+    int named = 0;
+    for (; j < length && qgen_is_name_char(pattern[j], j == i); j++) named |= !qgen_is_bit_char(pattern[j]);
+    if (!named || j >= length || pattern[j] != ':') return 0;
+    size_t k = j + 1, n = 0;
+    while (k < length && pattern[k] >= '0' && pattern[k] <= '9') {
+        if (n <= QGEN_KEY_MAX_BITS) n = n * 10 + (size_t) (pattern[k] - '0');
+        k++;
+    }
+    if (k == j + 1 || n == 0) return 0;
+    *bits = n;
+    return k - i;
+}
+
+// Field a token belongs to, appended on first use. NULL once every slot is taken.
+static qgen_field_t *qgen_field_slot(qgen_fields_t *fields, const char *name, size_t name_length) {
+    if (name_length >= QGEN_FIELD_NAME_MAX) name_length = QGEN_FIELD_NAME_MAX - 1;
+    for (uint32_t f = 0; f < fields->count; f++) {
+        if (strncmp(fields->fields[f].name, name, name_length) == 0 && fields->fields[f].name[name_length] == '\0') {
+            return &fields->fields[f];
+        }
+    }
+    if (fields->count >= QGEN_MAX_FIELDS) return NULL;
+    qgen_field_t *field = &fields->fields[fields->count++];
+    memset(field, 0, sizeof(*field));
+    memcpy(field->name, name, name_length);
+    return field;
+}
+
+// Parses a pattern string into mask and value words, word 0 is the lowest. The first character is the most
+// significant bit, so the width is counted before any bit is placed. Returns the width.
+static size_t qgen_parse_pattern(size_t length, const char *pattern, size_t max_width, uint64_t *mask, uint64_t *active, qgen_fields_t *fields) {
+    size_t width = 0, bits = 0;
+    for (size_t i = 0; i < length && width < max_width; ) {
+        size_t token = qgen_field_token(pattern, length, i, &bits);
+        if (token) {
+            width += bits < max_width - width ? bits : max_width - width;
+            i += token;
+            continue;
         }
-        bp.width++;
+        if (qgen_is_bit_char(pattern[i])) width++;
+        i++;
+    }
 
-        // Safety check for bit width
-        if (bp.width >= 128) break;
+    size_t bit = width;
+    for (size_t i = 0; i < length && bit > 0; ) {
+        size_t token = qgen_field_token(pattern, length, i, &bits);
+        if (token) {
+            size_t name_length = 0;
+            while (pattern[i + name_length] != ':') name_length++;
+            qgen_field_t *field = fields ? qgen_field_slot(fields, &pattern[i], name_length) : NULL;
+            for (size_t b = 0; b < bits && bit > 0; b++) {
+                bit--;
+                // A field holds 64 bits, longer ones keep their low end
+                if (field && b + 64 >= bits) {
+                    if (bit >= 64) field->mask_high |= 1ULL << (bit - 64);
+                    else field->mask_low |= 1ULL << bit;
+                }
+            }
+            i += token;
+            continue;
+        }
+        char c = pattern[i++];
+        if (!qgen_is_bit_char(c)) continue;
+        bit--;
+        if (c == '0' || c == '1') mask[bit >> 6] |= 1ULL << (bit & 63);
+        if (c == '1') active[bit >> 6] |= 1ULL << (bit & 63);
     }
+    return width;
+}
+
+qgen_bitpattern_t qgen_str2bp_fields(size_t length, const char *pattern, qgen_fields_t *fields) {
+    qgen_bitpattern_t bp = {0};
+    uint64_t mask[2] = {0}, active[2] = {0};
+    if (fields) memset(fields, 0, sizeof(*fields));
+    bp.width = (uint8_t) qgen_parse_pattern(length, pattern, 128, mask, active, fields);
+    bp.mask_low = mask[0];
+    bp.mask_high = mask[1];
+    bp.active_low = active[0];
+    bp.active_high = active[1];
     return bp;
 }
 
+qgen_bitpattern_t qgen_strz2bp_fields(const char *pattern, qgen_fields_t *fields) {
+    return qgen_str2bp_fields(strlen(pattern), pattern, fields);
+}
+
+qgen_bitpattern_t qgen_str2bp(size_t length, const char *pattern) {
+    return qgen_str2bp_fields(length, pattern, NULL);
+}
+
 qgen_bitpattern_t qgen_strz2bp(const char *pattern) {
     return qgen_str2bp(strlen(pattern), pattern);
 }
 
+qgen_wide_pattern_t qgen_str2wp(size_t length, const char *pattern) {
+    qgen_wide_pattern_t wp = {0};
+    wp.width = (uint16_t) qgen_parse_pattern(length, pattern, QGEN_KEY_MAX_BITS, wp.mask, wp.active, NULL);
+    return wp;
+}
+
+qgen_wide_pattern_t qgen_strz2wp(const char *pattern) {
+    return qgen_str2wp(strlen(pattern), pattern);
+}
+
+void qgen_prioritize_specific(qgen_bitpattern_t *patterns) {
+    for (size_t i = 0; i < QGEN_ARRAY_HEADER(patterns)->length; i++) {
+        uint16_t fixed = 0;
+        for (uint64_t m = patterns[i].mask_low; m; m &= m - 1) fixed++;
+        for (uint64_t m = patterns[i].mask_high; m; m &= m - 1) fixed++;
+        patterns[i].priority = fixed;
+    }
+}
+
 void *qgen_new_array_list(size_t initial_capacity, size_t elem_size) {
     qgen_array_list_t *al = malloc(sizeof(qgen_array_list_t) + initial_capacity * elem_size);
     if (al == NULL) return NULL;
@@ -79,10 +268,12 @@ void *qgen_new_array_list(size_t initial_capacity, size_t elem_size) {
 int qgen_al_push(void **arr, void *item) {
     qgen_array_list_t *al = QGEN_ARRAY_HEADER(*arr);
     if (al->length >= al->capacity) {
-        al->capacity = al->capacity * 2 + 1;
-        void *new_arr = realloc(al, sizeof(qgen_array_list_t) + al->capacity * al->elem_size);
+        size_t capacity = al->capacity * 2 + 1;
+        qgen_array_list_t *new_arr = realloc(al, sizeof(qgen_array_list_t) + capacity * al->elem_size);
         if (new_arr == NULL) return errno = ENOMEM;
-        *arr = &((qgen_array_list_t *)new_arr)[1];
+        al = new_arr;
+        al->capacity = capacity;
+        *arr = &al[1];
     }
     uint8_t *dest = &((uint8_t *) *arr)[al->elem_size * (al->length++)];
     memcpy(dest, item, al->elem_size);
@@ -107,19 +298,100 @@ void qgen_free_array_list(void *arr) {
     free(al);
 }
 
+// ---- Arena ----
+
+#define QGEN_ARENA_CHUNK_SIZE 0x10000
+
+static void *qgen_arena_alloc(qgen_arena_t *arena, size_t size) {
+    size = (size + 7) & ~(size_t) 7;
+    qgen_arena_chunk_t *chunk = arena->head;
+    if (chunk == NULL || chunk->size - chunk->used < size) {
+        size_t chunk_size = size > QGEN_ARENA_CHUNK_SIZE ? size : QGEN_ARENA_CHUNK_SIZE;
+        if (arena->spare && arena->spare->size >= chunk_size) {
+            chunk = arena->spare;
+            arena->spare = NULL;
+        } else {
+            chunk = malloc(sizeof(qgen_arena_chunk_t) + chunk_size);
+            if (chunk == NULL) return NULL;
+            chunk->size = chunk_size;
+        }
+        chunk->prev = arena->head;
+        chunk->used = 0;
+        arena->head = chunk;
+    }
+    void *ptr = (uint8_t *) &chunk[1] + chunk->used;
+    chunk->used += size;
+    return ptr;
+}
+
+static qgen_arena_mark_t qgen_arena_mark(qgen_arena_t *arena) {
+    return (qgen_arena_mark_t) {
+        .chunk = arena->head,
+        .used = arena->head ? arena->head->used : 0,
+    };
+}
+
+// Frees everything allocated since mark was taken
+static void qgen_arena_release(qgen_arena_t *arena, qgen_arena_mark_t mark) {
+    while (arena->head != mark.chunk) {
+        qgen_arena_chunk_t *chunk = arena->head;
+        arena->head = chunk->prev;
+        if (arena->spare == NULL || arena->spare->size < chunk->size) {
+            free(arena->spare);
+            arena->spare = chunk;
+        } else {
+            free(chunk);
+        }
+    }
+    if (arena->head) arena->head->used = mark.used;
+}
+
+static void qgen_arena_free(qgen_arena_t *arena) {
+    qgen_arena_release(arena, (qgen_arena_mark_t) {0});
+    free(arena->spare);
+    arena->spare = NULL;
+}
+
 void qgen_find_cared_bits(qgen_otree_gen_t *tree) {
-    tree->mask_low = 0;
-    tree->mask_high = 0;
+    memset(tree->mask, 0, sizeof(tree->mask));
     for (size_t i = 0; i < tree->tree.pattern_count; i++) {
-        tree->mask_high |= tree->tree.patterns[i].mask_high;
-        tree->mask_low |= tree->tree.patterns[i].mask_low;
+        if (tree->tree.flags & QGEN_TREE_WIDE) {
+            for (int w = 0; w < QGEN_KEY_MAX_WORDS; w++) {
+                tree->mask[w] |= tree->tree.wide_patterns[i].mask[w];
+            }
+            continue;
+        }
+        tree->mask[1] |= tree->tree.patterns[i].mask_high;
+        tree->mask[0] |= tree->tree.patterns[i].mask_low;
     }
 }
 
-#define QGEN_BUCKET_MAX_LENGTH 16
+static void qgen_unmap_file(uint8_t *mapping, size_t size);
+static void qgen_discard_leaves(qgen_otree_t *tree);
+static void qgen_discard_jit(qgen_otree_t *tree);
 
 // Helper to free lists INSIDE buckets if we have to abort generation
 void qgen_discard_partial_tree(qgen_otree_t *tree) {
+    free(tree->parents);
+    tree->parents = NULL;
+    qgen_discard_jit(tree);
+    if (tree->flags & QGEN_TREE_MAPPED) {
+        // Everything points into the mapping
+        qgen_unmap_file(tree->mapping, tree->mapping_size);
+        tree->mapping = NULL;
+        tree->nodes = NULL;
+        tree->patterns = NULL;
+        tree->file_buckets = NULL;
+        tree->tables = NULL;
+        tree->flags &= ~QGEN_TREE_MAPPED;
+        qgen_discard_leaves(tree);
+        return;
+    }
+    if (tree->flags & QGEN_TREE_COMPACT) {
+        // Everything but the frozen leaves goes away with the tree itself
+        qgen_discard_leaves(tree);
+        return;
+    }
     if (tree->buckets) {
         for (size_t i = 0; i < tree->bucket_count; i++) {
             if (tree->buckets[i].pattern_ids) {
@@ -133,301 +405,3995 @@ void qgen_discard_partial_tree(qgen_otree_t *tree) {
         free(tree->nodes);
         tree->nodes = NULL;
     }
-}
-
-int qgen_generate_tree_helper(qgen_otree_gen_t *gentree, size_t *patterns) {
-    int err = 0;
-    qgen_otree_t *tree = &gentree->tree;
-    qgen_array_list_t *patterns_head = QGEN_ARRAY_HEADER(patterns);
-    if (patterns_head->length <= QGEN_BUCKET_MAX_LENGTH) {
-        if (tree->bucket_count >= gentree->bucket_capacity) {
-            gentree->bucket_capacity = gentree->bucket_capacity * 2 + 1;
-            qgen_bucket_t *new_buckets = realloc(tree->buckets, sizeof(qgen_bucket_t) * gentree->bucket_capacity);
-            if (new_buckets == NULL) {
-                qgen_free_array_list(patterns);
-                return errno = ENOMEM;
-            }
-            tree->buckets = new_buckets;
-        }
-        size_t bucket_id = tree->bucket_count;
-        tree->buckets[tree->bucket_count++] = (qgen_bucket_t) {
-            .pattern_count = patterns_head->length,
-            .pattern_ids = patterns,
-        };
-        if (tree->node_count >= gentree->node_capacity) {
-            gentree->node_capacity = gentree->node_capacity * 2 + 1;
-            qgen_otree_node_t *new_nodes = realloc(tree->nodes, sizeof(qgen_otree_node_t) * gentree->node_capacity);
-            if (new_nodes == NULL) return errno = ENOMEM;
-            tree->nodes = new_nodes;
-        }
-        tree->nodes[tree->node_count++] = QGEN_NODE_LEAF(patterns_head->length, bucket_id);
-        return 0;
+    if (tree->tables) {
+        free(tree->tables);
+        tree->tables = NULL;
     }
+    qgen_discard_leaves(tree);
+}
 
-    size_t *zero_patterns = qgen_new_array_list(patterns_head->length, sizeof(*patterns));
-    size_t *one_patterns = qgen_new_array_list(patterns_head->length, sizeof(*patterns));
-
-    uint64_t best_bit_idx = -1;
-    uint64_t gini_nom = 0xffffffffffffffffULL;
-    uint64_t gini_denom = 1;
-    for (uint64_t bit_idx = 0; bit_idx < tree->width; bit_idx++) {
-        uint64_t low_mask = 0;
-        uint64_t high_mask = 0;
-
-        if (bit_idx >= 64) {
-            high_mask = 1ULL << (bit_idx - 64);
-            // Skip if NO pattern cares about it
-            if (!(gentree->mask_high & high_mask)) continue;
-        } else {
-            low_mask = 1ULL << bit_idx;
-            // Skip if NO pattern cares about it
-            if (!(gentree->mask_low & low_mask)) continue;
-        }
-
-        uint64_t n0 = 0; // qgen_pat(0)
-        uint64_t n1 = 0; // qgen_pat(1)
-
-        for (size_t p = 0; p < patterns_head->length; p++) {
-            qgen_bitpattern_t *pat = &tree->patterns[patterns[p]];
-
-            // Check if this pattern CARES about the bit (mask is 1)
-            int cares = bit_idx >= 64 ? (pat->mask_high & high_mask) : (pat->mask_low & low_mask);
-
-            if (cares) {
-                int is_one = bit_idx >= 64 ? (pat->active_high & high_mask) : (pat->active_low & low_mask);
-                if (is_one) n1++;
-                else n0++;
-            }
-        }
-
-        uint64_t cur_nom = n0 + n1;
-        if (cur_nom == 0) continue;
-        uint64_t cur_denom = n0 * n1;
-        if (cur_nom * gini_denom < gini_nom * cur_denom) {
-            gini_nom = cur_nom;
-            gini_denom = cur_denom;
-            best_bit_idx = bit_idx;
-        }
-    }
+// Bucket accessors that work for both in-memory and mapped trees
+static inline size_t qgen_bucket_length(qgen_otree_t *tree, size_t bucket_id) {
+    if (tree->flags & QGEN_TREE_MAPPED) return tree->file_buckets[bucket_id].pattern_count;
+    return tree->buckets[bucket_id].pattern_count;
+}
 
-    // There is no best bit, meaning all patterns are completely don't cares, which is an error case.
-    if (best_bit_idx == -1) {
-        err = EINVAL;
-        goto cleanup;
+static inline size_t qgen_bucket_pattern(qgen_otree_t *tree, size_t bucket_id, size_t i) {
+    if (tree->flags & QGEN_TREE_MAPPED) {
+        return ((const uint32_t *) &tree->mapping[tree->file_buckets[bucket_id].pattern_offset])[i];
     }
+    return tree->buckets[bucket_id].pattern_ids[i];
+}
 
-    uint64_t split_high = (best_bit_idx >= 64) ? (1ULL << (best_bit_idx - 64)) : 0;
-    uint64_t split_low  = (best_bit_idx < 64)  ? (1ULL << best_bit_idx) : 0;
-
-    for (size_t p = 0; p < patterns_head->length; p++) {
-        qgen_bitpattern_t *pat = &tree->patterns[patterns[p]];
-        
-        // Re-check the best bit logic to push to lists
-        int cares = (pat->mask_high & split_high) || (pat->mask_low & split_low);
-        
-        if (cares) {
-            int is_one = (pat->active_high & split_high) || (pat->active_low & split_low);
-            
-            qgen_al_push(is_one ? ((void **) &one_patterns) : ((void **) &zero_patterns), &patterns[p]);
-        } else {
-            // It's an x, so it must go down both paths in the tree
-            qgen_al_push((void **) &one_patterns, &patterns[p]);
-            qgen_al_push((void **) &zero_patterns, &patterns[p]);
+// Stores the children of an inner node, returns how many there are
+static size_t qgen_node_children(qgen_otree_t *tree, qgen_otree_node_t node, size_t *children) {
+    if (QGEN_NODE_IS_TABLE(node)) {
+        size_t entries = (size_t) 1 << QGEN_NODE_FIELD_BITS(node);
+        for (size_t j = 0; j < entries; j++) {
+            children[j] = tree->tables[QGEN_NODE_TABLE_OFFSET(node) + j];
         }
+        return entries;
     }
+    children[0] = QGEN_NODE_LEFT(node);
+    children[1] = QGEN_NODE_RIGHT(node);
+    return 2;
+}
 
-    // Free original patterns we are done now
-    qgen_free_array_list(patterns);
-    patterns = NULL;
-
-    // Left side
-    err = qgen_generate_tree_helper(gentree, zero_patterns);
-    zero_patterns = NULL; // justification: if needed to be freed, it should have been freed by the recursive call
-    if (err) goto cleanup;
-    size_t zero_branch = tree->node_count - 1;
-    size_t zero_weight = QGEN_NODE_WEIGHT(tree->nodes[zero_branch]);
-
-    // Right side
-    err = qgen_generate_tree_helper(gentree, one_patterns);
-    one_patterns = NULL; // justification: if needed to be freed, it should have been freed by the recursive call
-    if (err) goto cleanup;
-    size_t one_branch = tree->node_count - 1;
-    size_t one_weight = QGEN_NODE_WEIGHT(tree->nodes[one_branch]);
-    
+static int qgen_gen_push_node(qgen_otree_gen_t *gentree, qgen_otree_node_t node) {
+    qgen_otree_t *tree = &gentree->tree;
+    if (tree->node_count >= QGEN_NODE_INDEX_LIMIT) return errno = ENOSPC;
     if (tree->node_count >= gentree->node_capacity) {
         gentree->node_capacity = gentree->node_capacity * 2 + 1;
         qgen_otree_node_t *new_nodes = realloc(tree->nodes, sizeof(qgen_otree_node_t) * gentree->node_capacity);
         if (new_nodes == NULL) return errno = ENOMEM;
         tree->nodes = new_nodes;
     }
-    tree->nodes[tree->node_count++] = QGEN_NODE_INTERMEDIATE(best_bit_idx, zero_weight + one_weight, zero_branch, one_branch);
+    tree->nodes[tree->node_count++] = node;
+    return 0;
+}
 
-cleanup:
-    if (patterns) qgen_free_array_list(patterns);
-    if (zero_patterns) qgen_free_array_list(zero_patterns);
-    if (one_patterns) qgen_free_array_list(one_patterns);
-    if (err != 0) {
-        errno = err;
+// Extracts bits [lsb, lsb + bits) of a 128-bit value, the field must not cross the word boundary
+static inline uint64_t qgen_field(uint64_t high, uint64_t low, uint64_t lsb, uint64_t bits) {
+    uint64_t word = lsb >= 64 ? high : low;
+    return (word >> (lsb & 63)) & ((1ULL << bits) - 1);
+}
+
+static inline uint16_t qgen_pattern_priority(const qgen_otree_t *tree, size_t id) {
+    return tree->flags & QGEN_TREE_WIDE ? tree->wide_patterns[id].priority : tree->patterns[id].priority;
+}
+
+// Cared bits and value of a pattern on [lsb, lsb + bits), the field must not cross a word boundary
+static inline void qgen_pattern_field(const qgen_otree_t *tree, size_t id, uint64_t lsb, uint64_t bits, uint64_t *cares, uint64_t *value) {
+    if (tree->flags & QGEN_TREE_WIDE) {
+        const qgen_wide_pattern_t *pat = &tree->wide_patterns[id];
+        *cares = (pat->mask[lsb >> 6] >> (lsb & 63)) & ((1ULL << bits) - 1);
+        *value = (pat->active[lsb >> 6] >> (lsb & 63)) & ((1ULL << bits) - 1);
+        return;
     }
-    return err;
+    const qgen_bitpattern_t *pat = &tree->patterns[id];
+    *cares = qgen_field(pat->mask_high, pat->mask_low, lsb, bits);
+    *value = qgen_field(pat->active_high, pat->active_low, lsb, bits);
 }
 
-qgen_otree_t *qgen_generate_tree(qgen_bitpattern_t *patterns) {
-    int err = 0;
-    qgen_array_list_t *patterns_head = QGEN_ARRAY_HEADER(patterns);
-    qgen_otree_gen_t gentree = {0};
-    gentree.tree.patterns = patterns;
-    gentree.tree.pattern_count = patterns_head->length;
+// log2(n) in 1/256ths, linearly interpolated between powers of two, good enough for the cost model
+static uint64_t qgen_log2_fixed(uint64_t n) {
+    if (n <= 1) return 0;
+    uint64_t floor_log = qgen_log2_floor64(n);
+    uint64_t frac = floor_log >= 8 ? (n >> (floor_log - 8)) & 0xff : (n << (8 - floor_log)) & 0xff;
+    return (floor_log << 8) | frac;
+}
 
-    // Find max width
-    gentree.tree.width = 0;
-    for (size_t i = 0; i < gentree.tree.pattern_count; i++) {
-        gentree.tree.width = gentree.tree.width >= gentree.tree.patterns[i].width ? gentree.tree.width : gentree.tree.patterns[i].width;
+// Estimated hops below a set of n patterns, in 1/256ths, assuming every level halves it
+static uint64_t qgen_depth_estimate(uint64_t n) {
+    if (n <= QGEN_BUCKET_MAX_LENGTH) return 0;
+    return qgen_log2_fixed(n) - qgen_log2_fixed(QGEN_BUCKET_MAX_LENGTH);
+}
+
+// Counts how many patterns land in each entry of a table on [lsb, lsb + bits), don't cares inside the field are
+// replicated into every entry they match
+static uint64_t qgen_table_counts(qgen_otree_t *tree, const size_t *patterns, size_t length, uint64_t lsb, uint64_t bits, uint32_t *counts) {
+    uint64_t field_mask = (1ULL << bits) - 1;
+    uint64_t total = 0;
+    memset(counts, 0, sizeof(uint32_t) << bits);
+    for (size_t p = 0; p < length; p++) {
+        uint64_t cares, value;
+        qgen_pattern_field(tree, patterns[p], lsb, bits, &cares, &value);
+        uint64_t free_bits = ~cares & field_mask;
+        // Walk every subset of the free bits
+        uint64_t sub = free_bits;
+        while (1) {
+            counts[value | sub]++;
+            total++;
+            if (sub == 0) break;
+            sub = (sub - 1) & free_bits;
+        }
     }
+    return total;
+}
 
-    for (size_t i = 0; i < patterns_head->length; i++) {
-        uint64_t shift = gentree.tree.width - patterns[i].width;
-        uint64_t backshift = 64 - shift;
+// Cost model for table nodes, in 1/256 hops. A split costs one hop plus the traffic weighted depth estimate of its
+// children. Tables additionally pay for replicated patterns and for empty entries.
+#define QGEN_TABLE_DUP_PENALTY 512
+#define QGEN_TABLE_EMPTY_PENALTY 256
+
+// A split decision, a single bit test when bits is 1, a table node on [lsb, lsb + bits) otherwise
+typedef struct qgen_split {
+    uint64_t lsb;
+    uint64_t bits;
+} qgen_split_t;
+
+// Picks the cheapest table containing the best binary split bit, returns 0 if the binary split is cheaper
+static int qgen_choose_table(qgen_otree_gen_t *gentree, const size_t *patterns, size_t length, uint64_t split_bit, uint64_t n0, uint64_t n1, qgen_split_t *split) {
+    qgen_otree_t *tree = &gentree->tree;
+    uint64_t nx = length - n0 - n1;
+    uint64_t s0 = n0 + nx, s1 = n1 + nx;
+    uint64_t best_cost = 256 + (s0 * qgen_depth_estimate(s0) + s1 * qgen_depth_estimate(s1)) / (s0 + s1);
+    uint32_t counts[1 << QGEN_TABLE_MAX_BITS];
+    int found = 0;
+
+    for (uint64_t bits = 2; bits <= gentree->max_table_bits && bits <= QGEN_TABLE_MAX_BITS; bits++) {
+        for (uint64_t lsb = split_bit >= bits - 1 ? split_bit - (bits - 1) : 0; lsb <= split_bit; lsb++) {
+            if (lsb + bits > tree->width || (lsb >> 6) != ((lsb + bits - 1) >> 6)) continue;
+
+            uint64_t total = qgen_table_counts(tree, patterns, length, lsb, bits, counts);
+            uint64_t depth = 0, empty = 0;
+            int progress = 1;
+            for (uint64_t j = 0; j < (1ULL << bits); j++) {
+                if (counts[j] == 0) empty++;
+                // Every child has to be smaller, otherwise generation wouldn't terminate
+                if (counts[j] >= length) progress = 0;
+                depth += counts[j] * qgen_depth_estimate(counts[j]);
+            }
+            if (!progress) continue;
 
-        patterns[i].active_high <<= shift;
-        patterns[i].mask_high <<= shift;
-        patterns[i].active_high |= patterns[i].active_low >> backshift;
-        patterns[i].mask_high |= patterns[i].mask_low >> backshift;
-        patterns[i].active_low <<= shift;
-        patterns[i].mask_low <<= shift;
+            uint64_t cost = 256 + depth / total
+                + QGEN_TABLE_DUP_PENALTY * (total - length) / length
+                + QGEN_TABLE_EMPTY_PENALTY * empty / (1ULL << bits);
+            if (cost < best_cost) {
+                best_cost = cost;
+                split->lsb = lsb;
+                split->bits = bits;
+                found = 1;
+            }
+        }
     }
-    qgen_find_cared_bits(&gentree);
-    
-    size_t *pats = qgen_new_array_list(patterns_head->length, sizeof(size_t));
-    // no need to set errno as qgen_new_array_list already sets it
-    if (pats == NULL) return NULL;
+    return found;
+}
 
-    for (size_t i = 0; i < patterns_head->length; i++) {
-        pats[i] = i;
+// Transposes a 64x64 bit matrix in place, bit c of row r swaps with bit r of row c
+static void qgen_transpose64(uint64_t rows[64]) {
+    uint64_t m = 0x00000000FFFFFFFFULL;
+    for (unsigned j = 32; j != 0; j >>= 1, m ^= m << j) {
+        for (unsigned k = 0; k < 64; k = ((k | j) + 1) & ~j) {
+            uint64_t t = ((rows[k] >> j) ^ rows[k | j]) & m;
+            rows[k] ^= t << j;
+            rows[k | j] ^= t;
+        }
     }
-    QGEN_ARRAY_HEADER(pats)->length = patterns_head->length;
+}
 
-    err = qgen_generate_tree_helper(&gentree, pats);
+// Which word of a pattern a bit-sliced block is built from. Wide patterns continue the same way, slice 2w is mask
+// word w and slice 2w + 1 its value.
+enum {
+    QGEN_SLICE_MASK_LOW,
+    QGEN_SLICE_ACTIVE_LOW,
+    QGEN_SLICE_MASK_HIGH,
+    QGEN_SLICE_ACTIVE_HIGH,
+};
 
-    if (err != 0) {
-        qgen_discard_partial_tree(&gentree.tree);
-        errno = err;
-        return NULL;
+static inline uint64_t qgen_pattern_slice(const qgen_otree_t *tree, size_t id, int slice) {
+    if (tree->flags & QGEN_TREE_WIDE) {
+        const qgen_wide_pattern_t *pat = &tree->wide_patterns[id];
+        return (slice & 1) ? pat->active[slice >> 1] : pat->mask[slice >> 1];
     }
-    
-    qgen_otree_t *result = malloc(sizeof(gentree.tree));
-    if (result == NULL) {
-        qgen_discard_partial_tree(&gentree.tree);
-        errno = ENOMEM;
-        return NULL;
+    const qgen_bitpattern_t *pat = &tree->patterns[id];
+    switch (slice) {
+        case QGEN_SLICE_MASK_LOW: return pat->mask_low;
+        case QGEN_SLICE_ACTIVE_LOW: return pat->active_low;
+        case QGEN_SLICE_MASK_HIGH: return pat->mask_high;
+        default: return pat->active_high;
     }
-    *result = gentree.tree;
-    return result;
 }
 
-static void qgen_export_dot_helper(FILE *f, qgen_otree_t *tree, size_t node_idx) {
-    qgen_otree_node_t node = tree->nodes[node_idx];
+// Adds up, for every bit position, how many patterns care about it (cares) and how many of those want a one (ones).
+// Patterns are bit-sliced 64 at a time, so every row of a transposed block is one bit position across 64 patterns
+// and the counts are a popcount per row instead of a test per pattern per bit.
+// With weights, the weights of the block are bit-sliced too and every row is counted once per weight bit.
+static void qgen_count_bits(qgen_otree_t *tree, const uint16_t *weights, const size_t *patterns, size_t length, uint64_t cares[QGEN_KEY_MAX_BITS], uint64_t ones[QGEN_KEY_MAX_BITS]) {
+    uint64_t rows[64];
+    uint64_t planes[16];
+    int words = 2 * (int) ((tree->width + 63) / 64);
+    if (words == 0) words = 2;
+    memset(cares, 0, sizeof(uint64_t) * QGEN_KEY_MAX_BITS);
+    memset(ones, 0, sizeof(uint64_t) * QGEN_KEY_MAX_BITS);
+    for (size_t base = 0; base < length; base += 64) {
+        size_t block = length - base < 64 ? length - base : 64;
+        if (weights) {
+            memset(planes, 0, sizeof(planes));
+            for (size_t i = 0; i < block; i++) {
+                uint16_t weight = weights[patterns[base + i]];
+                for (unsigned k = 0; k < 16; k++) {
+                    planes[k] |= (uint64_t) ((weight >> k) & 1) << i;
+                }
+            }
+        }
+        for (int word = 0; word < words; word++) {
+            for (size_t i = 0; i < block; i++) {
+                rows[i] = qgen_pattern_slice(tree, patterns[base + i], word);
+            }
+            memset(&rows[block], 0, sizeof(uint64_t) * (64 - block));
+            qgen_transpose64(rows);
 
-    if (QGEN_NODE_IS_LEAF(node)) {
-        size_t bucket_id = QGEN_NODE_BUCKET(node);
-        qgen_bucket_t *bucket = &tree->buckets[bucket_id];
-        
-        // Render Leaf Node (Box shape)
-        fprintf(
-            f,
-            "    node_%"PRIuPTR" [shape=record, style=filled, fillcolor=lightgrey, "
-            "label=\"{LEAF | Pat Count: %"PRIuPTR" | Bucket ID: %"PRIuPTR"}\"];\n", 
-            (uintptr_t) node_idx,
-            (uintptr_t) bucket->pattern_count,
-            (uintptr_t) bucket_id
-        );
-        return;
+            uint64_t *counts = (word & 1) ? ones : cares;
+            uint64_t offset = (uint64_t) (word >> 1) * 64;
+            for (unsigned b = 0; b < 64; b++) {
+                if (weights) {
+                    for (unsigned k = 0; k < 16; k++) {
+                        counts[offset + b] += (uint64_t) qgen_popcount64(rows[b] & planes[k]) << k;
+                    }
+                } else {
+                    counts[offset + b] += qgen_popcount64(rows[b]);
+                }
+            }
+        }
     }
+}
 
-    // Render Intermediate Node (Circle/Ellipse)
-    // Display the Bit Index being tested
-    uint64_t bit = QGEN_NODE_SPLIT_BIT(node);
-    fprintf(
-        f,
-        "    node_%"PRIuPTR" [shape=ellipse, style=filled, fillcolor=white, label=\"Bit %" PRIu64 "\"];\n", 
-        (uintptr_t) node_idx,
-        (uintptr_t) bit
-    );
+// Distributes patterns into the 2^bits children of a split, don't cares go down every path they match.
+// children[j] needs room for counts[j] patterns as given by qgen_table_counts. Pattern order is kept inside every
+// child, so the first match stays the same.
+static void qgen_partition(qgen_otree_t *tree, const size_t *patterns, size_t length, qgen_split_t split, size_t **children, size_t *lengths) {
+    uint64_t field_mask = (1ULL << split.bits) - 1;
+    memset(lengths, 0, sizeof(size_t) << split.bits);
+    for (size_t p = 0; p < length; p++) {
+        uint64_t cares, value;
+        qgen_pattern_field(tree, patterns[p], split.lsb, split.bits, &cares, &value);
+        uint64_t free_bits = ~cares & field_mask;
+        uint64_t sub = free_bits;
+        while (1) {
+            children[value | sub][lengths[value | sub]++] = patterns[p];
+            if (sub == 0) break;
+            sub = (sub - 1) & free_bits;
+        }
+    }
+}
 
-    // Edges
-    size_t zero_idx = QGEN_NODE_LEFT(node);
-    size_t one_idx  = QGEN_NODE_RIGHT(node);
+// Defaults of the split cost model, see qgen_gen_options_t
+#define QGEN_SPLIT_DUP_PENALTY 256
+#define QGEN_SPLIT_FULLNESS_PENALTY 64
+#define QGEN_SPLIT_BEAM 4
 
-    // 0 Edge (False/Low) - Dotted line
-    fprintf(f, "    node_%"PRIuPTR" -> node_%"PRIuPTR" [label=\"0\", style=dashed];\n", (uintptr_t) node_idx, (uintptr_t) zero_idx);
-    
-    // 1 Edge (True/High) - Solid line
-    fprintf(f, "    node_%"PRIuPTR" -> node_%"PRIuPTR" [label=\"1\", style=bold];\n", (uintptr_t) node_idx, (uintptr_t) one_idx);
+// A candidate split bit of the cost model, n0 and n1 patterns want a zero and a one, nx don't care
+typedef struct qgen_split_candidate {
+    uint64_t bit;
+    uint64_t n0, n1, nx;
+    uint64_t t0, t1; // traffic going to either side, the pattern counts without weights
+    uint64_t cost;
+} qgen_split_candidate_t;
 
-    // Recurse
-    qgen_export_dot_helper(f, tree, zero_idx);
-    qgen_export_dot_helper(f, tree, one_idx);
+// Estimated cost of a set of n patterns without looking at it: the bucket if it fits, one hop per halving otherwise
+static uint64_t qgen_set_cost(const qgen_otree_gen_t *gentree, uint64_t n) {
+    if (n <= QGEN_BUCKET_MAX_LENGTH) return gentree->fullness_penalty * (QGEN_BUCKET_MAX_LENGTH - n) / QGEN_BUCKET_MAX_LENGTH;
+    return qgen_depth_estimate(n);
 }
 
-void qgen_export_to_dot(qgen_otree_t *tree, const char *filename) {
-    if (!tree || tree->node_count == 0) return;
+// One hop, the traffic weighted cost of the children and the penalty for the patterns copied into both of them
+static uint64_t qgen_candidate_cost(const qgen_otree_gen_t *gentree, const qgen_split_candidate_t *c, uint64_t cost0, uint64_t cost1) {
+    uint64_t length = c->n0 + c->n1 + c->nx;
+    uint64_t traffic = c->t0 + c->t1 ? c->t0 + c->t1 : 1;
+    return 256 + (c->t0 * cost0 + c->t1 * cost1) / traffic + gentree->duplication_penalty * c->nx / length;
+}
 
-    FILE *f = NULL;
-    errno = fopen_s(&f, filename, "w");
-    if (!f) {
-        perror("Failed to open dot file");
-        return;
+// Scores every bit of a set on its own and keeps the cheapest beam of them in candidates, cheapest first.
+// Returns how many were kept, 0 if no bit splits the set.
+static size_t qgen_split_candidates(qgen_otree_gen_t *gentree, const size_t *patterns, size_t length, size_t beam, qgen_split_candidate_t *candidates) {
+    qgen_otree_t *tree = &gentree->tree;
+    uint64_t cares[QGEN_KEY_MAX_BITS], ones[QGEN_KEY_MAX_BITS];
+    uint64_t weight_cares[QGEN_KEY_MAX_BITS], weight_ones[QGEN_KEY_MAX_BITS];
+    uint64_t weight_total = 0;
+    qgen_count_bits(tree, NULL, patterns, length, cares, ones);
+    if (gentree->weights) {
+        qgen_count_bits(tree, gentree->weights, patterns, length, weight_cares, weight_ones);
+        for (size_t p = 0; p < length; p++) {
+            weight_total += gentree->weights[patterns[p]];
+        }
     }
 
-    fprintf(f, "digraph QGenTree {\n");
-    fprintf(f, "    rankdir=TB;\n"); // Top-to-Bottom layout
-    fprintf(f, "    node [fontname=\"Helvetica\"];\n");
-    fprintf(f, "    edge [fontname=\"Helvetica\", fontsize=10];\n");
-
-    // Start recursion from the root
-    // In your generation logic, the root is the last node added.
-    size_t root_idx = tree->node_count - 1;
-    qgen_export_dot_helper(f, tree, root_idx);
-
-    fprintf(f, "}\n");
-    fclose(f);
-    printf("Tree exported to %s\n", filename);
-}
+    size_t kept = 0;
+    for (uint64_t bit = 0; bit < tree->width; bit++) {
+        if (!(gentree->mask[bit >> 6] & (1ULL << (bit & 63)))) continue;
+        qgen_split_candidate_t c = {.bit = bit, .n0 = cares[bit] - ones[bit], .n1 = ones[bit]};
+        // Both children have to be smaller
+        if (c.n0 == 0 || c.n1 == 0) continue;
+        c.nx = length - c.n0 - c.n1;
+        if (gentree->weights) {
+            c.t0 = weight_total - weight_ones[bit];
+            c.t1 = weight_total - (weight_cares[bit] - weight_ones[bit]);
+        } else {
+            c.t0 = c.n0 + c.nx;
+            c.t1 = c.n1 + c.nx;
+        }
+        c.cost = qgen_candidate_cost(gentree, &c, qgen_set_cost(gentree, c.n0 + c.nx), qgen_set_cost(gentree, c.n1 + c.nx));
 
-void qgen_free_tree(qgen_otree_t *tree) {
-    if (tree) {
-        qgen_discard_partial_tree(tree);
-        free(tree);
+        // Insertion into the beam, ties keep the lower bit like the greedy split
+        if (kept == beam && c.cost >= candidates[kept - 1].cost) continue;
+        size_t i = kept < beam ? kept++ : kept - 1;
+        while (i > 0 && candidates[i - 1].cost > c.cost) {
+            candidates[i] = candidates[i - 1];
+            i--;
+        }
+        candidates[i] = c;
     }
+    return kept;
 }
 
-intptr_t qgen_tree_dispatch(qgen_otree_t *tree, uint64_t high, uint64_t low) {
-    size_t node_id = tree->node_count - 1;
-
-    while (1) {
-        qgen_otree_node_t node = tree->nodes[node_id];
+// Cost of the cheapest split of a set looking depth levels ahead, the split itself goes to best.
+// EINVAL if no bit splits the set.
+static int qgen_lookahead(qgen_otree_gen_t *gentree, const size_t *patterns, size_t length, unsigned depth, qgen_split_candidate_t *best) {
+    qgen_split_candidate_t candidates[QGEN_BEAM_MAX];
+    size_t beam = depth > 1 ? gentree->beam_width : 1;
+    size_t count = qgen_split_candidates(gentree, patterns, length, beam, candidates);
+    if (count == 0) return EINVAL;
+    if (depth <= 1) {
+        *best = candidates[0];
+        return 0;
+    }
 
-        if (QGEN_NODE_IS_LEAF(node)) {
-            size_t bucket_id = QGEN_NODE_BUCKET(node);
-            qgen_bucket_t bucket = tree->buckets[bucket_id];
-
-            // Linear Scan inside the Cache Line
-            for (size_t i = 0; i < bucket.pattern_count; i++) {
-                size_t pat_idx = bucket.pattern_ids[i];
-                qgen_bitpattern_t pat = tree->patterns[pat_idx];
-                if ((low & pat.mask_low) == pat.active_low && (high & pat.mask_high) == pat.active_high) {
-                    return pat_idx;
-                }
+    // Every candidate is split for real and its children costed one level less deep
+    int err = 0;
+    size_t best_index = 0;
+    for (size_t i = 0; i < count && err == 0; i++) {
+        qgen_split_candidate_t *c = &candidates[i];
+        qgen_split_t split = {.lsb = c->bit, .bits = 1};
+        qgen_arena_mark_t mark = qgen_arena_mark(&gentree->scratch);
+        size_t *children[2], lengths[2];
+        children[0] = qgen_arena_alloc(&gentree->scratch, (c->n0 + c->nx) * sizeof(size_t));
+        children[1] = qgen_arena_alloc(&gentree->scratch, (c->n1 + c->nx) * sizeof(size_t));
+        if (children[0] == NULL || children[1] == NULL) {
+            err = ENOMEM;
+        } else {
+            qgen_partition(&gentree->tree, patterns, length, split, children, lengths);
+            uint64_t costs[2];
+            for (int side = 0; side < 2 && err == 0; side++) {
+                qgen_split_candidate_t below;
+                costs[side] = qgen_set_cost(gentree, lengths[side]);
+                if (lengths[side] <= QGEN_BUCKET_MAX_LENGTH) continue;
+                int below_err = qgen_lookahead(gentree, children[side], lengths[side], depth - 1, &below);
+                if (below_err == 0) costs[side] = below.cost;
+                // Nothing splits it, the whole oversized bucket is scanned
+                else if (below_err == EINVAL) costs[side] = 256 * lengths[side] / QGEN_BUCKET_MAX_LENGTH;
+                else err = below_err;
+            }
+            c->cost = qgen_candidate_cost(gentree, c, costs[0], costs[1]);
+            if (c->cost < candidates[best_index].cost || (c->cost == candidates[best_index].cost && c->bit < candidates[best_index].bit)) {
+                best_index = i;
             }
-            // No match in bucket
-            return -1;
         }
-        uint64_t split_bit = QGEN_NODE_SPLIT_BIT(node);
-        int bit_set = split_bit >= 64 ? ((high >> (split_bit - 64)) & 1) : ((low >> split_bit) & 1);
-        node_id = bit_set ? QGEN_NODE_RIGHT(node): QGEN_NODE_LEFT(node);
+        qgen_arena_release(&gentree->scratch, mark);
     }
+    *best = candidates[best_index];
+    return err;
 }
 
-uint8_t qgen_tree_max_width(qgen_otree_t *tree) {
-    return tree->width;
+// Picks how to split a set of more than QGEN_BUCKET_MAX_LENGTH patterns
+static int qgen_choose_split(qgen_otree_gen_t *gentree, const size_t *patterns, size_t length, qgen_split_t *split) {
+    qgen_otree_t *tree = &gentree->tree;
+    if (gentree->split == QGEN_SPLIT_COST) {
+        qgen_split_candidate_t best;
+        int err = qgen_lookahead(gentree, patterns, length, gentree->lookahead, &best);
+        if (err) return err;
+        split->lsb = best.bit;
+        split->bits = 1;
+        if (gentree->max_table_bits >= 2) {
+            qgen_choose_table(gentree, patterns, length, best.bit, best.n0, best.n1, split);
+        }
+        return 0;
+    }
+
+    uint64_t cares[QGEN_KEY_MAX_BITS], ones[QGEN_KEY_MAX_BITS];
+    uint64_t weight_cares[QGEN_KEY_MAX_BITS], weight_ones[QGEN_KEY_MAX_BITS];
+    uint64_t weight_total = 0;
+    qgen_count_bits(tree, NULL, patterns, length, cares, ones);
+    if (gentree->weights) {
+        qgen_count_bits(tree, gentree->weights, patterns, length, weight_cares, weight_ones);
+        for (size_t p = 0; p < length; p++) {
+            weight_total += gentree->weights[patterns[p]];
+        }
+    }
+
+    uint64_t best_bit_idx = -1;
+    uint64_t best_n0 = 0, best_n1 = 0;
+    uint64_t gini_nom = 0xffffffffffffffffULL;
+    uint64_t gini_denom = 1;
+    uint64_t best_cost = UINT64_MAX;
+    for (uint64_t bit_idx = 0; bit_idx < tree->width; bit_idx++) {
+        // Skip if NO pattern cares about it
+        if (!(gentree->mask[bit_idx >> 6] & (1ULL << (bit_idx & 63)))) continue;
+
+        uint64_t n0 = cares[bit_idx] - ones[bit_idx]; // qgen_pat(0)
+        uint64_t n1 = ones[bit_idx]; // qgen_pat(1)
+
+        uint64_t cur_nom = n0 + n1;
+        if (cur_nom == 0) continue;
+        if (gentree->weights) {
+            // Expected log2 of the set a key lands in, don't cares go to both sides
+            if (n0 == 0 || n1 == 0) continue;
+            uint64_t w1 = weight_ones[bit_idx];
+            uint64_t w0 = weight_cares[bit_idx] - w1;
+            uint64_t cost = (weight_total - w1) * qgen_log2_fixed(length - n1) + (weight_total - w0) * qgen_log2_fixed(length - n0);
+            cost /= 2 * weight_total - w0 - w1;
+            if (cost < best_cost) {
+                best_cost = cost;
+                best_bit_idx = bit_idx;
+                best_n0 = n0;
+                best_n1 = n1;
+            }
+            continue;
+        }
+        uint64_t cur_denom = n0 * n1;
+        if (cur_nom * gini_denom < gini_nom * cur_denom) {
+            gini_nom = cur_nom;
+            gini_denom = cur_denom;
+            best_bit_idx = bit_idx;
+            best_n0 = n0;
+            best_n1 = n1;
+        }
+    }
+
+    // There is no best bit, meaning all patterns are completely don't cares, which is an error case.
+    if (best_bit_idx == -1) return EINVAL;
+
+    split->lsb = best_bit_idx;
+    split->bits = 1;
+    // A table around the best bit can resolve several levels in a single hop
+    if (gentree->max_table_bits >= 2) {
+        qgen_choose_table(gentree, patterns, length, best_bit_idx, best_n0, best_n1, split);
+    }
+    return 0;
+}
+
+// Makes room for entries more child indices in the tables array
+static int qgen_gen_grow_tables(qgen_otree_gen_t *gentree, size_t entries) {
+    qgen_otree_t *tree = &gentree->tree;
+    if (tree->table_length + entries > QGEN_NODE_INDEX_LIMIT) return errno = ENOSPC;
+    if (tree->table_length + entries > gentree->table_capacity) {
+        size_t capacity = gentree->table_capacity * 2 + entries;
+        uint32_t *new_tables = realloc(tree->tables, sizeof(uint32_t) * capacity);
+        if (new_tables == NULL) return errno = ENOMEM;
+        tree->tables = new_tables;
+        gentree->table_capacity = capacity;
+    }
+    return 0;
+}
+
+// Appends a binary split, in the wide form if a child doesn't fit a compact node
+static int qgen_gen_push_binary(qgen_otree_gen_t *gentree, uint64_t bit, uint64_t weight, size_t left, size_t right) {
+    if (left < QGEN_NODE_COMPACT_LIMIT && right < QGEN_NODE_COMPACT_LIMIT) {
+        return qgen_gen_push_node(gentree, QGEN_NODE_INTERMEDIATE(bit, weight, left, right));
+    }
+    qgen_otree_t *tree = &gentree->tree;
+    int err = qgen_gen_grow_tables(gentree, 2);
+    if (err) return err;
+    size_t table_offset = tree->table_length;
+    tree->tables[table_offset] = (uint32_t) left;
+    tree->tables[table_offset + 1] = (uint32_t) right;
+    tree->table_length += 2;
+    return qgen_gen_push_node(gentree, QGEN_NODE_TABLE(bit, 1, weight, table_offset));
+}
+
+// Appends the node of a split whose children roots are child_nodes
+static int qgen_gen_push_split(qgen_otree_gen_t *gentree, qgen_split_t split, const size_t *child_nodes) {
+    qgen_otree_t *tree = &gentree->tree;
+    size_t entries = (size_t) 1 << split.bits;
+    uint64_t weight = 0;
+    for (size_t j = 0; j < entries; j++) {
+        weight += QGEN_NODE_WEIGHT(tree->nodes[child_nodes[j]]);
+    }
+    if (weight > 0xffff) weight = 0xffff;
+    if (split.bits == 1) return qgen_gen_push_binary(gentree, split.lsb, weight, child_nodes[0], child_nodes[1]);
+
+    int err = qgen_gen_grow_tables(gentree, entries);
+    if (err) return err;
+    size_t table_offset = tree->table_length;
+    for (size_t j = 0; j < entries; j++) {
+        tree->tables[table_offset + j] = (uint32_t) child_nodes[j];
+    }
+    tree->table_length += entries;
+    return qgen_gen_push_node(gentree, QGEN_NODE_TABLE(split.lsb, split.bits, weight, table_offset));
+}
+
+// Copies the pattern IDs of a bucket into the ID arena
+static int qgen_gen_push_bucket(qgen_otree_gen_t *gentree, const size_t *patterns, size_t length) {
+    qgen_otree_t *tree = &gentree->tree;
+    if (tree->bucket_count >= QGEN_NODE_INDEX_LIMIT) return errno = ENOSPC;
+    if (tree->bucket_count >= gentree->bucket_capacity) {
+        gentree->bucket_capacity = gentree->bucket_capacity * 2 + 1;
+        qgen_bucket_t *new_buckets = realloc(tree->buckets, sizeof(qgen_bucket_t) * gentree->bucket_capacity);
+        if (new_buckets == NULL) return errno = ENOMEM;
+        tree->buckets = new_buckets;
+    }
+    size_t *ids = qgen_arena_alloc(&gentree->ids, length * sizeof(size_t));
+    if (ids == NULL) return errno = ENOMEM;
+    memcpy(ids, patterns, length * sizeof(size_t));
+    tree->buckets[tree->bucket_count++] = (qgen_bucket_t) {
+        .pattern_count = length,
+        .pattern_ids = ids,
+    };
+    return 0;
+}
+
+// Whether some key matches both patterns
+static inline int qgen_patterns_overlap(const qgen_bitpattern_t *a, const qgen_bitpattern_t *b) {
+    uint64_t high = (a->active_high ^ b->active_high) & a->mask_high & b->mask_high;
+    uint64_t low = (a->active_low ^ b->active_low) & a->mask_low & b->mask_low;
+    return (high | low) == 0;
+}
+
+// Moves hot patterns to the front of a bucket. A pattern only passes patterns it can't overlap with, so the first
+// match of every key stays the same.
+static void qgen_sort_bucket(qgen_otree_gen_t *gentree, size_t *ids, size_t length) {
+    const uint16_t *weights = gentree->weights;
+    for (size_t i = 1; i < length; i++) {
+        size_t id = ids[i];
+        size_t j = i;
+        while (j > 0 && weights[ids[j - 1]] < weights[id] && !qgen_patterns_overlap(&gentree->tree.patterns[ids[j - 1]], &gentree->tree.patterns[id])) {
+            ids[j] = ids[j - 1];
+            j--;
+        }
+        ids[j] = id;
+    }
+}
+
+// Appends a leaf holding patterns
+static int qgen_gen_push_leaf(qgen_otree_gen_t *gentree, const size_t *patterns, size_t length) {
+    int err = qgen_gen_push_bucket(gentree, patterns, length);
+    if (err) return err;
+
+    qgen_bucket_t *bucket = &gentree->tree.buckets[gentree->tree.bucket_count - 1];
+    uint64_t weight = length;
+    if (gentree->weights) {
+        qgen_sort_bucket(gentree, bucket->pattern_ids, length);
+        // Share of the total traffic, rounded up so reachable leaves never weigh nothing
+        uint64_t sum = 0;
+        for (size_t i = 0; i < length; i++) {
+            sum += gentree->weights[patterns[i]];
+        }
+        weight = (sum * 0xffff + gentree->weight_total - 1) / gentree->weight_total;
+    }
+    if (weight > 0xffff) weight = 0xffff;
+    return qgen_gen_push_node(gentree, QGEN_NODE_LEAF(weight, gentree->tree.bucket_count - 1));
+}
+
+// Hash of a pattern index list, never 0
+static uint64_t qgen_memo_hash(const size_t *patterns, size_t length) {
+    uint64_t hash = 0x9E3779B97F4A7C15ULL ^ length;
+    for (size_t i = 0; i < length; i++) {
+        hash = (hash ^ patterns[i]) * 0xFF51AFD7ED558CCDULL;
+        hash ^= hash >> 32;
+    }
+    return hash | 1;
+}
+
+static int qgen_memo_find(qgen_otree_gen_t *gentree, uint64_t hash, const size_t *patterns, size_t length, size_t *node) {
+    if (gentree->memo_capacity == 0) return 0;
+    size_t mask = gentree->memo_capacity - 1;
+    for (size_t i = hash & mask; gentree->memo[i].hash; i = (i + 1) & mask) {
+        const qgen_memo_entry_t *entry = &gentree->memo[i];
+        if (entry->hash == hash && entry->length == length && memcmp(entry->patterns, patterns, length * sizeof(size_t)) == 0) {
+            *node = entry->node;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static void qgen_memo_place(qgen_memo_entry_t *memo, size_t capacity, qgen_memo_entry_t entry) {
+    size_t i = entry.hash & (capacity - 1);
+    while (memo[i].hash) {
+        i = (i + 1) & (capacity - 1);
+    }
+    memo[i] = entry;
+}
+
+static int qgen_memo_insert(qgen_otree_gen_t *gentree, uint64_t hash, const size_t *patterns, size_t length, size_t node) {
+    // Kept at most 3/4 full
+    if ((gentree->memo_count + 1) * 4 > gentree->memo_capacity * 3) {
+        size_t capacity = gentree->memo_capacity ? gentree->memo_capacity * 2 : 256;
+        qgen_memo_entry_t *memo = calloc(capacity, sizeof(qgen_memo_entry_t));
+        if (memo == NULL) return errno = ENOMEM;
+        for (size_t i = 0; i < gentree->memo_capacity; i++) {
+            if (gentree->memo[i].hash) qgen_memo_place(memo, capacity, gentree->memo[i]);
+        }
+        free(gentree->memo);
+        gentree->memo = memo;
+        gentree->memo_capacity = capacity;
+    }
+    size_t *key = qgen_arena_alloc(&gentree->memo_keys, length * sizeof(size_t));
+    if (key == NULL) return errno = ENOMEM;
+    memcpy(key, patterns, length * sizeof(size_t));
+    qgen_memo_place(gentree->memo, gentree->memo_capacity, (qgen_memo_entry_t) {
+        .hash = hash,
+        .patterns = key,
+        .length = length,
+        .node = node,
+    });
+    gentree->memo_count++;
+    return 0;
+}
+
+// Forgets every set, the table and one chunk of keys are kept for reuse
+static void qgen_memo_clear(qgen_otree_gen_t *gentree) {
+    if (gentree->memo) memset(gentree->memo, 0, gentree->memo_capacity * sizeof(qgen_memo_entry_t));
+    gentree->memo_count = 0;
+    qgen_arena_release(&gentree->memo_keys, (qgen_arena_mark_t) {0});
+}
+
+static void qgen_memo_free(qgen_otree_gen_t *gentree) {
+    free(gentree->memo);
+    gentree->memo = NULL;
+    gentree->memo_capacity = 0;
+    gentree->memo_count = 0;
+    qgen_arena_free(&gentree->memo_keys);
+}
+
+int qgen_generate_tree_helper(qgen_otree_gen_t *gentree, const size_t *patterns, size_t length, size_t *node) {
+    qgen_otree_t *tree = &gentree->tree;
+    // A pattern that doesn't care about a split bit goes down both sides, so wildcard heavy sets reach the same
+    // subsets over and over. Each set is built once and its subtree shared after that.
+    uint64_t hash = qgen_memo_hash(patterns, length);
+    if (qgen_memo_find(gentree, hash, patterns, length, node)) return 0;
+
+    // A set no bit can split is made of patterns that all overlap each other, the leaf just gets longer
+    qgen_split_t split;
+    int err = 0;
+    if (length <= QGEN_BUCKET_MAX_LENGTH || (err = qgen_choose_split(gentree, patterns, length, &split)) == EINVAL) {
+        err = qgen_gen_push_leaf(gentree, patterns, length);
+        if (err) return err;
+        *node = tree->node_count - 1;
+        return qgen_memo_insert(gentree, hash, patterns, length, *node);
+    }
+    if (err) return errno = err;
+
+    // Child lists live until this subtree is done, then the whole level goes at once
+    qgen_arena_mark_t mark = qgen_arena_mark(&gentree->scratch);
+    size_t entries = (size_t) 1 << split.bits;
+    uint32_t counts[1 << QGEN_TABLE_MAX_BITS];
+    size_t **children = qgen_arena_alloc(&gentree->scratch, entries * sizeof(size_t *));
+    size_t *lengths = qgen_arena_alloc(&gentree->scratch, entries * sizeof(size_t));
+    size_t *child_nodes = qgen_arena_alloc(&gentree->scratch, entries * sizeof(size_t));
+    if (children == NULL || lengths == NULL || child_nodes == NULL) {
+        err = ENOMEM;
+        goto cleanup;
+    }
+    qgen_table_counts(tree, patterns, length, split.lsb, split.bits, counts);
+    for (size_t j = 0; j < entries; j++) {
+        children[j] = qgen_arena_alloc(&gentree->scratch, counts[j] * sizeof(size_t));
+        if (children[j] == NULL) {
+            err = ENOMEM;
+            goto cleanup;
+        }
+    }
+    qgen_partition(tree, patterns, length, split, children, lengths);
+
+    // Children from the zero side up, the node itself comes after them
+    for (size_t j = 0; j < entries; j++) {
+        err = qgen_generate_tree_helper(gentree, children[j], lengths[j], &child_nodes[j]);
+        if (err) goto cleanup;
+    }
+
+    err = qgen_gen_push_split(gentree, split, child_nodes);
+    if (err == 0) {
+        *node = tree->node_count - 1;
+        err = qgen_memo_insert(gentree, hash, patterns, length, *node);
+    }
+
+cleanup:
+    qgen_arena_release(&gentree->scratch, mark);
+    if (err != 0) {
+        errno = err;
+    }
+    return err;
+}
+
+// Shifts a pattern so it's left aligned to width, patterns remember their shift so they can be reused for other trees
+static void qgen_align_pattern(qgen_bitpattern_t *bp, uint8_t width) {
+    int delta = (int) (width - bp->width) - (int) bp->shift;
+    bp->shift = width - bp->width;
+    if (delta > 0) {
+        uint64_t shift = (uint64_t) delta;
+        // Shifting by the full word size is undefined, handle both edges separately
+        if (shift >= 64) {
+            bp->active_high = bp->active_low << (shift - 64);
+            bp->mask_high = bp->mask_low << (shift - 64);
+            bp->active_low = 0;
+            bp->mask_low = 0;
+            return;
+        }
+        uint64_t backshift = 64 - shift;
+
+        bp->active_high <<= shift;
+        bp->mask_high <<= shift;
+        bp->active_high |= bp->active_low >> backshift;
+        bp->mask_high |= bp->mask_low >> backshift;
+        bp->active_low <<= shift;
+        bp->mask_low <<= shift;
+    } else if (delta < 0) {
+        uint64_t shift = (uint64_t) -delta;
+        if (shift >= 64) {
+            bp->active_low = bp->active_high >> (shift - 64);
+            bp->mask_low = bp->mask_high >> (shift - 64);
+            bp->active_high = 0;
+            bp->mask_high = 0;
+            return;
+        }
+        uint64_t backshift = 64 - shift;
+
+        bp->active_low >>= shift;
+        bp->mask_low >>= shift;
+        bp->active_low |= bp->active_high << backshift;
+        bp->mask_low |= bp->mask_high << backshift;
+        bp->active_high >>= shift;
+        bp->mask_high >>= shift;
+    }
+}
+
+// Shifts a multi-word value, left for positive amounts
+static void qgen_shift_words(uint64_t words[QGEN_KEY_MAX_WORDS], int amount) {
+    uint64_t shifted[QGEN_KEY_MAX_WORDS] = {0};
+    int distance = amount < 0 ? -amount : amount;
+    int word_shift = distance >> 6, bit_shift = distance & 63;
+    for (int w = 0; w < QGEN_KEY_MAX_WORDS; w++) {
+        int src = amount > 0 ? w - word_shift : w + word_shift;
+        int carry = amount > 0 ? src - 1 : src + 1;
+        if (src < 0 || src >= QGEN_KEY_MAX_WORDS) continue;
+        shifted[w] = amount > 0 ? words[src] << bit_shift : words[src] >> bit_shift;
+        if (bit_shift == 0 || carry < 0 || carry >= QGEN_KEY_MAX_WORDS) continue;
+        shifted[w] |= amount > 0 ? words[carry] >> (64 - bit_shift) : words[carry] << (64 - bit_shift);
+    }
+    memcpy(words, shifted, sizeof(shifted));
+}
+
+// Same as qgen_align_pattern for wide patterns
+static void qgen_align_wide_pattern(qgen_wide_pattern_t *wp, uint16_t width) {
+    int delta = (int) (width - wp->width) - (int) wp->shift;
+    wp->shift = width - wp->width;
+    if (delta == 0) return;
+    qgen_shift_words(wp->mask, delta);
+    qgen_shift_words(wp->active, delta);
+}
+
+static int qgen_compare_keys(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *) a, y = *(const uint64_t *) b;
+    return x < y ? -1 : x > y;
+}
+
+// Builds the root pattern list of the patterns of the tree being generated
+static int qgen_gen_root(qgen_otree_gen_t *gentree, size_t **root, size_t *root_length) {
+    qgen_otree_t *tree = &gentree->tree;
+    size_t length = tree->pattern_count;
+    qgen_find_cared_bits(gentree);
+
+    size_t *pats = malloc(length * sizeof(size_t) + 1);
+    if (pats == NULL) return ENOMEM;
+
+    int prioritized = 0;
+    for (size_t i = 0; i < length; i++) {
+        pats[i] = i;
+        if (qgen_pattern_priority(tree, i)) prioritized = 1;
+    }
+    // Every bucket keeps the order of this list, so sorting it once resolves priorities for all of them
+    if (prioritized) {
+        uint64_t *keys = malloc(length * sizeof(uint64_t) + 1);
+        if (keys == NULL) {
+            free(pats);
+            return ENOMEM;
+        }
+        for (size_t i = 0; i < length; i++) {
+            keys[i] = ((uint64_t) (0xffff - qgen_pattern_priority(tree, i)) << 48) | i;
+        }
+        qsort(keys, length, sizeof(uint64_t), qgen_compare_keys);
+        for (size_t i = 0; i < length; i++) {
+            pats[i] = (size_t) (keys[i] & 0xffffffffffffULL);
+        }
+        free(keys);
+    }
+    *root = pats;
+    *root_length = length;
+    return 0;
+}
+
+// Aligns the patterns and builds the root pattern list, shared by every generator
+static int qgen_gen_prepare(qgen_otree_gen_t *gentree, qgen_bitpattern_t *patterns, size_t **root, size_t *root_length) {
+    qgen_array_list_t *patterns_head = QGEN_ARRAY_HEADER(patterns);
+    gentree->max_table_bits = QGEN_TABLE_MAX_BITS;
+    gentree->tree.patterns = patterns;
+    gentree->tree.pattern_count = patterns_head->length;
+
+    // Find max width
+    gentree->tree.width = 0;
+    for (size_t i = 0; i < gentree->tree.pattern_count; i++) {
+        gentree->tree.width = gentree->tree.width >= gentree->tree.patterns[i].width ? gentree->tree.width : gentree->tree.patterns[i].width;
+    }
+
+    for (size_t i = 0; i < patterns_head->length; i++) {
+        qgen_align_pattern(&patterns[i], (uint8_t) gentree->tree.width);
+    }
+    return qgen_gen_root(gentree, root, root_length);
+}
+
+static void qgen_gen_discard(qgen_otree_gen_t *gentree) {
+    // Bucket ID lists belong to the arena
+    for (size_t i = 0; i < gentree->tree.bucket_count; i++) {
+        gentree->tree.buckets[i].pattern_ids = NULL;
+    }
+    qgen_discard_partial_tree(&gentree->tree);
+    qgen_arena_free(&gentree->scratch);
+    qgen_arena_free(&gentree->ids);
+    qgen_memo_free(gentree);
+}
+
+// Lays a tree out in a single allocation: the tree itself, then nodes, tables, buckets and pattern ID lists.
+// The caller fills the arrays in, ids points to the start of the ID lists.
+static qgen_otree_t *qgen_alloc_compact(size_t node_count, size_t bucket_count, size_t table_length, size_t id_count, size_t **ids) {
+    size_t node_offset = sizeof(qgen_otree_t);
+    size_t table_offset = node_offset + node_count * sizeof(qgen_otree_node_t);
+    size_t bucket_offset = table_offset + ((table_length * sizeof(uint32_t) + 7) & ~(size_t) 7);
+    size_t id_offset = bucket_offset + bucket_count * sizeof(qgen_bucket_t);
+    uint8_t *block = calloc(1, id_offset + id_count * sizeof(size_t));
+    if (block == NULL) return NULL;
+
+    qgen_otree_t *tree = (qgen_otree_t *) block;
+    tree->flags = QGEN_TREE_COMPACT;
+    tree->node_count = node_count;
+    tree->nodes = (qgen_otree_node_t *) &block[node_offset];
+    tree->table_length = table_length;
+    tree->tables = table_length ? (uint32_t *) &block[table_offset] : NULL;
+    tree->bucket_count = bucket_count;
+    tree->buckets = (qgen_bucket_t *) &block[bucket_offset];
+    *ids = (size_t *) &block[id_offset];
+    return tree;
+}
+
+// Moves the generated tree into a single allocation, or discards it if generation failed
+static qgen_otree_t *qgen_gen_finish(qgen_otree_gen_t *gentree, int err) {
+    qgen_otree_t *src = &gentree->tree;
+    qgen_otree_t *result = NULL;
+    if (err == 0) {
+        size_t id_count = 0;
+        for (size_t i = 0; i < src->bucket_count; i++) {
+            id_count += src->buckets[i].pattern_count;
+        }
+
+        size_t *ids = NULL;
+        result = qgen_alloc_compact(src->node_count, src->bucket_count, src->table_length, id_count, &ids);
+        if (result == NULL) {
+            err = ENOMEM;
+        } else {
+            result->width = src->width;
+            result->flags |= src->flags;
+            result->pattern_count = src->pattern_count;
+            result->patterns = src->patterns;
+            result->wide_patterns = src->wide_patterns;
+            memcpy(result->nodes, src->nodes, src->node_count * sizeof(qgen_otree_node_t));
+            if (src->table_length) memcpy(result->tables, src->tables, src->table_length * sizeof(uint32_t));
+            for (size_t i = 0; i < src->bucket_count; i++) {
+                size_t count = src->buckets[i].pattern_count;
+                memcpy(ids, src->buckets[i].pattern_ids, count * sizeof(size_t));
+                result->buckets[i] = (qgen_bucket_t) {
+                    .pattern_count = count,
+                    .pattern_ids = ids,
+                };
+                ids += count;
+            }
+        }
+    }
+
+    qgen_gen_discard(gentree);
+    if (err != 0) {
+        errno = err;
+        return NULL;
+    }
+    return result;
+}
+
+qgen_otree_t *qgen_generate_tree(qgen_bitpattern_t *patterns) {
+    return qgen_generate_tree_ex(patterns, NULL);
+}
+
+qgen_otree_t *qgen_generate_tree_wide(qgen_wide_pattern_t *patterns) {
+    qgen_array_list_t *patterns_head = QGEN_ARRAY_HEADER(patterns);
+    qgen_otree_gen_t gentree = {0};
+    gentree.max_table_bits = QGEN_TABLE_MAX_BITS;
+    gentree.tree.flags = QGEN_TREE_WIDE;
+    gentree.tree.wide_patterns = patterns;
+    gentree.tree.pattern_count = patterns_head->length;
+    for (size_t i = 0; i < patterns_head->length; i++) {
+        if (patterns[i].width > QGEN_KEY_MAX_BITS) {
+            errno = EINVAL;
+            return NULL;
+        }
+        if (patterns[i].width > gentree.tree.width) gentree.tree.width = patterns[i].width;
+    }
+    for (size_t i = 0; i < patterns_head->length; i++) {
+        qgen_align_wide_pattern(&patterns[i], gentree.tree.width);
+    }
+
+    size_t *pats = NULL;
+    size_t length = 0;
+    size_t root = 0;
+    int err = qgen_gen_root(&gentree, &pats, &length);
+    if (err == 0) {
+        err = qgen_generate_tree_helper(&gentree, pats, length, &root);
+    }
+    free(pats);
+    return qgen_gen_finish(&gentree, err);
+}
+
+// Weights are scaled to 16 bits so they can be bit-sliced, every pattern keeps at least 1 so cold ones still count
+// as patterns
+static int qgen_gen_weights(qgen_otree_gen_t *gentree, const uint64_t *hits, size_t length) {
+    gentree->weights = malloc(length * sizeof(uint16_t) + 1);
+    if (gentree->weights == NULL) return ENOMEM;
+    uint64_t max_hits = 0;
+    for (size_t i = 0; i < length; i++) {
+        max_hits = hits[i] > max_hits ? hits[i] : max_hits;
+    }
+    for (size_t i = 0; i < length; i++) {
+        uint64_t weight = max_hits ? 1 + (uint64_t) ((double) hits[i] * 0xfffe / (double) max_hits) : 1;
+        gentree->weights[i] = (uint16_t) weight;
+        gentree->weight_total += weight;
+    }
+    return 0;
+}
+
+// Applies the options to a prepared generator
+static int qgen_gen_configure(qgen_otree_gen_t *gentree, const qgen_gen_options_t *options, size_t length) {
+    static const qgen_gen_options_t defaults = {0};
+    if (options == NULL) options = &defaults;
+    if (options->split > QGEN_SPLIT_COST) return EINVAL;
+    if (options->max_table_bits) {
+        gentree->max_table_bits = options->max_table_bits < QGEN_TABLE_MAX_BITS ? options->max_table_bits : QGEN_TABLE_MAX_BITS;
+    }
+    gentree->split = options->split;
+    gentree->lookahead = options->lookahead ? options->lookahead : 1;
+    if (gentree->lookahead > QGEN_LOOKAHEAD_MAX) gentree->lookahead = QGEN_LOOKAHEAD_MAX;
+    gentree->beam_width = options->beam_width ? options->beam_width : QGEN_SPLIT_BEAM;
+    if (gentree->beam_width > QGEN_BEAM_MAX) gentree->beam_width = QGEN_BEAM_MAX;
+    gentree->duplication_penalty = options->duplication_penalty ? options->duplication_penalty : QGEN_SPLIT_DUP_PENALTY;
+    gentree->fullness_penalty = options->fullness_penalty ? options->fullness_penalty : QGEN_SPLIT_FULLNESS_PENALTY;
+    if (options->hits) return qgen_gen_weights(gentree, options->hits, length);
+    return 0;
+}
+
+qgen_otree_t *qgen_generate_tree_weighted(qgen_bitpattern_t *patterns, const uint64_t *hits) {
+    qgen_gen_options_t options = {.hits = hits};
+    return qgen_generate_tree_ex(patterns, &options);
+}
+
+// ---- Parallel generation ----
+
+// Sets smaller than this are built serially by a single task
+#define QGEN_PARALLEL_GRAIN 1024
+
+typedef struct qgen_gen_task qgen_gen_task_t;
+typedef struct qgen_gen_pool qgen_gen_pool_t;
+
+struct qgen_gen_task {
+    size_t *patterns; // owned until the task runs
+    size_t length;
+    // Split done by the task, bits is 0 if the whole subtree was built into the arena of a worker instead
+    qgen_split_t split;
+    qgen_gen_task_t **children;
+    // Fragment of the arena of worker holding the subtree
+    size_t worker;
+    size_t node_start, node_end;
+    size_t bucket_start, bucket_end;
+    size_t table_start, table_end;
+};
+
+// Owner pushes and pops at the tail, thieves take from the head
+typedef struct qgen_gen_deque {
+    qgen_mutex_t lock;
+    qgen_gen_task_t **tasks;
+    size_t head, tail, capacity;
+} qgen_gen_deque_t;
+
+typedef struct qgen_gen_worker {
+    qgen_otree_gen_t gentree; // arena for the fragments built by this worker
+    qgen_gen_deque_t deque;
+    qgen_gen_pool_t *pool;
+    size_t index;
+    qgen_thread_t thread;
+} qgen_gen_worker_t;
+
+struct qgen_gen_pool {
+    qgen_gen_worker_t *workers;
+    size_t worker_count;
+    qgen_mutex_t lock;
+    qgen_cond_t wake;
+    size_t pending; // tasks not finished yet
+    size_t queued; // tasks sitting in a deque
+    int err;
+};
+
+static void qgen_free_task(qgen_gen_task_t *task);
+
+static int qgen_pool_push(qgen_gen_worker_t *worker, qgen_gen_task_t *task) {
+    qgen_gen_deque_t *deque = &worker->deque;
+    qgen_mutex_lock(&deque->lock);
+    if (deque->tail >= deque->capacity) {
+        // Reuse the space in front of the head before growing
+        size_t length = deque->tail - deque->head;
+        if (deque->head > 0) {
+            memmove(deque->tasks, &deque->tasks[deque->head], length * sizeof(qgen_gen_task_t *));
+        } else {
+            size_t capacity = deque->capacity * 2 + 16;
+            qgen_gen_task_t **new_tasks = realloc(deque->tasks, capacity * sizeof(qgen_gen_task_t *));
+            if (new_tasks == NULL) {
+                qgen_mutex_unlock(&deque->lock);
+                return ENOMEM;
+            }
+            deque->tasks = new_tasks;
+            deque->capacity = capacity;
+        }
+        deque->head = 0;
+        deque->tail = length;
+    }
+    deque->tasks[deque->tail++] = task;
+    qgen_mutex_unlock(&deque->lock);
+
+    qgen_gen_pool_t *pool = worker->pool;
+    qgen_mutex_lock(&pool->lock);
+    pool->queued++;
+    qgen_cond_broadcast(&pool->wake);
+    qgen_mutex_unlock(&pool->lock);
+    return 0;
+}
+
+static qgen_gen_task_t *qgen_pool_take(qgen_gen_deque_t *deque, int steal) {
+    qgen_gen_task_t *task = NULL;
+    qgen_mutex_lock(&deque->lock);
+    if (deque->head < deque->tail) {
+        task = steal ? deque->tasks[deque->head++] : deque->tasks[--deque->tail];
+    }
+    qgen_mutex_unlock(&deque->lock);
+    return task;
+}
+
+static void qgen_pool_fail(qgen_gen_pool_t *pool, int err) {
+    qgen_mutex_lock(&pool->lock);
+    if (pool->err == 0) pool->err = err;
+    qgen_mutex_unlock(&pool->lock);
+}
+
+static void qgen_pool_run(qgen_gen_worker_t *worker, qgen_gen_task_t *task) {
+    qgen_gen_pool_t *pool = worker->pool;
+    qgen_otree_gen_t *gentree = &worker->gentree;
+    size_t length = task->length;
+    int err = 0;
+    qgen_split_t split;
+    int serial = length <= QGEN_PARALLEL_GRAIN;
+    if (!serial) {
+        err = qgen_choose_split(gentree, task->patterns, length, &split);
+        // Unsplittable sets become a single leaf, which the serial generator takes care of
+        if (err == EINVAL) {
+            serial = 1;
+            err = 0;
+        }
+    }
+
+    if (err == 0 && serial) {
+        task->worker = worker->index;
+        task->node_start = gentree->tree.node_count;
+        task->bucket_start = gentree->tree.bucket_count;
+        task->table_start = gentree->tree.table_length;
+        // Fragments are relocated on their own, so they can't share nodes with other fragments of the worker
+        qgen_memo_clear(gentree);
+        size_t root = 0;
+        err = qgen_generate_tree_helper(gentree, task->patterns, length, &root);
+        free(task->patterns);
+        task->patterns = NULL;
+        task->node_end = gentree->tree.node_count;
+        task->bucket_end = gentree->tree.bucket_count;
+        task->table_end = gentree->tree.table_length;
+    } else {
+        size_t entries = (size_t) 1 << (err ? 0 : split.bits);
+        uint32_t counts[1 << QGEN_TABLE_MAX_BITS];
+        size_t **lists = NULL;
+        size_t *lengths = NULL;
+        if (err == 0) {
+            // Tasks hand their lists to other threads, so these come from the heap and not from an arena
+            lists = calloc(entries, sizeof(size_t *));
+            lengths = malloc(entries * sizeof(size_t));
+            task->children = calloc(entries, sizeof(qgen_gen_task_t *));
+            if (lists == NULL || lengths == NULL || task->children == NULL) err = ENOMEM;
+        }
+        if (err == 0) {
+            qgen_table_counts(&gentree->tree, task->patterns, length, split.lsb, split.bits, counts);
+            for (size_t j = 0; j < entries; j++) {
+                lists[j] = malloc(counts[j] * sizeof(size_t) + 1);
+                if (lists[j] == NULL) err = ENOMEM;
+            }
+        }
+        if (err == 0) qgen_partition(&gentree->tree, task->patterns, length, split, lists, lengths);
+        for (size_t j = 0; err == 0 && j < entries; j++) {
+            task->children[j] = calloc(1, sizeof(qgen_gen_task_t));
+            if (task->children[j] == NULL) {
+                err = ENOMEM;
+                break;
+            }
+            task->children[j]->patterns = lists[j];
+            task->children[j]->length = lengths[j];
+            lists[j] = NULL;
+        }
+        if (err == 0) {
+            task->split = split;
+            free(task->patterns);
+            task->patterns = NULL;
+
+            // Children have to be accounted for before anyone can finish them
+            qgen_mutex_lock(&pool->lock);
+            pool->pending += entries;
+            qgen_mutex_unlock(&pool->lock);
+            // Pushed last to first, so the owner continues depth first on the zero side
+            for (size_t j = entries; j-- > 0; ) {
+                if (qgen_pool_push(worker, task->children[j]) != 0) {
+                    // Not queued, run it right away instead
+                    qgen_pool_run(worker, task->children[j]);
+                }
+            }
+        }
+        if (lists) {
+            for (size_t j = 0; j < entries; j++) {
+                free(lists[j]);
+            }
+            free(lists);
+        }
+        free(lengths);
+        if (err && task->children) {
+            for (size_t j = 0; j < entries; j++) {
+                qgen_free_task(task->children[j]);
+            }
+            free(task->children);
+            task->children = NULL;
+        }
+    }
+    if (err) qgen_pool_fail(pool, err);
+
+    qgen_mutex_lock(&pool->lock);
+    if (--pool->pending == 0) qgen_cond_broadcast(&pool->wake);
+    qgen_mutex_unlock(&pool->lock);
+}
+
+static void qgen_pool_worker(qgen_gen_worker_t *worker) {
+    qgen_gen_pool_t *pool = worker->pool;
+    while (1) {
+        qgen_gen_task_t *task = qgen_pool_take(&worker->deque, 0);
+        // Nothing local, try to steal from the others, starting from the next worker
+        for (size_t i = 1; task == NULL && i < pool->worker_count; i++) {
+            task = qgen_pool_take(&pool->workers[(worker->index + i) % pool->worker_count].deque, 1);
+        }
+        if (task) {
+            qgen_mutex_lock(&pool->lock);
+            pool->queued--;
+            qgen_mutex_unlock(&pool->lock);
+            qgen_pool_run(worker, task);
+            continue;
+        }
+
+        qgen_mutex_lock(&pool->lock);
+        while (pool->queued == 0 && pool->pending > 0) {
+            qgen_cond_wait(&pool->wake, &pool->lock);
+        }
+        int done = pool->pending == 0;
+        qgen_mutex_unlock(&pool->lock);
+        if (done) return;
+    }
+}
+
+#ifdef _WIN32
+static DWORD WINAPI qgen_pool_thread(LPVOID arg) {
+    qgen_pool_worker(arg);
+    return 0;
+}
+#else
+static void *qgen_pool_thread(void *arg) {
+    qgen_pool_worker(arg);
+    return NULL;
+}
+#endif
+
+// Appends a node of a fragment relocated to where the fragment is copied. Binary splits may have to turn wide when
+// their children move past the reach of a compact node.
+static int qgen_relocate_node(qgen_otree_gen_t *out, qgen_otree_node_t node, size_t node_delta, size_t bucket_delta, size_t table_delta) {
+    if (QGEN_NODE_IS_LEAF(node)) {
+        return qgen_gen_push_node(out, QGEN_NODE_LEAF(QGEN_NODE_WEIGHT(node), QGEN_NODE_BUCKET(node) + bucket_delta));
+    }
+    if (QGEN_NODE_IS_TABLE(node)) {
+        return qgen_gen_push_node(out, QGEN_NODE_TABLE(QGEN_NODE_FIELD_LSB(node), QGEN_NODE_FIELD_BITS(node), QGEN_NODE_WEIGHT(node), QGEN_NODE_TABLE_OFFSET(node) + table_delta));
+    }
+    return qgen_gen_push_binary(out, QGEN_NODE_SPLIT_BIT(node), QGEN_NODE_WEIGHT(node), QGEN_NODE_LEFT(node) + node_delta, QGEN_NODE_RIGHT(node) + node_delta);
+}
+
+// Copies the task tree into out in the same post-order the serial generator produces
+static int qgen_pool_stitch(qgen_otree_gen_t *out, qgen_gen_pool_t *pool, qgen_gen_task_t *task) {
+    qgen_otree_t *tree = &out->tree;
+    int err = 0;
+    if (task->split.bits == 0) {
+        qgen_otree_t *src = &pool->workers[task->worker].gentree.tree;
+        // Deltas wrap around when moving down, which unsigned arithmetic takes care of
+        size_t node_delta = tree->node_count - task->node_start;
+        size_t bucket_delta = tree->bucket_count - task->bucket_start;
+        size_t table_delta = tree->table_length - task->table_start;
+
+        for (size_t b = task->bucket_start; b < task->bucket_end; b++) {
+            err = qgen_gen_push_bucket(out, src->buckets[b].pattern_ids, src->buckets[b].pattern_count);
+            if (err) return err;
+        }
+        err = qgen_gen_grow_tables(out, task->table_end - task->table_start);
+        if (err) return err;
+        for (size_t t = task->table_start; t < task->table_end; t++) {
+            tree->tables[tree->table_length++] = (uint32_t) (src->tables[t] + node_delta);
+        }
+        for (size_t n = task->node_start; n < task->node_end; n++) {
+            err = qgen_relocate_node(out, src->nodes[n], node_delta, bucket_delta, table_delta);
+            if (err) return err;
+        }
+        return 0;
+    }
+
+    size_t entries = (size_t) 1 << task->split.bits;
+    size_t *child_nodes = malloc(entries * sizeof(size_t));
+    if (child_nodes == NULL) return ENOMEM;
+    for (size_t j = 0; j < entries; j++) {
+        err = qgen_pool_stitch(out, pool, task->children[j]);
+        if (err) break;
+        child_nodes[j] = tree->node_count - 1;
+    }
+    if (err == 0) err = qgen_gen_push_split(out, task->split, child_nodes);
+    free(child_nodes);
+    return err;
+}
+
+static void qgen_free_task(qgen_gen_task_t *task) {
+    if (task == NULL) return;
+    free(task->patterns);
+    if (task->children) {
+        for (size_t j = 0; j < ((size_t) 1 << task->split.bits); j++) {
+            qgen_free_task(task->children[j]);
+        }
+        free(task->children);
+    }
+    free(task);
+}
+
+static size_t qgen_cpu_count(void) {
+#ifdef _WIN32
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+    return info.dwNumberOfProcessors;
+#else
+    long count = sysconf(_SC_NPROCESSORS_ONLN);
+    return count > 0 ? (size_t) count : 1;
+#endif
+}
+
+// Builds the tree of a prepared generator on nthreads threads, the root list is handed over
+static int qgen_gen_parallel(qgen_otree_gen_t *gentree, size_t *pats, size_t length, size_t nthreads) {
+    qgen_gen_pool_t pool = {0};
+    qgen_gen_task_t *root = calloc(1, sizeof(qgen_gen_task_t));
+    size_t started = 0;
+    int err = 0;
+    if (root == NULL) {
+        free(pats);
+        return ENOMEM;
+    }
+    root->patterns = pats;
+    root->length = length;
+
+    pool.workers = calloc(nthreads, sizeof(qgen_gen_worker_t));
+    if (pool.workers == NULL) {
+        err = ENOMEM;
+        goto cleanup;
+    }
+    pool.worker_count = nthreads;
+    pool.pending = 1;
+    qgen_mutex_init(&pool.lock);
+    qgen_cond_init(&pool.wake);
+    for (size_t i = 0; i < nthreads; i++) {
+        qgen_gen_worker_t *worker = &pool.workers[i];
+        // Every worker generates with the same settings into its own arrays
+        worker->gentree = *gentree;
+        worker->pool = &pool;
+        worker->index = i;
+        qgen_mutex_init(&worker->deque.lock);
+    }
+
+    // The calling thread is worker 0
+    pool.queued = 1;
+    pool.workers[0].deque.tasks = malloc(16 * sizeof(qgen_gen_task_t *));
+    if (pool.workers[0].deque.tasks == NULL) {
+        err = ENOMEM;
+        goto cleanup;
+    }
+    pool.workers[0].deque.capacity = 16;
+    pool.workers[0].deque.tasks[pool.workers[0].deque.tail++] = root;
+    for (started = 1; started < nthreads; started++) {
+        if (qgen_thread_start(&pool.workers[started].thread, qgen_pool_thread, &pool.workers[started]) != 0) break;
+    }
+    qgen_pool_worker(&pool.workers[0]);
+    for (size_t i = 1; i < started; i++) {
+        qgen_thread_join(pool.workers[i].thread);
+    }
+
+    err = pool.err;
+    if (err == 0) err = qgen_pool_stitch(gentree, &pool, root);
+
+cleanup:
+    if (pool.workers) {
+        for (size_t i = 0; i < pool.worker_count; i++) {
+            qgen_gen_discard(&pool.workers[i].gentree);
+            free(pool.workers[i].deque.tasks);
+            qgen_mutex_destroy(&pool.workers[i].deque.lock);
+        }
+        qgen_mutex_destroy(&pool.lock);
+        qgen_cond_destroy(&pool.wake);
+        free(pool.workers);
+    }
+    qgen_free_task(root);
+    return err;
+}
+
+qgen_otree_t *qgen_generate_tree_parallel(qgen_bitpattern_t *patterns, size_t nthreads) {
+    qgen_gen_options_t options = {.nthreads = nthreads ? nthreads : qgen_cpu_count()};
+    return qgen_generate_tree_ex(patterns, &options);
+}
+
+qgen_otree_t *qgen_generate_tree_ex(qgen_bitpattern_t *patterns, const qgen_gen_options_t *options) {
+    size_t *pats = NULL;
+    size_t length = 0;
+    qgen_otree_gen_t gentree = {0};
+    size_t root = 0;
+    int err = qgen_gen_prepare(&gentree, patterns, &pats, &length);
+    if (err == 0) err = qgen_gen_configure(&gentree, options, length);
+    if (err == 0 && options && options->nthreads > 1) {
+        err = qgen_gen_parallel(&gentree, pats, length, options->nthreads);
+        pats = NULL;
+    } else if (err == 0) {
+        err = qgen_generate_tree_helper(&gentree, pats, length, &root);
+    }
+    free(pats);
+    free(gentree.weights);
+    gentree.weights = NULL;
+    return qgen_gen_finish(&gentree, err);
+}
+
+void qgen_tree_count_hits(qgen_otree_t *tree, const uint64_t *high, const uint64_t *low, size_t n, uint64_t *hits) {
+    for (size_t i = 0; i < n; i++) {
+        intptr_t match = qgen_tree_dispatch(tree, high[i], low[i]);
+        if (match >= 0) hits[match]++;
+    }
+}
+
+// Fill color of a node, white to red by the share of dispatches that went through it
+static void qgen_dot_fill(FILE *f, const qgen_stats_t *stats, size_t node_idx, const char *color) {
+    if (stats == NULL) {
+        fprintf(f, "fillcolor=%s", color);
+        return;
+    }
+    double heat = stats->dispatches ? (double) stats->node_visits[node_idx] / (double) stats->dispatches : 0.0;
+    fprintf(f, "fillcolor=\"0.000 %.3f 1.000\"", heat > 1.0 ? 1.0 : heat);
+}
+
+static void qgen_export_dot_helper(FILE *f, qgen_otree_t *tree, const qgen_stats_t *stats, size_t node_idx, uint8_t *emitted) {
+    // Shared subtrees are drawn once, with an edge from every parent
+    if (emitted[node_idx]) return;
+    emitted[node_idx] = 1;
+    qgen_otree_node_t node = tree->nodes[node_idx];
+
+    if (QGEN_NODE_IS_LEAF(node)) {
+        size_t bucket_id = QGEN_NODE_BUCKET(node);
+        size_t pattern_count = qgen_bucket_length(tree, bucket_id);
+        
+        // Render Leaf Node (Box shape)
+        fprintf(f, "    node_%"PRIuPTR" [shape=record, style=filled, ", (uintptr_t) node_idx);
+        qgen_dot_fill(f, stats, node_idx, "lightgrey");
+        fprintf(
+            f,
+            ", label=\"{LEAF | Pat Count: %"PRIuPTR" | Bucket ID: %"PRIuPTR"",
+            (uintptr_t) pattern_count,
+            (uintptr_t) bucket_id
+        );
+        if (stats) {
+            fprintf(f, " | Visits: %"PRIu64" | Misses: %"PRIu64"", stats->node_visits[node_idx], stats->bucket_misses[bucket_id]);
+        }
+        fprintf(f, "}\"];\n");
+        return;
+    }
+
+    if (QGEN_NODE_IS_TABLE(node)) {
+        // Render Table Node (Octagon), one edge per field value
+        uint64_t lsb = QGEN_NODE_FIELD_LSB(node);
+        uint64_t bits = QGEN_NODE_FIELD_BITS(node);
+        fprintf(f, "    node_%"PRIuPTR" [shape=octagon, style=filled, ", (uintptr_t) node_idx);
+        qgen_dot_fill(f, stats, node_idx, "white");
+        fprintf(f, ", label=\"Bits %" PRIu64 "..%" PRIu64 "", lsb + bits - 1, lsb);
+        if (stats) fprintf(f, "\\nVisits: %"PRIu64"", stats->node_visits[node_idx]);
+        fprintf(f, "\"];\n");
+        const uint32_t *table = &tree->tables[QGEN_NODE_TABLE_OFFSET(node)];
+        for (uint64_t j = 0; j < (1ULL << bits); j++) {
+            fprintf(f, "    node_%"PRIuPTR" -> node_%"PRIuPTR" [label=\"%" PRIu64 "\"];\n", (uintptr_t) node_idx, (uintptr_t) table[j], j);
+        }
+        for (uint64_t j = 0; j < (1ULL << bits); j++) {
+            qgen_export_dot_helper(f, tree, stats, table[j], emitted);
+        }
+        return;
+    }
+
+    // Render Intermediate Node (Circle/Ellipse)
+    // Display the Bit Index being tested
+    uint64_t bit = QGEN_NODE_SPLIT_BIT(node);
+    fprintf(f, "    node_%"PRIuPTR" [shape=ellipse, style=filled, ", (uintptr_t) node_idx);
+    qgen_dot_fill(f, stats, node_idx, "white");
+    fprintf(f, ", label=\"Bit %" PRIu64 "", bit);
+    if (stats) fprintf(f, "\\nVisits: %"PRIu64"", stats->node_visits[node_idx]);
+    fprintf(f, "\"];\n");
+
+    // Edges
+    size_t zero_idx = QGEN_NODE_LEFT(node);
+    size_t one_idx  = QGEN_NODE_RIGHT(node);
+
+    // 0 Edge (False/Low) - Dotted line
+    fprintf(f, "    node_%"PRIuPTR" -> node_%"PRIuPTR" [label=\"0\", style=dashed];\n", (uintptr_t) node_idx, (uintptr_t) zero_idx);
+    
+    // 1 Edge (True/High) - Solid line
+    fprintf(f, "    node_%"PRIuPTR" -> node_%"PRIuPTR" [label=\"1\", style=bold];\n", (uintptr_t) node_idx, (uintptr_t) one_idx);
+
+    // Recurse
+    qgen_export_dot_helper(f, tree, stats, zero_idx, emitted);
+    qgen_export_dot_helper(f, tree, stats, one_idx, emitted);
+}
+
+static int qgen_export_dot_file(FILE *f, qgen_otree_t *tree, const qgen_stats_t *stats) {
+    uint8_t *emitted = calloc(tree->node_count, 1);
+    if (emitted == NULL) return errno = ENOMEM;
+
+    fprintf(f, "digraph QGenTree {\n");
+    fprintf(f, "    rankdir=TB;\n"); // Top-to-Bottom layout
+    fprintf(f, "    node [fontname=\"Helvetica\"];\n");
+    fprintf(f, "    edge [fontname=\"Helvetica\", fontsize=10];\n");
+
+    // Start recursion from the root
+    // In your generation logic, the root is the last node added.
+    size_t root_idx = tree->node_count - 1;
+    qgen_export_dot_helper(f, tree, stats, root_idx, emitted);
+
+    fprintf(f, "}\n");
+    free(emitted);
+    return 0;
+}
+
+void qgen_export_to_dot(qgen_otree_t *tree, const char *filename) {
+    if (!tree || tree->node_count == 0) return;
+
+    FILE *f = qgen_fopen(filename, "w");
+    if (!f) {
+        perror("Failed to open dot file");
+        return;
+    }
+
+    if (qgen_export_dot_file(f, tree, NULL) != 0) perror("Failed to export dot file");
+    fclose(f);
+    printf("Tree exported to %s\n", filename);
+}
+
+static void qgen_export_c_helper(FILE *f, qgen_otree_t *tree, size_t node_idx, uint8_t *emitted) {
+    if (emitted[node_idx]) return;
+    emitted[node_idx] = 1;
+    qgen_otree_node_t node = tree->nodes[node_idx];
+
+    // Nothing jumps back to the root, a label there would be unused
+    if (node_idx != tree->node_count - 1) fprintf(f, "node_%"PRIuPTR":\n", (uintptr_t) node_idx);
+    if (QGEN_NODE_IS_LEAF(node)) {
+        // Unrolled bucket, every mask and value is an immediate
+        size_t bucket_id = QGEN_NODE_BUCKET(node);
+        for (size_t i = 0; i < qgen_bucket_length(tree, bucket_id); i++) {
+            size_t pat_idx = qgen_bucket_pattern(tree, bucket_id, i);
+            qgen_bitpattern_t pat = tree->patterns[pat_idx];
+            fprintf(f, "    if ((low & 0x%016"PRIX64"ULL) == 0x%016"PRIX64"ULL", pat.mask_low, pat.active_low);
+            if (pat.mask_high) {
+                fprintf(f, " && (high & 0x%016"PRIX64"ULL) == 0x%016"PRIX64"ULL", pat.mask_high, pat.active_high);
+            }
+            fprintf(f, ") return %"PRIuPTR";\n", (uintptr_t) pat_idx);
+        }
+        fprintf(f, "    return -1;\n");
+        return;
+    }
+
+    if (QGEN_NODE_IS_TABLE(node)) {
+        uint64_t lsb = QGEN_NODE_FIELD_LSB(node);
+        uint64_t bits = QGEN_NODE_FIELD_BITS(node);
+        const uint32_t *table = &tree->tables[QGEN_NODE_TABLE_OFFSET(node)];
+        fprintf(f, "    switch ((%s >> %u) & 0x%" PRIX64 ") {\n", lsb >= 64 ? "high" : "low", (unsigned) (lsb & 63), (uint64_t) ((1ULL << bits) - 1));
+        for (uint64_t j = 0; j < (1ULL << bits); j++) {
+            fprintf(f, "        case %" PRIu64 ": goto node_%"PRIuPTR";\n", j, (uintptr_t) table[j]);
+        }
+        fprintf(f, "    }\n    return -1;\n");
+        for (uint64_t j = 0; j < (1ULL << bits); j++) {
+            qgen_export_c_helper(f, tree, table[j], emitted);
+        }
+        return;
+    }
+
+    uint64_t bit = QGEN_NODE_SPLIT_BIT(node);
+    size_t zero_idx = QGEN_NODE_LEFT(node);
+    size_t one_idx  = QGEN_NODE_RIGHT(node);
+    fprintf(
+        f, "    if (%s & 0x%016"PRIX64"ULL) goto node_%"PRIuPTR";\n    goto node_%"PRIuPTR";\n",
+        bit >= 64 ? "high" : "low", (uint64_t) 1 << (bit & 63), (uintptr_t) one_idx, (uintptr_t) zero_idx
+    );
+    qgen_export_c_helper(f, tree, zero_idx, emitted);
+    qgen_export_c_helper(f, tree, one_idx, emitted);
+}
+
+int qgen_export_to_c(qgen_otree_t *tree, const char *filename, const char *fn_name) {
+    if (!tree || tree->node_count == 0 || !fn_name) return errno = EINVAL;
+    if (tree->flags & QGEN_TREE_WIDE) return errno = ENOTSUP;
+
+    uint8_t *emitted = calloc(tree->node_count, 1);
+    if (emitted == NULL) return errno = ENOMEM;
+
+    FILE *f = qgen_fopen(filename, "w");
+    if (!f) {
+        int err = errno ? errno : EIO;
+        free(emitted);
+        return errno = err;
+    }
+
+    fprintf(f, "// Generated by qgen, do not edit.\n");
+    fprintf(f, "// %"PRIuPTR" patterns, %"PRIuPTR" nodes, %"PRIuPTR" buckets, key width %u bits.\n",
+        (uintptr_t) tree->pattern_count, (uintptr_t) tree->node_count, (uintptr_t) tree->bucket_count, (unsigned) tree->width);
+    fprintf(f, "#include <stdint.h>\n\n");
+    fprintf(f, "// Returns the matching pattern index, or -1, same as qgen_tree_dispatch on the source tree.\n");
+    fprintf(f, "intptr_t %s(uint64_t high, uint64_t low) {\n", fn_name);
+    fprintf(f, "    (void) high;\n");
+
+    // Every node below the root gets a label, which also keeps shared subtrees from being emitted twice
+    qgen_export_c_helper(f, tree, tree->node_count - 1, emitted);
+
+    fprintf(f, "}\n");
+    free(emitted);
+    if (ferror(f)) {
+        fclose(f);
+        return errno = EIO;
+    }
+    if (fclose(f) != 0) return errno = EIO;
+    return 0;
+}
+
+void qgen_free_tree(qgen_otree_t *tree) {
+    if (tree) {
+        qgen_discard_partial_tree(tree);
+        if ((tree->flags & QGEN_TREE_OWNS_PATTERNS) && tree->patterns) {
+            qgen_free_array_list(tree->patterns);
+        }
+        if ((tree->flags & QGEN_TREE_OWNS_PATTERNS) && tree->wide_patterns) {
+            qgen_free_array_list(tree->wide_patterns);
+        }
+        if (tree->fields) qgen_free_array_list(tree->fields);
+        free(tree);
+    }
+}
+
+// ---- Frozen leaves ----
+
+static void *qgen_aligned_alloc(size_t alignment, size_t size) {
+#ifdef _WIN32
+    return _aligned_malloc(size, alignment);
+#else
+    void *ptr = NULL;
+    if (posix_memalign(&ptr, alignment, size) != 0) return NULL;
+    return ptr;
+#endif
+}
+
+static void qgen_aligned_free(void *ptr) {
+#ifdef _WIN32
+    _aligned_free(ptr);
+#else
+    free(ptr);
+#endif
+}
+
+static void qgen_discard_leaves(qgen_otree_t *tree) {
+    if (tree->leaves) {
+        qgen_aligned_free(tree->leaves);
+        tree->leaves = NULL;
+    }
+    tree->leaf_match = NULL;
+    tree->leaf_isa = QGEN_ISA_AUTO;
+}
+
+static intptr_t qgen_leaf_match_scalar(const qgen_leaf_t *leaf, uint64_t high, uint64_t low) {
+    for (uint32_t i = 0; i < leaf->pattern_count; i++) {
+        if ((low & leaf->mask_low[i]) == leaf->active_low[i] && (high & leaf->mask_high[i]) == leaf->active_high[i]) {
+            return leaf->pattern_ids[i];
+        }
+    }
+    return -1;
+}
+
+#ifdef QGEN_X86
+// All kernels build a bitmask of matching slots then pick the lowest, only the chunks holding patterns are compared
+
+QGEN_TARGET("sse2") static intptr_t qgen_leaf_match_sse2(const qgen_leaf_t *leaf, uint64_t high, uint64_t low) {
+    __m128i key_low = _mm_set1_epi64x((long long) low);
+    __m128i key_high = _mm_set1_epi64x((long long) high);
+    __m128i zero = _mm_setzero_si128();
+    uint32_t matches = 0;
+    for (uint32_t i = 0; i < leaf->pattern_count; i += 2) {
+        __m128i diff_low = _mm_xor_si128(_mm_and_si128(key_low, _mm_load_si128((const __m128i *) &leaf->mask_low[i])), _mm_load_si128((const __m128i *) &leaf->active_low[i]));
+        __m128i diff_high = _mm_xor_si128(_mm_and_si128(key_high, _mm_load_si128((const __m128i *) &leaf->mask_high[i])), _mm_load_si128((const __m128i *) &leaf->active_high[i]));
+        // No 64-bit compare in SSE2, a lane is zero if both of its 32-bit halves are
+        __m128i eq = _mm_cmpeq_epi32(_mm_or_si128(diff_low, diff_high), zero);
+        eq = _mm_and_si128(eq, _mm_shuffle_epi32(eq, _MM_SHUFFLE(2, 3, 0, 1)));
+        matches |= (uint32_t) _mm_movemask_pd(_mm_castsi128_pd(eq)) << i;
+    }
+    if (matches == 0) return -1;
+    return leaf->pattern_ids[qgen_ctz32(matches)];
+}
+
+QGEN_TARGET("avx2") static intptr_t qgen_leaf_match_avx2(const qgen_leaf_t *leaf, uint64_t high, uint64_t low) {
+    __m256i key_low = _mm256_set1_epi64x((long long) low);
+    __m256i key_high = _mm256_set1_epi64x((long long) high);
+    __m256i zero = _mm256_setzero_si256();
+    uint32_t matches = 0;
+    for (uint32_t i = 0; i < leaf->pattern_count; i += 4) {
+        __m256i diff_low = _mm256_xor_si256(_mm256_and_si256(key_low, _mm256_load_si256((const __m256i *) &leaf->mask_low[i])), _mm256_load_si256((const __m256i *) &leaf->active_low[i]));
+        __m256i diff_high = _mm256_xor_si256(_mm256_and_si256(key_high, _mm256_load_si256((const __m256i *) &leaf->mask_high[i])), _mm256_load_si256((const __m256i *) &leaf->active_high[i]));
+        __m256i eq = _mm256_cmpeq_epi64(_mm256_or_si256(diff_low, diff_high), zero);
+        matches |= (uint32_t) _mm256_movemask_pd(_mm256_castsi256_pd(eq)) << i;
+    }
+    if (matches == 0) return -1;
+    return leaf->pattern_ids[qgen_ctz32(matches)];
+}
+
+QGEN_TARGET("avx512f") static intptr_t qgen_leaf_match_avx512(const qgen_leaf_t *leaf, uint64_t high, uint64_t low) {
+    __m512i key_low = _mm512_set1_epi64((long long) low);
+    __m512i key_high = _mm512_set1_epi64((long long) high);
+    uint32_t matches = 0;
+    for (uint32_t i = 0; i < leaf->pattern_count; i += 8) {
+        __m512i diff_low = _mm512_xor_si512(_mm512_and_si512(key_low, _mm512_load_si512(&leaf->mask_low[i])), _mm512_load_si512(&leaf->active_low[i]));
+        __m512i diff_high = _mm512_xor_si512(_mm512_and_si512(key_high, _mm512_load_si512(&leaf->mask_high[i])), _mm512_load_si512(&leaf->active_high[i]));
+        __m512i diff = _mm512_or_si512(diff_low, diff_high);
+        matches |= (uint32_t) _mm512_testn_epi64_mask(diff, diff) << i;
+    }
+    if (matches == 0) return -1;
+    return leaf->pattern_ids[qgen_ctz32(matches)];
+}
+#endif
+
+static int qgen_cpu_supports(int isa) {
+    switch (isa) {
+        case QGEN_ISA_SCALAR:
+            return 1;
+#ifdef QGEN_X86
+#ifdef _MSC_VER
+        case QGEN_ISA_SSE2:
+        case QGEN_ISA_AVX2:
+        case QGEN_ISA_AVX512: {
+            int regs[4];
+            __cpuid(regs, 1);
+            if (isa == QGEN_ISA_SSE2) return (regs[3] >> 26) & 1;
+            // OS has to save the AVX (and for AVX-512 the opmask and upper ZMM) state
+            if (!((regs[2] >> 27) & 1)) return 0;
+            unsigned long long xcr0 = _xgetbv(0);
+            __cpuidex(regs, 7, 0);
+            if (isa == QGEN_ISA_AVX2) return (xcr0 & 0x6) == 0x6 && ((regs[1] >> 5) & 1);
+            return (xcr0 & 0xe6) == 0xe6 && ((regs[1] >> 16) & 1);
+        }
+#else
+        case QGEN_ISA_SSE2:
+            return __builtin_cpu_supports("sse2");
+        case QGEN_ISA_AVX2:
+            return __builtin_cpu_supports("avx2");
+        case QGEN_ISA_AVX512:
+            return __builtin_cpu_supports("avx512f");
+#endif
+#endif
+        default:
+            return 0;
+    }
+}
+
+// Copies a bucket into its frozen layout, EINVAL if it's too long to fit
+static int qgen_fill_leaf(qgen_otree_t *tree, size_t bucket_id, qgen_leaf_t *leaf) {
+    size_t length = qgen_bucket_length(tree, bucket_id);
+    if (length > QGEN_BUCKET_MAX_LENGTH) return EINVAL;
+    memset(leaf, 0, sizeof(*leaf));
+    leaf->pattern_count = (uint32_t) length;
+    for (size_t i = 0; i < QGEN_BUCKET_MAX_LENGTH; i++) {
+        if (i < length) {
+            size_t pat_idx = qgen_bucket_pattern(tree, bucket_id, i);
+            qgen_bitpattern_t pat = tree->patterns[pat_idx];
+            leaf->mask_low[i] = pat.mask_low;
+            leaf->mask_high[i] = pat.mask_high;
+            leaf->active_low[i] = pat.active_low;
+            leaf->active_high[i] = pat.active_high;
+            leaf->pattern_ids[i] = (uint32_t) pat_idx;
+        } else {
+            leaf->active_low[i] = ~0ULL;
+            leaf->active_high[i] = ~0ULL;
+        }
+    }
+    return 0;
+}
+
+int qgen_tree_freeze(qgen_otree_t *tree, int isa) {
+    if (!tree) return errno = EINVAL;
+    if (tree->flags & QGEN_TREE_WIDE) return errno = ENOTSUP;
+    if (isa == QGEN_ISA_AUTO) {
+        isa = QGEN_ISA_AVX512;
+        while (!qgen_cpu_supports(isa)) isa--;
+    } else if (!qgen_cpu_supports(isa)) {
+        return errno = ENOTSUP;
+    }
+
+    qgen_leaf_t *leaves = qgen_aligned_alloc(64, (tree->bucket_count ? tree->bucket_count : 1) * sizeof(qgen_leaf_t));
+    if (leaves == NULL) return errno = ENOMEM;
+
+    for (size_t b = 0; b < tree->bucket_count; b++) {
+        if (qgen_fill_leaf(tree, b, &leaves[b]) != 0) {
+            qgen_aligned_free(leaves);
+            return errno = EINVAL;
+        }
+    }
+
+    qgen_discard_leaves(tree);
+    tree->leaves = leaves;
+    tree->leaf_isa = (uint8_t) isa;
+    switch (isa) {
+#ifdef QGEN_X86
+        case QGEN_ISA_SSE2: tree->leaf_match = qgen_leaf_match_sse2; break;
+        case QGEN_ISA_AVX2: tree->leaf_match = qgen_leaf_match_avx2; break;
+        case QGEN_ISA_AVX512: tree->leaf_match = qgen_leaf_match_avx512; break;
+#endif
+        default: tree->leaf_match = qgen_leaf_match_scalar; break;
+    }
+    return 0;
+}
+
+int qgen_tree_leaf_isa(qgen_otree_t *tree) {
+    return tree->leaf_isa;
+}
+
+// ---- Field decoding ----
+
+// Gathers the bits of word selected by mask into the low end, in order
+static inline uint64_t qgen_extract_bits(uint64_t word, uint64_t mask) {
+    if (mask == 0) return 0;
+    unsigned low = qgen_log2_floor64(mask & -mask);
+    uint64_t run = mask >> low;
+    // Most fields are a single run of bits
+    if ((run & (run + 1)) == 0) return (word >> low) & run;
+    uint64_t value = 0;
+    unsigned out = 0;
+    for (; mask; mask &= mask - 1, out++) {
+        value |= ((word >> qgen_log2_floor64(mask & -mask)) & 1) << out;
+    }
+    return value;
+}
+
+static void qgen_extract_fields_scalar(const qgen_fields_t *fields, uint64_t high, uint64_t low, uint64_t *values) {
+    for (uint32_t f = 0; f < fields->count; f++) {
+        const qgen_field_t *field = &fields->fields[f];
+        unsigned low_bits = qgen_popcount64(field->mask_low);
+        uint64_t hi = qgen_extract_bits(high, field->mask_high);
+        values[f] = (low_bits < 64 ? hi << low_bits : 0) | qgen_extract_bits(low, field->mask_low);
+    }
+}
+
+#if defined(__x86_64__) || defined(_M_X64)
+#define QGEN_HAS_PEXT
+QGEN_TARGET("bmi2,popcnt") static void qgen_extract_fields_bmi2(const qgen_fields_t *fields, uint64_t high, uint64_t low, uint64_t *values) {
+    for (uint32_t f = 0; f < fields->count; f++) {
+        const qgen_field_t *field = &fields->fields[f];
+        unsigned low_bits = (unsigned) _mm_popcnt_u64(field->mask_low);
+        uint64_t hi = _pext_u64(high, field->mask_high);
+        values[f] = (low_bits < 64 ? hi << low_bits : 0) | _pext_u64(low, field->mask_low);
+    }
+}
+
+static int qgen_cpu_has_bmi2(void) {
+#ifdef _MSC_VER
+    int regs[4];
+    __cpuidex(regs, 7, 0);
+    return (regs[1] >> 8) & 1;
+#else
+    return __builtin_cpu_supports("bmi2");
+#endif
+}
+#endif
+
+int qgen_tree_set_fields(qgen_otree_t *tree, const qgen_fields_t *fields) {
+    if (tree == NULL) return errno = EINVAL;
+    if (tree->flags & QGEN_TREE_WIDE) return errno = ENOTSUP;
+    size_t length = fields ? QGEN_ARRAY_HEADER(fields)->length : 0;
+    if (length > tree->pattern_count) return errno = EINVAL;
+
+    qgen_fields_t *aligned = NULL;
+    if (fields) {
+        aligned = qgen_new_array_list(length + 1, sizeof(qgen_fields_t));
+        if (aligned == NULL) return errno = ENOMEM;
+        for (size_t i = 0; i < length; i++) {
+            qgen_fields_t entry = fields[i];
+            if (entry.count > QGEN_MAX_FIELDS) entry.count = QGEN_MAX_FIELDS;
+            // Fields were parsed against the pattern's own width, the tree holds it shifted to the tree width
+            for (uint32_t f = 0; f < entry.count; f++) {
+                uint64_t words[QGEN_KEY_MAX_WORDS] = {entry.fields[f].mask_low, entry.fields[f].mask_high};
+                qgen_shift_words(words, tree->patterns[i].shift);
+                entry.fields[f].mask_low = words[0];
+                entry.fields[f].mask_high = words[1];
+            }
+            qgen_al_push((void **) &aligned, &entry);
+        }
+    }
+
+    if (tree->fields) qgen_free_array_list(tree->fields);
+    tree->fields = aligned;
+    tree->extract_fields = qgen_extract_fields_scalar;
+#ifdef QGEN_HAS_PEXT
+    if (qgen_cpu_has_bmi2()) tree->extract_fields = qgen_extract_fields_bmi2;
+#endif
+    return 0;
+}
+
+const qgen_fields_t *qgen_tree_fields(qgen_otree_t *tree, size_t pattern_index) {
+    if (tree->fields == NULL || pattern_index >= QGEN_ARRAY_HEADER(tree->fields)->length) return NULL;
+    if (tree->fields[pattern_index].count == 0) return NULL;
+    return &tree->fields[pattern_index];
+}
+
+intptr_t qgen_tree_decode(qgen_otree_t *tree, uint64_t high, uint64_t low, uint64_t *values) {
+    intptr_t id = qgen_tree_dispatch(tree, high, low);
+    if (id >= 0 && tree->fields && (size_t) id < QGEN_ARRAY_HEADER(tree->fields)->length) {
+        tree->extract_fields(&tree->fields[id], high, low, values);
+    }
+    return id;
+}
+
+// ---- JIT ----
+
+#if defined(__x86_64__) || defined(_M_X64)
+#define QGEN_JIT
+#endif
+
+// A rel32 field at offset at, holding the distance from base to the code of node
+typedef struct qgen_jit_fixup {
+    size_t at;
+    size_t base;
+    size_t node;
+} qgen_jit_fixup_t;
+
+typedef struct qgen_jit {
+    qgen_otree_t *tree;
+    uint8_t *code;
+    size_t length;
+    size_t capacity;
+    size_t *node_offsets; // SIZE_MAX until the node is emitted
+    qgen_jit_fixup_t *fixups;
+    int err;
+} qgen_jit_t;
+
+static void qgen_jit_bytes(qgen_jit_t *jit, const void *bytes, size_t n) {
+    if (jit->err) return;
+    if (jit->length + n > jit->capacity) {
+        size_t capacity = jit->capacity * 2 + n + 4096;
+        uint8_t *code = realloc(jit->code, capacity);
+        if (code == NULL) {
+            jit->err = ENOMEM;
+            return;
+        }
+        jit->code = code;
+        jit->capacity = capacity;
+    }
+    memcpy(&jit->code[jit->length], bytes, n);
+    jit->length += n;
+}
+
+static void qgen_jit_u32(qgen_jit_t *jit, uint32_t value) {
+    qgen_jit_bytes(jit, &value, 4);
+}
+
+static void qgen_jit_u64(qgen_jit_t *jit, uint64_t value) {
+    qgen_jit_bytes(jit, &value, 8);
+}
+
+// Emits a rel32 to the code of node, counted from base, patched at the end if the node isn't emitted yet
+static void qgen_jit_ref(qgen_jit_t *jit, size_t base, size_t node) {
+    qgen_jit_fixup_t fixup = {jit->length, base, node};
+    if (jit->err == 0 && jit->node_offsets[node] == SIZE_MAX && qgen_al_push((void **) &jit->fixups, &fixup) != 0) {
+        jit->err = ENOMEM;
+    }
+    qgen_jit_u32(jit, (uint32_t) (jit->node_offsets[node] - base));
+}
+
+// Key registers of the generated code, high lives in r10 and low in r11
+#define QGEN_JIT_REG(bit) ((bit) >= 64 ? 2 : 3)
+
+static void qgen_jit_node(qgen_jit_t *jit, size_t node_id) {
+    qgen_otree_t *tree = jit->tree;
+    qgen_otree_node_t node = tree->nodes[node_id];
+    jit->node_offsets[node_id] = jit->length;
+
+    if (QGEN_NODE_IS_LEAF(node)) {
+        // Every pattern is an immediate mask and value per word, a mismatch skips to the next pattern
+        size_t bucket_id = QGEN_NODE_BUCKET(node);
+        for (size_t i = 0; i < qgen_bucket_length(tree, bucket_id); i++) {
+            size_t pat_idx = qgen_bucket_pattern(tree, bucket_id, i);
+            const qgen_bitpattern_t *pat = &tree->patterns[pat_idx];
+            size_t skips[2], skip_count = 0;
+            uint64_t masks[2] = {pat->mask_low, pat->mask_high}, values[2] = {pat->active_low, pat->active_high};
+            for (int word = 0; word < 2; word++) {
+                // Removed patterns keep a value under an empty mask and must still fail
+                if (masks[word] == 0 && values[word] == 0) continue;
+                if (masks[word] <= UINT32_MAX && values[word] <= UINT32_MAX) {
+                    // Narrow masks fit the 32-bit immediates, mov eax, r10d/r11d; and eax, mask; cmp eax, value
+                    qgen_jit_bytes(jit, (const uint8_t[]) {0x44, 0x89, word ? 0xD0 : 0xD8, 0x25}, 4);
+                    qgen_jit_u32(jit, (uint32_t) masks[word]);
+                    qgen_jit_bytes(jit, (const uint8_t[]) {0x3D}, 1);
+                    qgen_jit_u32(jit, (uint32_t) values[word]);
+                    qgen_jit_bytes(jit, (const uint8_t[]) {0x75, 0x00}, 2); // jne rel8
+                } else {
+                    qgen_jit_bytes(jit, (const uint8_t[]) {0x48, 0xB8}, 2); // mov rax, mask
+                    qgen_jit_u64(jit, masks[word]);
+                    qgen_jit_bytes(jit, (const uint8_t[]) {0x4C, 0x21, word ? 0xD0 : 0xD8}, 3); // and rax, r10/r11
+                    qgen_jit_bytes(jit, (const uint8_t[]) {0x48, 0xB9}, 2); // mov rcx, value
+                    qgen_jit_u64(jit, values[word]);
+                    qgen_jit_bytes(jit, (const uint8_t[]) {0x48, 0x39, 0xC8, 0x75, 0x00}, 5); // cmp rax, rcx; jne rel8
+                }
+                skips[skip_count++] = jit->length - 1;
+            }
+            if ((uint64_t) pat_idx <= UINT32_MAX) {
+                qgen_jit_bytes(jit, (const uint8_t[]) {0xB8}, 1); // mov eax, index
+                qgen_jit_u32(jit, (uint32_t) pat_idx);
+            } else {
+                qgen_jit_bytes(jit, (const uint8_t[]) {0x48, 0xB8}, 2); // mov rax, index
+                qgen_jit_u64(jit, pat_idx);
+            }
+            qgen_jit_bytes(jit, (const uint8_t[]) {0xC3}, 1); // ret
+            // A pattern takes at most 67 bytes, two 28 byte word checks, mov rax and ret, the skips always fit rel8
+            for (size_t k = 0; k < skip_count && jit->err == 0; k++) {
+                assert(jit->length - skips[k] - 1 <= 127);
+                jit->code[skips[k]] = (uint8_t) (jit->length - skips[k] - 1);
+            }
+        }
+        qgen_jit_bytes(jit, (const uint8_t[]) {0x48, 0xC7, 0xC0, 0xFF, 0xFF, 0xFF, 0xFF, 0xC3}, 8); // mov rax, -1; ret
+        return;
+    }
+
+    size_t children[(size_t) 1 << QGEN_TABLE_MAX_BITS];
+    size_t count = qgen_node_children(tree, node, children);
+    uint64_t bit = QGEN_NODE_SPLIT_BIT(node);
+    uint8_t reg = QGEN_JIT_REG(bit);
+    if (count == 2) {
+        // bt reg, bit; jc one
+        qgen_jit_bytes(jit, (const uint8_t[]) {0x49, 0x0F, 0xBA, (uint8_t) (0xE0 | reg), (uint8_t) (bit & 63), 0x0F, 0x82}, 7);
+        qgen_jit_ref(jit, jit->length + 4, children[1]);
+        // The zero side follows right away unless it is shared and already emitted
+        if (jit->node_offsets[children[0]] == SIZE_MAX) {
+            qgen_jit_node(jit, children[0]);
+        } else {
+            qgen_jit_bytes(jit, (const uint8_t[]) {0xE9}, 1);
+            qgen_jit_ref(jit, jit->length + 4, children[0]);
+        }
+        if (jit->node_offsets[children[1]] == SIZE_MAX) qgen_jit_node(jit, children[1]);
+        return;
+    }
+
+    // mov rax, reg; shr rax, lsb; and eax, field mask; then jump through a table of rel32 that follows the code
+    qgen_jit_bytes(jit, (const uint8_t[]) {0x4C, 0x89, (uint8_t) (0xC0 | (reg << 3))}, 3);
+    if (bit & 63) qgen_jit_bytes(jit, (const uint8_t[]) {0x48, 0xC1, 0xE8, (uint8_t) (bit & 63)}, 4);
+    qgen_jit_bytes(jit, (const uint8_t[]) {0x25}, 1);
+    qgen_jit_u32(jit, (uint32_t) (count - 1));
+    static const uint8_t jump[] = {
+        0x48, 0x8D, 0x0D, 0x09, 0x00, 0x00, 0x00, // lea rcx, [rip + 9], the table
+        0x48, 0x63, 0x04, 0x81, // movsxd rax, dword [rcx + rax * 4]
+        0x48, 0x01, 0xC8, // add rax, rcx
+        0xFF, 0xE0, // jmp rax
+    };
+    qgen_jit_bytes(jit, jump, sizeof(jump));
+    size_t table = jit->length;
+    for (size_t j = 0; j < count; j++) {
+        qgen_jit_ref(jit, table, children[j]);
+    }
+    for (size_t j = 0; j < count; j++) {
+        if (jit->node_offsets[children[j]] == SIZE_MAX) qgen_jit_node(jit, children[j]);
+    }
+}
+
+static void qgen_discard_jit(qgen_otree_t *tree) {
+    if (tree->jit_code == NULL) return;
+#ifdef _WIN32
+    VirtualFree(tree->jit_code, 0, MEM_RELEASE);
+#else
+    munmap(tree->jit_code, tree->jit_size);
+#endif
+    tree->jit_code = NULL;
+    tree->jit_size = 0;
+}
+
+// Copies code into fresh pages that are made executable once written
+static uint8_t *qgen_jit_map(const uint8_t *code, size_t length) {
+#ifdef _WIN32
+    uint8_t *pages = VirtualAlloc(NULL, length, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
+    if (pages == NULL) return NULL;
+    memcpy(pages, code, length);
+    DWORD old;
+    if (!VirtualProtect(pages, length, PAGE_EXECUTE_READ, &old)) {
+        VirtualFree(pages, 0, MEM_RELEASE);
+        return NULL;
+    }
+    FlushInstructionCache(GetCurrentProcess(), pages, length);
+    return pages;
+#else
+    void *pages = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (pages == MAP_FAILED) return NULL;
+    memcpy(pages, code, length);
+    if (mprotect(pages, length, PROT_READ | PROT_EXEC) != 0) {
+        munmap(pages, length);
+        return NULL;
+    }
+    return pages;
+#endif
+}
+
+qgen_dispatch_fn_t qgen_tree_jit(qgen_otree_t *tree) {
+    if (tree == NULL || tree->node_count == 0) {
+        errno = EINVAL;
+        return NULL;
+    }
+    if (tree->flags & QGEN_TREE_WIDE) {
+        errno = ENOTSUP;
+        return NULL;
+    }
+#ifndef QGEN_JIT
+    return qgen_tree_dispatch;
+#else
+    qgen_jit_t jit = {0};
+    jit.tree = tree;
+    jit.node_offsets = malloc(tree->node_count * sizeof(size_t));
+    jit.fixups = qgen_new_array_list(64, sizeof(qgen_jit_fixup_t));
+    if (jit.node_offsets == NULL || jit.fixups == NULL) jit.err = ENOMEM;
+    else memset(jit.node_offsets, 0xff, tree->node_count * sizeof(size_t));
+
+    // The key moves to r10 (high) and r11 (low), caller-saved in both calling conventions
+#ifdef _WIN32
+    qgen_jit_bytes(&jit, (const uint8_t[]) {0x49, 0x89, 0xD2, 0x4D, 0x89, 0xC3}, 6); // mov r10, rdx; mov r11, r8
+#else
+    qgen_jit_bytes(&jit, (const uint8_t[]) {0x49, 0x89, 0xF2, 0x49, 0x89, 0xD3}, 6); // mov r10, rsi; mov r11, rdx
+#endif
+    if (jit.err == 0) qgen_jit_node(&jit, tree->node_count - 1);
+    for (size_t i = 0; jit.err == 0 && i < QGEN_ARRAY_HEADER(jit.fixups)->length; i++) {
+        qgen_jit_fixup_t fixup = jit.fixups[i];
+        uint32_t rel = (uint32_t) (jit.node_offsets[fixup.node] - fixup.base);
+        memcpy(&jit.code[fixup.at], &rel, 4);
+    }
+
+    uint8_t *pages = NULL;
+    if (jit.err == 0) {
+        pages = qgen_jit_map(jit.code, jit.length);
+        if (pages == NULL) jit.err = ENOMEM;
+    }
+    free(jit.code);
+    free(jit.node_offsets);
+    if (jit.fixups) qgen_free_array_list(jit.fixups);
+    if (jit.err) {
+        errno = jit.err;
+        return NULL;
+    }
+    qgen_discard_jit(tree);
+    tree->jit_code = pages;
+    tree->jit_size = jit.length;
+    return (qgen_dispatch_fn_t) (void *) pages;
+#endif
+}
+
+// ---- Incremental updates ----
+
+// Expected hops plus bucket entries below a node for uniformly random keys. The cost of a node doesn't depend on
+// the path to it, costs caches it for shared subtrees (negative until known) and may be NULL.
+static double qgen_expected_cost(qgen_otree_t *tree, size_t node_id, double *costs) {
+    if (costs && costs[node_id] >= 0.0) return costs[node_id];
+    qgen_otree_node_t node = tree->nodes[node_id];
+    double cost;
+    if (QGEN_NODE_IS_LEAF(node)) {
+        cost = (double) qgen_bucket_length(tree, QGEN_NODE_BUCKET(node));
+    } else if (QGEN_NODE_IS_TABLE(node)) {
+        size_t entries = (size_t) 1 << QGEN_NODE_FIELD_BITS(node);
+        double sum = 0.0;
+        for (size_t j = 0; j < entries; j++) {
+            sum += qgen_expected_cost(tree, tree->tables[QGEN_NODE_TABLE_OFFSET(node) + j], costs);
+        }
+        cost = 1.0 + sum / (double) entries;
+    } else {
+        cost = 1.0 + 0.5 * (qgen_expected_cost(tree, QGEN_NODE_LEFT(node), costs) + qgen_expected_cost(tree, QGEN_NODE_RIGHT(node), costs));
+    }
+    if (costs) costs[node_id] = cost;
+    return cost;
+}
+
+static double qgen_tree_cost(qgen_otree_t *tree) {
+    double *costs = malloc(tree->node_count * sizeof(double));
+    // Without the cache shared subtrees are just visited once per path
+    for (size_t i = 0; costs && i < tree->node_count; i++) {
+        costs[i] = -1.0;
+    }
+    double cost = qgen_expected_cost(tree, tree->node_count - 1, costs);
+    free(costs);
+    return cost;
+}
+
+double qgen_tree_degradation(qgen_otree_t *tree) {
+    if (tree->base_cost <= 0.0 || tree->node_count == 0) return 0.0;
+    double degradation = qgen_tree_cost(tree) / tree->base_cost - 1.0;
+    degradation += (double) tree->dead_nodes / (double) tree->node_count;
+    return degradation > 0.0 ? degradation : 0.0;
+}
+
+// Counts the edges out of nodes [first, node_count) into parents
+static void qgen_count_parents(qgen_otree_t *tree, size_t first) {
+    for (size_t n = first; n < tree->node_count; n++) {
+        qgen_otree_node_t node = tree->nodes[n];
+        if (QGEN_NODE_IS_LEAF(node)) continue;
+        if (QGEN_NODE_IS_TABLE(node)) {
+            for (size_t j = 0; j < ((size_t) 1 << QGEN_NODE_FIELD_BITS(node)); j++) {
+                tree->parents[tree->tables[QGEN_NODE_TABLE_OFFSET(node) + j]]++;
+            }
+            continue;
+        }
+        tree->parents[QGEN_NODE_LEFT(node)]++;
+        tree->parents[QGEN_NODE_RIGHT(node)]++;
+    }
+}
+
+// Turns a compact tree into one whose arrays are allocated separately and can grow, the patterns are copied as well.
+// The compact block itself is the tree, so its space stays allocated until the tree is freed.
+static int qgen_tree_thaw(qgen_otree_t *tree) {
+    if (tree->flags & QGEN_TREE_MAPPED) return EROFS;
+    if (tree->parents == NULL) {
+        tree->parents = calloc(tree->node_count + 1, sizeof(uint32_t));
+        if (tree->parents == NULL) return ENOMEM;
+        qgen_count_parents(tree, 0);
+    }
+    if (tree->base_cost <= 0.0 && tree->node_count) tree->base_cost = qgen_tree_cost(tree);
+
+    if (!(tree->flags & QGEN_TREE_OWNS_PATTERNS) && (tree->flags & QGEN_TREE_WIDE)) {
+        qgen_wide_pattern_t *patterns = qgen_new_array_list(tree->pattern_count + 1, sizeof(qgen_wide_pattern_t));
+        if (patterns == NULL) return ENOMEM;
+        memcpy(patterns, tree->wide_patterns, tree->pattern_count * sizeof(qgen_wide_pattern_t));
+        QGEN_ARRAY_HEADER(patterns)->length = tree->pattern_count;
+        tree->wide_patterns = patterns;
+        tree->flags |= QGEN_TREE_OWNS_PATTERNS;
+    }
+    if (!(tree->flags & QGEN_TREE_OWNS_PATTERNS)) {
+        qgen_bitpattern_t *patterns = qgen_new_array_list(tree->pattern_count + 1, sizeof(qgen_bitpattern_t));
+        if (patterns == NULL) return ENOMEM;
+        memcpy(patterns, tree->patterns, tree->pattern_count * sizeof(qgen_bitpattern_t));
+        QGEN_ARRAY_HEADER(patterns)->length = tree->pattern_count;
+        tree->patterns = patterns;
+        tree->flags |= QGEN_TREE_OWNS_PATTERNS;
+    }
+    if (!(tree->flags & QGEN_TREE_COMPACT)) return 0;
+
+    qgen_otree_node_t *nodes = malloc(tree->node_count * sizeof(qgen_otree_node_t) + 1);
+    uint32_t *tables = malloc(tree->table_length * sizeof(uint32_t) + 1);
+    qgen_bucket_t *buckets = calloc(tree->bucket_count + 1, sizeof(qgen_bucket_t));
+    int err = nodes && tables && buckets ? 0 : ENOMEM;
+    for (size_t b = 0; err == 0 && b < tree->bucket_count; b++) {
+        size_t length = tree->buckets[b].pattern_count;
+        size_t *ids = qgen_new_array_list(length + 1, sizeof(size_t));
+        if (ids == NULL) {
+            err = ENOMEM;
+            break;
+        }
+        memcpy(ids, tree->buckets[b].pattern_ids, length * sizeof(size_t));
+        QGEN_ARRAY_HEADER(ids)->length = length;
+        buckets[b] = (qgen_bucket_t) {
+            .pattern_count = length,
+            .pattern_ids = ids,
+        };
+    }
+    if (err) {
+        for (size_t b = 0; buckets && b < tree->bucket_count; b++) {
+            if (buckets[b].pattern_ids) qgen_free_array_list(buckets[b].pattern_ids);
+        }
+        free(nodes);
+        free(tables);
+        free(buckets);
+        return err;
+    }
+
+    memcpy(nodes, tree->nodes, tree->node_count * sizeof(qgen_otree_node_t));
+    if (tree->table_length) memcpy(tables, tree->tables, tree->table_length * sizeof(uint32_t));
+    tree->nodes = nodes;
+    tree->tables = tables;
+    tree->buckets = buckets;
+    tree->flags &= ~QGEN_TREE_COMPACT;
+    return 0;
+}
+
+// Collects the leaves a pattern can reach, the only buckets a key matching it can end up in
+static void qgen_collect_leaves(qgen_otree_t *tree, const qgen_bitpattern_t *pat, size_t node_id, size_t **leaves, int *err) {
+    qgen_otree_node_t node = tree->nodes[node_id];
+    if (QGEN_NODE_IS_LEAF(node)) {
+        if (*err == 0) *err = qgen_al_push((void **) leaves, &node_id);
+        return;
+    }
+    if (QGEN_NODE_IS_TABLE(node)) {
+        uint64_t lsb = QGEN_NODE_FIELD_LSB(node), bits = QGEN_NODE_FIELD_BITS(node);
+        uint64_t cares = qgen_field(pat->mask_high, pat->mask_low, lsb, bits);
+        uint64_t value = qgen_field(pat->active_high, pat->active_low, lsb, bits);
+        for (uint64_t j = 0; j < (1ULL << bits); j++) {
+            if ((j & cares) == value) {
+                qgen_collect_leaves(tree, pat, tree->tables[QGEN_NODE_TABLE_OFFSET(node) + j], leaves, err);
+            }
+        }
+        return;
+    }
+    uint64_t bit = QGEN_NODE_SPLIT_BIT(node);
+    uint64_t cares = qgen_field(pat->mask_high, pat->mask_low, bit, 1);
+    uint64_t value = qgen_field(pat->active_high, pat->active_low, bit, 1);
+    if (!cares || !value) qgen_collect_leaves(tree, pat, QGEN_NODE_LEFT(node), leaves, err);
+    if (!cares || value) qgen_collect_leaves(tree, pat, QGEN_NODE_RIGHT(node), leaves, err);
+}
+
+// Keeps frozen leaves in sync, changed lists the buckets that were modified in place
+static void qgen_tree_refreeze(qgen_otree_t *tree, size_t frozen_buckets, const size_t *changed, size_t changed_count) {
+    if (tree->leaves == NULL) return;
+    if (tree->bucket_count == frozen_buckets) {
+        for (size_t i = 0; i < changed_count; i++) {
+            if (qgen_fill_leaf(tree, changed[i], &tree->leaves[changed[i]]) != 0) {
+                qgen_discard_leaves(tree);
+                return;
+            }
+        }
+        return;
+    }
+    // Buckets were added, leaves that can't be frozen fall back to the plain scan
+    if (qgen_tree_freeze(tree, tree->leaf_isa) != 0) qgen_discard_leaves(tree);
+}
+
+// Regenerates an overflowing leaf into a subtree. The subtree is appended, its root takes the place of the leaf and
+// the root of the tree moves back to the end, so nothing pointing at either has to change.
+static int qgen_tree_split_leaf(qgen_otree_t *tree, size_t leaf_node) {
+    size_t bucket_id = QGEN_NODE_BUCKET(tree->nodes[leaf_node]);
+    size_t *ids = tree->buckets[bucket_id].pattern_ids;
+    size_t length = tree->buckets[bucket_id].pattern_count;
+    size_t old_nodes = tree->node_count, old_buckets = tree->bucket_count;
+
+    qgen_otree_gen_t gentree = {0};
+    gentree.max_table_bits = QGEN_TABLE_MAX_BITS;
+    gentree.tree = *tree;
+    gentree.node_capacity = tree->node_count;
+    gentree.bucket_capacity = tree->bucket_count;
+    gentree.table_capacity = tree->table_length;
+    for (size_t i = 0; i < length; i++) {
+        gentree.mask[1] |= tree->patterns[ids[i]].mask_high;
+        gentree.mask[0] |= tree->patterns[ids[i]].mask_low;
+    }
+
+    size_t sub_root = 0;
+    int err = qgen_generate_tree_helper(&gentree, ids, length, &sub_root);
+    // The arrays may have moved even if generation failed
+    tree->nodes = gentree.tree.nodes;
+    tree->buckets = gentree.tree.buckets;
+    tree->tables = gentree.tree.tables;
+    // Patterns that all overlap come back as the same long leaf
+    if (err == 0 && QGEN_NODE_IS_LEAF(gentree.tree.nodes[sub_root])) err = EINVAL;
+    if (err == 0) {
+        uint32_t *parents = realloc(tree->parents, gentree.tree.node_count * sizeof(uint32_t));
+        if (parents == NULL) err = ENOMEM;
+        else tree->parents = parents;
+    }
+    // New buckets move out of the arena into lists of their own
+    size_t converted = old_buckets;
+    for (; err == 0 && converted < gentree.tree.bucket_count; converted++) {
+        qgen_bucket_t *bucket = &tree->buckets[converted];
+        size_t *list = qgen_new_array_list(bucket->pattern_count + 1, sizeof(size_t));
+        if (list == NULL) {
+            err = ENOMEM;
+            break;
+        }
+        memcpy(list, bucket->pattern_ids, bucket->pattern_count * sizeof(size_t));
+        QGEN_ARRAY_HEADER(list)->length = bucket->pattern_count;
+        bucket->pattern_ids = list;
+    }
+    qgen_arena_free(&gentree.scratch);
+    qgen_arena_free(&gentree.ids);
+    qgen_memo_free(&gentree);
+    if (err) {
+        for (size_t b = old_buckets; b < converted; b++) {
+            qgen_free_array_list(tree->buckets[b].pattern_ids);
+        }
+        return err;
+    }
+    tree->node_count = gentree.tree.node_count;
+    tree->bucket_count = gentree.tree.bucket_count;
+    tree->table_length = gentree.tree.table_length;
+    memset(&tree->parents[old_nodes], 0, (tree->node_count - old_nodes) * sizeof(uint32_t));
+    qgen_count_parents(tree, old_nodes);
+
+    // The subtree was built from scratch, so its root is the last node
+    size_t root = old_nodes - 1;
+    if (leaf_node != root) {
+        tree->nodes[leaf_node] = tree->nodes[sub_root];
+        tree->nodes[sub_root] = tree->nodes[root];
+    }
+    // The old slot keeps pointing at the emptied bucket
+    tree->nodes[root] = QGEN_NODE_LEAF(0, bucket_id);
+    QGEN_ARRAY_HEADER(ids)->length = 0;
+    tree->buckets[bucket_id].pattern_count = 0;
+    tree->dead_nodes++;
+    tree->dead_buckets++;
+    return 0;
+}
+
+static int qgen_compare_ids(const void *a, const void *b) {
+    size_t x = *(const size_t *) a, y = *(const size_t *) b;
+    return x < y ? -1 : x > y;
+}
+
+// Whether pattern a wins over pattern b when both match
+static inline int qgen_resolves_before(const qgen_otree_t *tree, size_t a, size_t b) {
+    uint16_t pa = tree->patterns[a].priority, pb = tree->patterns[b].priority;
+    return pa > pb || (pa == pb && a < b);
+}
+
+// Insertion sort into resolution order, buckets are short and usually sorted already
+static void qgen_sort_resolution(const qgen_otree_t *tree, size_t *ids, size_t length) {
+    for (size_t i = 1; i < length; i++) {
+        size_t id = ids[i], j = i;
+        for (; j > 0 && qgen_resolves_before(tree, id, ids[j - 1]); j--) ids[j] = ids[j - 1];
+        ids[j] = id;
+    }
+}
+
+intptr_t qgen_tree_insert(qgen_otree_t *tree, qgen_bitpattern_t pattern) {
+    if (tree == NULL || tree->node_count == 0 || pattern.width > tree->width) {
+        errno = EINVAL;
+        return -1;
+    }
+    if (tree->flags & QGEN_TREE_WIDE) {
+        errno = ENOTSUP;
+        return -1;
+    }
+    int err = qgen_tree_thaw(tree);
+    if (err) {
+        errno = err;
+        return -1;
+    }
+
+    qgen_align_pattern(&pattern, tree->width);
+    size_t *leaves = qgen_new_array_list(16, sizeof(size_t));
+    if (leaves == NULL) {
+        errno = ENOMEM;
+        return -1;
+    }
+    qgen_collect_leaves(tree, &pattern, tree->node_count - 1, &leaves, &err);
+    if (err == 0) err = qgen_al_push((void **) &tree->patterns, &pattern);
+    if (err) {
+        qgen_free_array_list(leaves);
+        errno = err;
+        return -1;
+    }
+    size_t id = tree->pattern_count++;
+    // Shared leaves are reached once per path, but take the pattern only once
+    size_t leaf_count = QGEN_ARRAY_HEADER(leaves)->length;
+    qsort(leaves, leaf_count, sizeof(size_t), qgen_compare_ids);
+    size_t unique = 0;
+    for (size_t i = 0; i < leaf_count; i++) {
+        if (unique == 0 || leaves[unique - 1] != leaves[i]) leaves[unique++] = leaves[i];
+    }
+    leaf_count = unique;
+
+    // The new pattern has the highest index, so it goes last wherever it lands unless its priority moves it up
+    size_t frozen_buckets = tree->bucket_count;
+    for (size_t i = 0; i < leaf_count; i++) {
+        qgen_bucket_t *bucket = &tree->buckets[QGEN_NODE_BUCKET(tree->nodes[leaves[i]])];
+        err = qgen_al_push((void **) &bucket->pattern_ids, &id);
+        if (err) {
+            // Undo the buckets done so far
+            while (i-- > 0) {
+                bucket = &tree->buckets[QGEN_NODE_BUCKET(tree->nodes[leaves[i]])];
+                QGEN_ARRAY_HEADER(bucket->pattern_ids)->length--;
+                bucket->pattern_count--;
+            }
+            tree->pattern_count--;
+            QGEN_ARRAY_HEADER(tree->patterns)->length--;
+            qgen_free_array_list(leaves);
+            errno = err;
+            return -1;
+        }
+        bucket->pattern_count++;
+    }
+    if (pattern.priority) {
+        for (size_t i = 0; i < leaf_count; i++) {
+            qgen_bucket_t *bucket = &tree->buckets[QGEN_NODE_BUCKET(tree->nodes[leaves[i]])];
+            qgen_sort_resolution(tree, bucket->pattern_ids, bucket->pattern_count);
+        }
+    }
+
+    for (size_t i = 0; i < leaf_count; i++) {
+        // Buckets that can't be split stay long, which dispatch handles and qgen_tree_degradation reports
+        if (tree->buckets[QGEN_NODE_BUCKET(tree->nodes[leaves[i]])].pattern_count > QGEN_BUCKET_MAX_LENGTH) {
+            qgen_tree_split_leaf(tree, leaves[i]);
+        }
+        leaves[i] = QGEN_NODE_BUCKET(tree->nodes[leaves[i]]);
+    }
+    qgen_tree_refreeze(tree, frozen_buckets, leaves, leaf_count);
+    qgen_free_array_list(leaves);
+    return (intptr_t) id;
+}
+
+static void qgen_bucket_drop(qgen_bucket_t *bucket, size_t pattern_index) {
+    for (size_t i = 0; i < bucket->pattern_count; i++) {
+        if (bucket->pattern_ids[i] == pattern_index) {
+            memmove(&bucket->pattern_ids[i], &bucket->pattern_ids[i + 1], (bucket->pattern_count - i - 1) * sizeof(size_t));
+            bucket->pattern_count--;
+            QGEN_ARRAY_HEADER(bucket->pattern_ids)->length--;
+            return;
+        }
+    }
+}
+
+// Merges two sorted lists, dropping duplicates
+static size_t qgen_merge_ids(size_t *out, const size_t *a, size_t a_length, const size_t *b, size_t b_length) {
+    size_t i = 0, j = 0, n = 0;
+    while (i < a_length || j < b_length) {
+        if (j >= b_length || (i < a_length && a[i] < b[j])) out[n++] = a[i++];
+        else if (i >= a_length || b[j] < a[i]) out[n++] = b[j++];
+        else {
+            out[n++] = a[i++];
+            j++;
+        }
+    }
+    return n;
+}
+
+// Drops a pattern from every leaf below node_id, returns whether the node is a leaf afterwards
+static int qgen_remove_walk(qgen_otree_t *tree, const qgen_bitpattern_t *pat, size_t pattern_index, size_t node_id, size_t **changed, int *err) {
+    qgen_otree_node_t node = tree->nodes[node_id];
+    if (QGEN_NODE_IS_LEAF(node)) {
+        size_t bucket_id = QGEN_NODE_BUCKET(node);
+        qgen_bucket_drop(&tree->buckets[bucket_id], pattern_index);
+        if (qgen_al_push((void **) changed, &bucket_id) != 0) *err = ENOMEM;
+        return 1;
+    }
+    if (QGEN_NODE_IS_TABLE(node)) {
+        uint64_t lsb = QGEN_NODE_FIELD_LSB(node), bits = QGEN_NODE_FIELD_BITS(node);
+        uint64_t cares = qgen_field(pat->mask_high, pat->mask_low, lsb, bits);
+        uint64_t value = qgen_field(pat->active_high, pat->active_low, lsb, bits);
+        for (uint64_t j = 0; j < (1ULL << bits); j++) {
+            if ((j & cares) == value) {
+                qgen_remove_walk(tree, pat, pattern_index, tree->tables[QGEN_NODE_TABLE_OFFSET(node) + j], changed, err);
+            }
+        }
+        return 0;
+    }
+
+    uint64_t bit = QGEN_NODE_SPLIT_BIT(node);
+    uint64_t cares = qgen_field(pat->mask_high, pat->mask_low, bit, 1);
+    uint64_t value = qgen_field(pat->active_high, pat->active_low, bit, 1);
+    size_t left = QGEN_NODE_LEFT(node), right = QGEN_NODE_RIGHT(node);
+    if (!cares || !value) qgen_remove_walk(tree, pat, pattern_index, left, changed, err);
+    if (!cares || value) qgen_remove_walk(tree, pat, pattern_index, right, changed, err);
+    if (!QGEN_NODE_IS_LEAF(tree->nodes[left]) || !QGEN_NODE_IS_LEAF(tree->nodes[right])) return 0;
+    // Shared leaves are still needed elsewhere
+    if (left == right || tree->parents[left] != 1 || tree->parents[right] != 1) return 0;
+
+    // Two leaves that fit in one bucket become one. Patterns only in one of them can't match keys of the other side,
+    // so the merged bucket just has to keep resolution order.
+    qgen_bucket_t *a = &tree->buckets[QGEN_NODE_BUCKET(tree->nodes[left])];
+    qgen_bucket_t *b = &tree->buckets[QGEN_NODE_BUCKET(tree->nodes[right])];
+    if (a->pattern_count + b->pattern_count > 2 * QGEN_BUCKET_MAX_LENGTH) return 0;
+    size_t sorted_a[2 * QGEN_BUCKET_MAX_LENGTH], sorted_b[2 * QGEN_BUCKET_MAX_LENGTH], merged[4 * QGEN_BUCKET_MAX_LENGTH];
+    memcpy(sorted_a, a->pattern_ids, a->pattern_count * sizeof(size_t));
+    memcpy(sorted_b, b->pattern_ids, b->pattern_count * sizeof(size_t));
+    qsort(sorted_a, a->pattern_count, sizeof(size_t), qgen_compare_ids);
+    qsort(sorted_b, b->pattern_count, sizeof(size_t), qgen_compare_ids);
+    size_t length = qgen_merge_ids(merged, sorted_a, a->pattern_count, sorted_b, b->pattern_count);
+    if (length > QGEN_BUCKET_MAX_LENGTH) return 0;
+    qgen_sort_resolution(tree, merged, length);
+    // Grow first so nothing has changed if that fails
+    size_t kept = a->pattern_count;
+    while (QGEN_ARRAY_HEADER(a->pattern_ids)->length < length) {
+        if (qgen_al_push((void **) &a->pattern_ids, &merged[QGEN_ARRAY_HEADER(a->pattern_ids)->length]) != 0) {
+            QGEN_ARRAY_HEADER(a->pattern_ids)->length = kept;
+            return 0;
+        }
+    }
+    memcpy(a->pattern_ids, merged, length * sizeof(size_t));
+    a->pattern_count = length;
+    b->pattern_count = 0;
+    QGEN_ARRAY_HEADER(b->pattern_ids)->length = 0;
+
+    size_t a_id = QGEN_NODE_BUCKET(tree->nodes[left]), b_id = QGEN_NODE_BUCKET(tree->nodes[right]);
+    tree->nodes[node_id] = QGEN_NODE_LEAF(a->pattern_count, a_id);
+    tree->parents[left] = 0;
+    tree->parents[right] = 0;
+    tree->dead_nodes += 2;
+    tree->dead_buckets++;
+    if (qgen_al_push((void **) changed, &a_id) != 0 || qgen_al_push((void **) changed, &b_id) != 0) *err = ENOMEM;
+    return 1;
+}
+
+int qgen_tree_remove(qgen_otree_t *tree, size_t pattern_index) {
+    if (tree == NULL || tree->node_count == 0 || pattern_index >= tree->pattern_count) return errno = EINVAL;
+    if (tree->flags & QGEN_TREE_WIDE) return errno = ENOTSUP;
+    qgen_bitpattern_t pattern = tree->patterns[pattern_index];
+    // Removed patterns are left with a mask that can never match
+    if (pattern.mask_low == 0 && pattern.mask_high == 0 && (pattern.active_low | pattern.active_high) != 0) return errno = ENOENT;
+    int err = qgen_tree_thaw(tree);
+    if (err) return errno = err;
+
+    size_t *changed = qgen_new_array_list(16, sizeof(size_t));
+    if (changed == NULL) return errno = ENOMEM;
+    qgen_remove_walk(tree, &pattern, pattern_index, tree->node_count - 1, &changed, &err);
+    tree->patterns[pattern_index].mask_low = 0;
+    tree->patterns[pattern_index].mask_high = 0;
+    tree->patterns[pattern_index].active_low = ~0ULL;
+    tree->patterns[pattern_index].active_high = ~0ULL;
+    // Without the full list of changed buckets every leaf is frozen again
+    qgen_tree_refreeze(tree, err ? SIZE_MAX : tree->bucket_count, changed, QGEN_ARRAY_HEADER(changed)->length);
+    qgen_free_array_list(changed);
+    return 0;
+}
+
+// ---- Node layout ----
+
+// Nodes per block of the blocked layout, one cache line
+#define QGEN_LAYOUT_BLOCK_NODES (64 / sizeof(qgen_otree_node_t))
+
+// Places the nodes reachable from the root. Blocks are filled breadth first from their root with up to block_nodes
+// nodes, children left over start blocks of their own, queued breadth first as well. order receives the old index
+// of every placed node, returns how many were placed.
+static size_t qgen_layout_order(qgen_otree_t *tree, size_t block_nodes, size_t *order, size_t *new_id, size_t *roots, size_t *queue) {
+    size_t children[(size_t) 1 << QGEN_TABLE_MAX_BITS];
+    size_t placed = 0, root_head = 0, root_tail = 0;
+    roots[root_tail++] = tree->node_count - 1;
+    while (root_head < root_tail) {
+        size_t head = 0, tail = 0, block = 0;
+        queue[tail++] = roots[root_head++];
+        for (; head < tail && block < block_nodes; head++) {
+            size_t id = queue[head];
+            // Shared subtrees are queued once per parent but only placed once
+            if (new_id[id] != SIZE_MAX) continue;
+            new_id[id] = placed;
+            order[placed++] = id;
+            block++;
+            if (QGEN_NODE_IS_LEAF(tree->nodes[id])) continue;
+            size_t count = qgen_node_children(tree, tree->nodes[id], children);
+            for (size_t j = 0; j < count; j++) {
+                if (new_id[children[j]] == SIZE_MAX) queue[tail++] = children[j];
+            }
+        }
+        for (; head < tail; head++) {
+            if (new_id[queue[head]] == SIZE_MAX) roots[root_tail++] = queue[head];
+        }
+    }
+    return placed;
+}
+
+int qgen_tree_relayout(qgen_otree_t *tree, int layout) {
+    if (tree == NULL || tree->node_count == 0) return errno = EINVAL;
+    if (layout != QGEN_LAYOUT_BREADTH_FIRST && layout != QGEN_LAYOUT_BLOCKED) return errno = EINVAL;
+    if (tree->flags & QGEN_TREE_MAPPED) return errno = EROFS;
+
+    // Every edge queues its child at most once, plus the root
+    size_t edges = 2 * tree->node_count + tree->table_length + 1;
+    size_t *new_id = malloc(tree->node_count * sizeof(size_t));
+    size_t *order = malloc(tree->node_count * sizeof(size_t));
+    size_t *roots = malloc(edges * sizeof(size_t));
+    size_t *queue = malloc(edges * sizeof(size_t));
+    // Binary splits can turn wide, or compact again, once their children move
+    qgen_otree_node_t *nodes = malloc(tree->node_count * sizeof(qgen_otree_node_t));
+    uint32_t *tables = malloc((tree->table_length + 2 * tree->node_count) * sizeof(uint32_t));
+    int err = new_id && order && roots && queue && nodes && tables ? 0 : ENOMEM;
+    size_t node_count = 0, table_length = 0;
+    if (err == 0) {
+        memset(new_id, 0xff, tree->node_count * sizeof(size_t));
+        size_t block_nodes = layout == QGEN_LAYOUT_BLOCKED ? QGEN_LAYOUT_BLOCK_NODES : SIZE_MAX;
+        node_count = qgen_layout_order(tree, block_nodes, order, new_id, roots, queue);
+
+        // Placed first means stored last, so the root stays at the end and the top of the tree is contiguous
+        size_t children[(size_t) 1 << QGEN_TABLE_MAX_BITS];
+        for (size_t i = 0; i < node_count; i++) {
+            qgen_otree_node_t node = tree->nodes[order[i]];
+            qgen_otree_node_t *out = &nodes[node_count - 1 - i];
+            if (QGEN_NODE_IS_LEAF(node)) {
+                *out = node;
+                continue;
+            }
+            size_t count = qgen_node_children(tree, node, children);
+            for (size_t j = 0; j < count; j++) {
+                children[j] = node_count - 1 - new_id[children[j]];
+            }
+            if (count == 2 && children[0] < QGEN_NODE_COMPACT_LIMIT && children[1] < QGEN_NODE_COMPACT_LIMIT) {
+                *out = QGEN_NODE_INTERMEDIATE(QGEN_NODE_SPLIT_BIT(node), QGEN_NODE_WEIGHT(node), children[0], children[1]);
+                continue;
+            }
+            *out = QGEN_NODE_TABLE(QGEN_NODE_FIELD_LSB(node), count == 2 ? 1 : QGEN_NODE_FIELD_BITS(node), QGEN_NODE_WEIGHT(node), table_length);
+            for (size_t j = 0; j < count; j++) {
+                tables[table_length++] = (uint32_t) children[j];
+            }
+        }
+    }
+    free(new_id);
+    free(order);
+    free(roots);
+    free(queue);
+
+    // Compact trees are rewritten in place unless the tables grew, anything else takes the new arrays
+    if (err == 0 && (tree->flags & QGEN_TREE_COMPACT) && table_length <= tree->table_length) {
+        memcpy(tree->nodes, nodes, node_count * sizeof(qgen_otree_node_t));
+        if (table_length) memcpy(tree->tables, tables, table_length * sizeof(uint32_t));
+        free(nodes);
+        free(tables);
+    } else {
+        if (err == 0) err = qgen_tree_thaw(tree);
+        if (err) {
+            free(nodes);
+            free(tables);
+            return errno = err;
+        }
+        free(tree->nodes);
+        free(tree->tables);
+        tree->nodes = nodes;
+        tree->tables = tables;
+    }
+    tree->node_count = node_count;
+    tree->table_length = table_length;
+    // Unreachable nodes were dropped on the way
+    tree->dead_nodes = 0;
+    if (tree->parents) {
+        memset(tree->parents, 0, node_count * sizeof(uint32_t));
+        qgen_count_parents(tree, 0);
+    }
+    return 0;
+}
+
+// ---- Tree handles ----
+
+// Quiescent-state based reclamation. Every publish starts a new epoch, readers announce the epoch they have seen
+// whenever they hold no tree, and a retired tree is freed once every online reader has announced an epoch at least as
+// new as the one it was retired in.
+
+typedef struct qgen_retired {
+    qgen_otree_t *tree;
+    uint64_t epoch;
+} qgen_retired_t;
+
+struct qgen_reader {
+    volatile uint64_t epoch; // last epoch announced, 0 while offline
+    qgen_tree_handle_t *handle;
+    qgen_reader_t *next;
+};
+
+struct qgen_tree_handle {
+    qgen_otree_t *volatile tree;
+    volatile uint64_t epoch;
+    qgen_mutex_t lock; // taken by writers and registration, never by dispatch
+    qgen_reader_t *readers;
+    qgen_retired_t *retired;
+};
+
+// Readers are written to on every dispatch, each gets a cache line of its own
+#define QGEN_READER_SIZE ((sizeof(qgen_reader_t) + 63) & ~(size_t) 63)
+
+qgen_tree_handle_t *qgen_new_tree_handle(qgen_otree_t *tree) {
+    if (tree == NULL) {
+        errno = EINVAL;
+        return NULL;
+    }
+    qgen_tree_handle_t *handle = calloc(1, sizeof(qgen_tree_handle_t));
+    if (handle == NULL) return NULL;
+    handle->retired = qgen_new_array_list(4, sizeof(qgen_retired_t));
+    if (handle->retired == NULL) {
+        free(handle);
+        return NULL;
+    }
+    qgen_mutex_init(&handle->lock);
+    handle->tree = tree;
+    handle->epoch = 1;
+    return handle;
+}
+
+// Frees the retired trees no reader can still be using, returns how many are left. Called with the lock held.
+static size_t qgen_handle_reclaim_locked(qgen_tree_handle_t *handle) {
+    uint64_t oldest = UINT64_MAX;
+    for (qgen_reader_t *reader = handle->readers; reader; reader = reader->next) {
+        uint64_t epoch = qgen_load_acquire(&reader->epoch);
+        if (epoch && epoch < oldest) oldest = epoch;
+    }
+    qgen_array_list_t *head = QGEN_ARRAY_HEADER(handle->retired);
+    size_t kept = 0;
+    for (size_t i = 0; i < head->length; i++) {
+        if (handle->retired[i].epoch <= oldest) qgen_free_tree(handle->retired[i].tree);
+        else handle->retired[kept++] = handle->retired[i];
+    }
+    head->length = kept;
+    return kept;
+}
+
+int qgen_handle_publish(qgen_tree_handle_t *handle, qgen_otree_t *tree) {
+    if (handle == NULL || tree == NULL) return errno = EINVAL;
+    qgen_mutex_lock(&handle->lock);
+    if (tree == handle->tree) {
+        qgen_mutex_unlock(&handle->lock);
+        return errno = EINVAL;
+    }
+    // Make room first so the old tree can always be retired
+    qgen_retired_t retired = {handle->tree, 0};
+    if (qgen_al_push((void **) &handle->retired, &retired) != 0) {
+        qgen_mutex_unlock(&handle->lock);
+        return errno = ENOMEM;
+    }
+    uint64_t epoch = handle->epoch + 1;
+    qgen_store_release(&handle->tree, tree);
+    qgen_store_release(&handle->epoch, epoch);
+    // Pairs with the fence in qgen_reader_online, a reader coming online either shows up in the scan below or sees
+    // the new tree
+    qgen_fence();
+    handle->retired[QGEN_ARRAY_HEADER(handle->retired)->length - 1].epoch = epoch;
+    qgen_handle_reclaim_locked(handle);
+    qgen_mutex_unlock(&handle->lock);
+    return 0;
+}
+
+size_t qgen_handle_reclaim(qgen_tree_handle_t *handle) {
+    qgen_mutex_lock(&handle->lock);
+    size_t left = qgen_handle_reclaim_locked(handle);
+    qgen_mutex_unlock(&handle->lock);
+    return left;
+}
+
+void qgen_free_tree_handle(qgen_tree_handle_t *handle) {
+    if (handle == NULL) return;
+    while (handle->readers) {
+        qgen_reader_t *next = handle->readers->next;
+        qgen_aligned_free(handle->readers);
+        handle->readers = next;
+    }
+    qgen_handle_reclaim_locked(handle);
+    qgen_free_tree(handle->tree);
+    qgen_free_array_list(handle->retired);
+    qgen_mutex_destroy(&handle->lock);
+    free(handle);
+}
+
+qgen_reader_t *qgen_handle_register(qgen_tree_handle_t *handle) {
+    qgen_reader_t *reader = qgen_aligned_alloc(64, QGEN_READER_SIZE);
+    if (reader == NULL) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    reader->epoch = 0;
+    reader->handle = handle;
+    qgen_mutex_lock(&handle->lock);
+    reader->next = handle->readers;
+    handle->readers = reader;
+    qgen_mutex_unlock(&handle->lock);
+    qgen_reader_online(reader);
+    return reader;
+}
+
+void qgen_handle_unregister(qgen_reader_t *reader) {
+    if (reader == NULL) return;
+    qgen_tree_handle_t *handle = reader->handle;
+    qgen_mutex_lock(&handle->lock);
+    for (qgen_reader_t **link = &handle->readers; *link; link = &(*link)->next) {
+        if (*link == reader) {
+            *link = reader->next;
+            break;
+        }
+    }
+    // Trees this reader was holding back can go now
+    qgen_handle_reclaim_locked(handle);
+    qgen_mutex_unlock(&handle->lock);
+    qgen_aligned_free(reader);
+}
+
+void qgen_reader_online(qgen_reader_t *reader) {
+    qgen_store_release(&reader->epoch, qgen_load_acquire(&reader->handle->epoch));
+    qgen_fence();
+}
+
+void qgen_reader_offline(qgen_reader_t *reader) {
+    qgen_store_release(&reader->epoch, 0);
+}
+
+void qgen_reader_quiescent(qgen_reader_t *reader) {
+    uint64_t epoch = qgen_load_acquire(&reader->handle->epoch);
+    // The line stays clean between publishes
+    if (reader->epoch != epoch) qgen_store_release(&reader->epoch, epoch);
+}
+
+qgen_otree_t *qgen_reader_tree(qgen_reader_t *reader) {
+    qgen_reader_quiescent(reader);
+    return (qgen_otree_t *) qgen_load_acquire(&reader->handle->tree);
+}
+
+intptr_t qgen_reader_dispatch(qgen_reader_t *reader, uint64_t high, uint64_t low) {
+    return qgen_tree_dispatch(qgen_reader_tree(reader), high, low);
+}
+
+// ---- Instrumentation ----
+
+#ifdef QGEN_STATS
+#ifdef _MSC_VER
+#define QGEN_THREAD_LOCAL __declspec(thread)
+#else
+#define QGEN_THREAD_LOCAL _Thread_local
+#endif
+
+static QGEN_THREAD_LOCAL qgen_stats_t *qgen_thread_stats;
+
+static inline void qgen_stats_node(qgen_otree_t *tree, size_t node_id) {
+    qgen_stats_t *stats = qgen_thread_stats;
+    // Updates can grow the tree past the block
+    if (stats && stats->tree == tree && node_id < stats->node_count) stats->node_visits[node_id]++;
+}
+
+static void qgen_stats_match(qgen_otree_t *tree, size_t bucket_id, intptr_t result) {
+    qgen_stats_t *stats = qgen_thread_stats;
+    if (stats == NULL || stats->tree != tree || bucket_id >= stats->bucket_count) return;
+
+    size_t length = qgen_bucket_length(tree, bucket_id);
+    size_t scanned = length;
+    stats->dispatches++;
+    if (result < 0) {
+        stats->misses++;
+        stats->bucket_misses[bucket_id]++;
+    } else {
+        for (size_t i = 0; i < length; i++) {
+            if (qgen_bucket_pattern(tree, bucket_id, i) == (size_t) result) {
+                scanned = i + 1;
+                break;
+            }
+        }
+    }
+    // Unsplittable leaves can be longer than the histogram
+    if (scanned >= QGEN_STATS_SCAN_SLOTS) scanned = QGEN_STATS_SCAN_SLOTS - 1;
+    stats->bucket_scans[bucket_id][scanned]++;
+}
+
+#define QGEN_STATS_NODE(tree, node_id) qgen_stats_node((tree), (node_id))
+#define QGEN_STATS_MATCH(tree, bucket_id, result) qgen_stats_match((tree), (bucket_id), (result))
+
+qgen_stats_t *qgen_stats_new(qgen_otree_t *tree) {
+    // A single block, the counters follow the struct
+    size_t node_size = tree->node_count * sizeof(uint64_t);
+    size_t miss_size = tree->bucket_count * sizeof(uint64_t);
+    size_t scan_size = tree->bucket_count * sizeof(uint64_t[QGEN_STATS_SCAN_SLOTS]);
+    qgen_stats_t *stats = calloc(1, sizeof(qgen_stats_t) + node_size + miss_size + scan_size);
+    if (stats == NULL) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    stats->tree = tree;
+    stats->node_count = tree->node_count;
+    stats->node_visits = (uint64_t *) &stats[1];
+    stats->bucket_count = tree->bucket_count;
+    stats->bucket_misses = &stats->node_visits[tree->node_count];
+    stats->bucket_scans = (uint64_t (*)[QGEN_STATS_SCAN_SLOTS]) &stats->bucket_misses[tree->bucket_count];
+    return stats;
+}
+
+void qgen_stats_free(qgen_stats_t *stats) {
+    if (qgen_thread_stats == stats) qgen_thread_stats = NULL;
+    free(stats);
+}
+
+int qgen_stats_bind(qgen_stats_t *stats) {
+    qgen_thread_stats = stats;
+    return 0;
+}
+
+void qgen_stats_reset(qgen_stats_t *stats) {
+    stats->dispatches = 0;
+    stats->misses = 0;
+    memset(stats->node_visits, 0, stats->node_count * sizeof(uint64_t));
+    memset(stats->bucket_misses, 0, stats->bucket_count * sizeof(uint64_t));
+    memset(stats->bucket_scans, 0, stats->bucket_count * sizeof(uint64_t[QGEN_STATS_SCAN_SLOTS]));
+}
+
+int qgen_stats_merge(qgen_stats_t *into, const qgen_stats_t *from) {
+    if (into->tree != from->tree) return errno = EINVAL;
+    into->dispatches += from->dispatches;
+    into->misses += from->misses;
+    for (size_t i = 0; i < into->node_count; i++) {
+        into->node_visits[i] += from->node_visits[i];
+    }
+    for (size_t i = 0; i < into->bucket_count; i++) {
+        into->bucket_misses[i] += from->bucket_misses[i];
+        for (size_t n = 0; n < QGEN_STATS_SCAN_SLOTS; n++) {
+            into->bucket_scans[i][n] += from->bucket_scans[i][n];
+        }
+    }
+    return 0;
+}
+
+int qgen_stats_export(const qgen_stats_t *stats, const char *filename) {
+    FILE *f = qgen_fopen(filename, "w");
+    if (f == NULL) return errno;
+
+    fprintf(f, "dispatches %"PRIu64"\n", stats->dispatches);
+    fprintf(f, "misses %"PRIu64"\n", stats->misses);
+    for (size_t i = 0; i < stats->node_count; i++) {
+        fprintf(f, "node %"PRIuPTR" visits %"PRIu64"\n", (uintptr_t) i, stats->node_visits[i]);
+    }
+    for (size_t i = 0; i < stats->bucket_count; i++) {
+        fprintf(
+            f, "bucket %"PRIuPTR" length %"PRIuPTR" misses %"PRIu64" scans",
+            (uintptr_t) i, (uintptr_t) qgen_bucket_length((qgen_otree_t *) stats->tree, i), stats->bucket_misses[i]
+        );
+        for (size_t n = 0; n < QGEN_STATS_SCAN_SLOTS; n++) {
+            fprintf(f, " %"PRIu64"", stats->bucket_scans[i][n]);
+        }
+        fprintf(f, "\n");
+    }
+
+    int err = ferror(f) ? EIO : 0;
+    if (fclose(f) != 0 && err == 0) err = EIO;
+    if (err) errno = err;
+    return err;
+}
+
+int qgen_stats_export_dot(const qgen_stats_t *stats, const char *filename) {
+    if (stats->node_count == 0) return errno = EINVAL;
+    FILE *f = qgen_fopen(filename, "w");
+    if (f == NULL) return errno;
+
+    int err = qgen_export_dot_file(f, (qgen_otree_t *) stats->tree, stats);
+    if (err == 0 && ferror(f)) err = EIO;
+    if (fclose(f) != 0 && err == 0) err = EIO;
+    if (err) errno = err;
+    return err;
+}
+#else
+#define QGEN_STATS_NODE(tree, node_id) ((void) 0)
+#define QGEN_STATS_MATCH(tree, bucket_id, result) ((void) 0)
+
+qgen_stats_t *qgen_stats_new(qgen_otree_t *tree) {
+    (void) tree;
+    errno = ENOSYS;
+    return NULL;
+}
+
+void qgen_stats_free(qgen_stats_t *stats) {
+    (void) stats;
+}
+
+int qgen_stats_bind(qgen_stats_t *stats) {
+    (void) stats;
+    return errno = ENOSYS;
+}
+
+void qgen_stats_reset(qgen_stats_t *stats) {
+    (void) stats;
+}
+
+int qgen_stats_merge(qgen_stats_t *into, const qgen_stats_t *from) {
+    (void) into;
+    (void) from;
+    return errno = ENOSYS;
+}
+
+int qgen_stats_export(const qgen_stats_t *stats, const char *filename) {
+    (void) stats;
+    (void) filename;
+    return errno = ENOSYS;
+}
+
+int qgen_stats_export_dot(const qgen_stats_t *stats, const char *filename) {
+    (void) stats;
+    (void) filename;
+    return errno = ENOSYS;
+}
+#endif
+
+// Scans a leaf bucket for the first pattern matching the key
+static inline intptr_t qgen_bucket_match(qgen_otree_t *tree, size_t bucket_id, uint64_t high, uint64_t low) {
+    if (tree->leaves) {
+        return tree->leaf_match(&tree->leaves[bucket_id], high, low);
+    }
+    if (tree->flags & QGEN_TREE_MAPPED) {
+        qgen_file_bucket_t bucket = tree->file_buckets[bucket_id];
+        const uint32_t *pattern_ids = (const uint32_t *) &tree->mapping[bucket.pattern_offset];
+        for (uint32_t i = 0; i < bucket.pattern_count; i++) {
+            uint32_t pat_idx = pattern_ids[i];
+            qgen_bitpattern_t pat = tree->patterns[pat_idx];
+            if ((low & pat.mask_low) == pat.active_low && (high & pat.mask_high) == pat.active_high) {
+                return pat_idx;
+            }
+        }
+        return -1;
+    }
+    qgen_bucket_t bucket = tree->buckets[bucket_id];
+
+    // Linear Scan inside the Cache Line
+    for (size_t i = 0; i < bucket.pattern_count; i++) {
+        size_t pat_idx = bucket.pattern_ids[i];
+        qgen_bitpattern_t pat = tree->patterns[pat_idx];
+        if ((low & pat.mask_low) == pat.active_low && (high & pat.mask_high) == pat.active_high) {
+            return pat_idx;
+        }
+    }
+    // No match in bucket
+    return -1;
+}
+
+// Child of an intermediate or table node for the key
+static inline size_t qgen_node_next(qgen_otree_t *tree, qgen_otree_node_t node, uint64_t high, uint64_t low) {
+    // 128-bit trees never set the upper split index bits
+    uint64_t split_bit = (node >> 56) & 0x7fULL;
+    uint64_t word = split_bit >= 64 ? high : low;
+    if (node & QGEN_NODE_TABLE_FLAG) {
+        uint64_t field = (word >> (split_bit & 63)) & ((1ULL << QGEN_NODE_FIELD_BITS(node)) - 1);
+        return tree->tables[QGEN_NODE_TABLE_OFFSET(node) + field];
+    }
+    // The tested bit picks the 16-bit child field by shifting, LEFT sits above RIGHT, so there's nothing to mispredict
+    uint64_t bit = (word >> (split_bit & 63)) & 1;
+    return (node >> ((bit ^ 1) << 4)) & 0xffffULL;
+}
+
+// Same as qgen_node_next for keys of any width
+static inline size_t qgen_node_next_wide(qgen_otree_t *tree, qgen_otree_node_t node, const uint64_t *key) {
+    uint64_t split_bit = QGEN_NODE_SPLIT_BIT(node);
+    uint64_t word = key[split_bit >> 6];
+    if (node & QGEN_NODE_TABLE_FLAG) {
+        uint64_t field = (word >> (split_bit & 63)) & ((1ULL << QGEN_NODE_FIELD_BITS(node)) - 1);
+        return tree->tables[QGEN_NODE_TABLE_OFFSET(node) + field];
+    }
+    uint64_t bit = (word >> (split_bit & 63)) & 1;
+    return (node >> ((bit ^ 1) << 4)) & 0xffffULL;
+}
+
+intptr_t qgen_tree_dispatch(qgen_otree_t *tree, uint64_t high, uint64_t low) {
+    size_t node_id = tree->node_count - 1;
+
+    while (1) {
+        qgen_otree_node_t node = tree->nodes[node_id];
+        QGEN_STATS_NODE(tree, node_id);
+
+        if (QGEN_NODE_IS_LEAF(node)) {
+            intptr_t result = qgen_bucket_match(tree, QGEN_NODE_BUCKET(node), high, low);
+            QGEN_STATS_MATCH(tree, QGEN_NODE_BUCKET(node), result);
+            return result;
+        }
+        node_id = qgen_node_next(tree, node, high, low);
+    }
+}
+
+intptr_t qgen_tree_dispatch_wide(qgen_otree_t *tree, const uint64_t *key) {
+    size_t node_id = tree->node_count - 1;
+    qgen_otree_node_t node = tree->nodes[node_id];
+    QGEN_STATS_NODE(tree, node_id);
+    while (!QGEN_NODE_IS_LEAF(node)) {
+        node_id = qgen_node_next_wide(tree, node, key);
+        node = tree->nodes[node_id];
+        QGEN_STATS_NODE(tree, node_id);
+    }
+
+    size_t bucket_id = QGEN_NODE_BUCKET(node);
+    size_t words = (tree->width + 63) / 64;
+    const qgen_bucket_t *bucket = &tree->buckets[bucket_id];
+    intptr_t result = -1;
+    for (size_t i = 0; i < bucket->pattern_count && result < 0; i++) {
+        const qgen_wide_pattern_t *pat = &tree->wide_patterns[bucket->pattern_ids[i]];
+        size_t w = 0;
+        while (w < words && (key[w] & pat->mask[w]) == pat->active[w]) w++;
+        if (w == words) result = (intptr_t) bucket->pattern_ids[i];
+    }
+    QGEN_STATS_MATCH(tree, bucket_id, result);
+    return result;
+}
+
+size_t qgen_tree_dispatch_all(qgen_otree_t *tree, uint64_t high, uint64_t low, size_t *out, size_t capacity) {
+    size_t node_id = tree->node_count - 1;
+    qgen_otree_node_t node = tree->nodes[node_id];
+    while (!QGEN_NODE_IS_LEAF(node)) {
+        node_id = qgen_node_next(tree, node, high, low);
+        node = tree->nodes[node_id];
+    }
+
+    // Patterns that match the same key overlap, so the bucket already has them in resolution order
+    size_t bucket_id = QGEN_NODE_BUCKET(node), found = 0;
+    size_t length = qgen_bucket_length(tree, bucket_id);
+    for (size_t i = 0; i < length; i++) {
+        size_t pat_idx = qgen_bucket_pattern(tree, bucket_id, i);
+        const qgen_bitpattern_t *pat = &tree->patterns[pat_idx];
+        if ((low & pat->mask_low) == pat->active_low && (high & pat->mask_high) == pat->active_high) {
+            if (found < capacity) out[found] = pat_idx;
+            found++;
+        }
+    }
+    return found;
+}
+
+// Lanes that reached a leaf are tagged, so the bucket can be prefetched a round before it's scanned
+#define QGEN_LANE_AT_LEAF ((size_t) 1 << (sizeof(size_t) * 8 - 1))
+
+void qgen_tree_dispatch_batch(qgen_otree_t *tree, const uint64_t *high, const uint64_t *low, intptr_t *out, size_t n) {
+    // Each lane walks one key, finished lanes are refilled with the next key so all lanes stay busy.
+    // Every step issues the next load of a lane and moves on to the others before using it.
+    size_t lane_key[QGEN_BATCH_LANES];
+    size_t lane_node[QGEN_BATCH_LANES];
+    size_t root = tree->node_count - 1;
+    size_t next_key = 0;
+    size_t active = 0;
+
+    for (; active < QGEN_BATCH_LANES && next_key < n; active++) {
+        lane_key[active] = next_key++;
+        lane_node[active] = root;
+    }
+
+    while (active) {
+        for (size_t lane = 0; lane < active; ) {
+            size_t key = lane_key[lane];
+
+            if (!(lane_node[lane] & QGEN_LANE_AT_LEAF)) {
+                qgen_otree_node_t node = tree->nodes[lane_node[lane]];
+                QGEN_STATS_NODE(tree, lane_node[lane]);
+                if (QGEN_NODE_IS_LEAF(node)) {
+                    size_t bucket_id = QGEN_NODE_BUCKET(node);
+                    if (tree->leaves) QGEN_PREFETCH(&tree->leaves[bucket_id]);
+                    else if (tree->flags & QGEN_TREE_MAPPED) QGEN_PREFETCH(&tree->file_buckets[bucket_id]);
+                    else QGEN_PREFETCH(&tree->buckets[bucket_id]);
+                    lane_node[lane++] = bucket_id | QGEN_LANE_AT_LEAF;
+                    continue;
+                }
+                size_t next = qgen_node_next(tree, node, high[key], low[key]);
+                QGEN_PREFETCH(&tree->nodes[next]);
+                lane_node[lane++] = next;
+                continue;
+            }
+
+            out[key] = qgen_bucket_match(tree, lane_node[lane] & ~QGEN_LANE_AT_LEAF, high[key], low[key]);
+            QGEN_STATS_MATCH(tree, lane_node[lane] & ~QGEN_LANE_AT_LEAF, out[key]);
+            if (next_key < n) {
+                lane_key[lane] = next_key++;
+                lane_node[lane] = root;
+                QGEN_PREFETCH(&tree->nodes[root]);
+                lane++;
+            } else {
+                // Compact the lanes, the last lane is moved into this slot and visited next
+                active--;
+                lane_key[lane] = lane_key[active];
+                lane_node[lane] = lane_node[active];
+            }
+        }
+    }
+}
+
+// Bytes ahead of the current record qgen_tree_scan prefetches
+#define QGEN_SCAN_PREFETCH 256
+
+static inline uint64_t qgen_bswap64(uint64_t x) {
+#ifdef _MSC_VER
+    return _byteswap_uint64(x);
+#else
+    return __builtin_bswap64(x);
+#endif
+}
+
+// Eight bytes in stream order, the first one most significant
+static inline uint64_t qgen_load_be64(const uint8_t *p) {
+    uint64_t x;
+    memcpy(&x, p, sizeof(x));
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    return x;
+#else
+    return qgen_bswap64(x);
+#endif
+}
+
+// Reorders eight loaded bytes into the bit stream qgen_tree_scan matches against, see the QGEN_SCAN_ flags
+static inline uint64_t qgen_scan_word(const uint8_t *p, int flags) {
+    uint64_t w = qgen_load_be64(p);
+    switch (flags & QGEN_SCAN_UNIT_MASK) {
+        case QGEN_SCAN_LE16:
+            w = ((w & 0x00ff00ff00ff00ffULL) << 8) | ((w >> 8) & 0x00ff00ff00ff00ffULL);
+            break;
+        case QGEN_SCAN_LE32:
+            w = ((w & 0x00ff00ff00ff00ffULL) << 8) | ((w >> 8) & 0x00ff00ff00ff00ffULL);
+            w = ((w & 0x0000ffff0000ffffULL) << 16) | ((w >> 16) & 0x0000ffff0000ffffULL);
+            break;
+        case QGEN_SCAN_LE64:
+            w = qgen_bswap64(w);
+            break;
+        default:
+            break;
+    }
+    if (flags & QGEN_SCAN_LSB_FIRST) {
+        w = ((w & 0x5555555555555555ULL) << 1) | ((w >> 1) & 0x5555555555555555ULL);
+        w = ((w & 0x3333333333333333ULL) << 2) | ((w >> 2) & 0x3333333333333333ULL);
+        w = ((w & 0x0f0f0f0f0f0f0f0fULL) << 4) | ((w >> 4) & 0x0f0f0f0f0f0f0f0fULL);
+    }
+    return w;
+}
+
+size_t qgen_tree_scan(qgen_otree_t *tree, const uint8_t *buf, size_t length, int flags, intptr_t *out, size_t capacity, size_t *consumed) {
+    if (consumed) *consumed = 0;
+    if (tree->flags & QGEN_TREE_WIDE) {
+        errno = ENOTSUP;
+        return 0;
+    }
+    if (tree->node_count == 0) return 0;
+    size_t unit = (size_t) 1 << ((flags & QGEN_SCAN_UNIT_MASK) >> 1);
+    length -= length % unit;
+    uint64_t end_bit = (uint64_t) length * 8;
+    unsigned width = tree->width;
+    size_t root = tree->node_count - 1;
+    uint8_t tail[24];
+    uint64_t bit = 0;
+    unsigned stride = 0;
+    size_t count = 0;
+
+    while (count < capacity && bit < end_bit) {
+        size_t start = (size_t) (bit >> 3) & ~(unit - 1);
+        unsigned offset = (unsigned) (bit - (uint64_t) start * 8);
+        const uint8_t *p = &buf[start];
+        // Windows are read from a unit boundary, at most 63 bits before the record, and take 24 bytes
+        if (length - start < 24) {
+            // Past the end of the buffer the stream reads as zeros, records reaching there aren't complete anyway
+            memset(tail, 0, sizeof(tail));
+            memcpy(tail, p, length - start);
+            p = tail;
+        } else if (start + QGEN_SCAN_PREFETCH < length) {
+            QGEN_PREFETCH(&buf[start + QGEN_SCAN_PREFETCH]);
+        }
+
+        // Top 128 bits of the window from the record on, then the tree width of them as the key. Words past the key
+        // aren't loaded.
+        unsigned needed = offset + width;
+        uint64_t w0 = qgen_scan_word(p, flags);
+        uint64_t w1 = needed > 64 ? qgen_scan_word(p + 8, flags) : 0;
+        if (offset) {
+            uint64_t w2 = needed > 128 ? qgen_scan_word(p + 16, flags) : 0;
+            w0 = (w0 << offset) | (w1 >> (64 - offset));
+            w1 = (w1 << offset) | (w2 >> (64 - offset));
+        }
+        unsigned drop = 128 - width;
+        uint64_t high, low;
+        if (drop == 0) {
+            high = w0;
+            low = w1;
+        } else if (drop < 64) {
+            high = w0 >> drop;
+            low = (w1 >> drop) | (w0 << (64 - drop));
+        } else {
+            high = 0;
+            low = drop < 128 ? w0 >> (drop - 64) : 0;
+        }
+
+        size_t node_id = root;
+        qgen_otree_node_t node = tree->nodes[node_id];
+        QGEN_STATS_NODE(tree, node_id);
+        while (!QGEN_NODE_IS_LEAF(node)) {
+            node_id = qgen_node_next(tree, node, high, low);
+            node = tree->nodes[node_id];
+            QGEN_STATS_NODE(tree, node_id);
+        }
+        intptr_t id = qgen_bucket_match(tree, QGEN_NODE_BUCKET(node), high, low);
+        QGEN_STATS_MATCH(tree, QGEN_NODE_BUCKET(node), id);
+
+        if (id < 0) break;
+        unsigned advance = tree->patterns[id].width;
+        // Records mostly repeat the width of the one before. Advancing by that and branching when it changes lets the
+        // next window load start before this match resolves, instead of waiting on the pattern's width. Without the
+        // barrier the compiler sees stride == advance on both paths and folds the branch back into a dependency.
+        if (advance != stride) {
+            if (advance == 0) break;
+            stride = advance;
+            QGEN_OPAQUE(stride);
+        }
+        if (bit + stride > end_bit) break;
+        out[count++] = id;
+        bit += stride;
+    }
+    if (consumed) *consumed = (size_t) bit;
+    return count;
+}
+
+uint16_t qgen_tree_max_width(qgen_otree_t *tree) {
+    return tree->width;
+}
+
+// Node and bucket counts of the subtree below node_id with nothing shared, sizes[2 * node_id] is 0 until known
+static void qgen_unshared_size(qgen_otree_t *tree, size_t node_id, uint64_t *sizes) {
+    if (sizes[2 * node_id]) return;
+    qgen_otree_node_t node = tree->nodes[node_id];
+    uint64_t nodes = 1, buckets = 0;
+    if (QGEN_NODE_IS_LEAF(node)) {
+        buckets = 1;
+    } else if (QGEN_NODE_IS_TABLE(node)) {
+        for (size_t j = 0; j < ((size_t) 1 << QGEN_NODE_FIELD_BITS(node)); j++) {
+            size_t child = tree->tables[QGEN_NODE_TABLE_OFFSET(node) + j];
+            qgen_unshared_size(tree, child, sizes);
+            nodes += sizes[2 * child];
+            buckets += sizes[2 * child + 1];
+        }
+    } else {
+        size_t children[2] = {QGEN_NODE_LEFT(node), QGEN_NODE_RIGHT(node)};
+        for (int j = 0; j < 2; j++) {
+            qgen_unshared_size(tree, children[j], sizes);
+            nodes += sizes[2 * children[j]];
+            buckets += sizes[2 * children[j] + 1];
+        }
+    }
+    sizes[2 * node_id] = nodes;
+    sizes[2 * node_id + 1] = buckets;
+}
+
+int qgen_tree_sharing(qgen_otree_t *tree, qgen_sharing_t *sharing) {
+    if (tree == NULL || sharing == NULL || tree->node_count == 0) return errno = EINVAL;
+    uint64_t *sizes = calloc(tree->node_count, 2 * sizeof(uint64_t));
+    if (sizes == NULL) return errno = ENOMEM;
+    size_t root = tree->node_count - 1;
+    qgen_unshared_size(tree, root, sizes);
+    sharing->nodes = tree->node_count;
+    sharing->buckets = tree->bucket_count;
+    sharing->unshared_nodes = sizes[2 * root];
+    sharing->unshared_buckets = sizes[2 * root + 1];
+    free(sizes);
+    return 0;
+}
+
+size_t qgen_tree_wide_nodes(qgen_otree_t *tree) {
+    size_t count = 0;
+    for (size_t i = 0; tree && i < tree->node_count; i++) {
+        qgen_otree_node_t node = tree->nodes[i];
+        if (QGEN_NODE_IS_TABLE(node) && QGEN_NODE_FIELD_BITS(node) == 1) count++;
+    }
+    return count;
+}
+
+// Expected and maximum depth below node_id, memoized in average (negative until known) and max_depth
+static void qgen_tree_depth(qgen_otree_t *tree, size_t node_id, double *average, uint32_t *max_depth) {
+    if (average[node_id] >= 0.0) return;
+    qgen_otree_node_t node = tree->nodes[node_id];
+    if (QGEN_NODE_IS_LEAF(node)) {
+        average[node_id] = 0.0;
+        max_depth[node_id] = 0;
+        return;
+    }
+    size_t children[(size_t) 1 << QGEN_TABLE_MAX_BITS];
+    size_t count = qgen_node_children(tree, node, children);
+    double sum = 0.0;
+    uint32_t deepest = 0;
+    for (size_t j = 0; j < count; j++) {
+        qgen_tree_depth(tree, children[j], average, max_depth);
+        sum += average[children[j]];
+        if (max_depth[children[j]] > deepest) deepest = max_depth[children[j]];
+    }
+    average[node_id] = 1.0 + sum / (double) count;
+    max_depth[node_id] = deepest + 1;
+}
+
+int qgen_tree_info(qgen_otree_t *tree, qgen_tree_info_t *info) {
+    if (tree == NULL || info == NULL || tree->node_count == 0) return errno = EINVAL;
+    double *average = malloc(tree->node_count * sizeof(double));
+    uint32_t *max_depth = malloc(tree->node_count * sizeof(uint32_t));
+    if (average == NULL || max_depth == NULL) {
+        free(average);
+        free(max_depth);
+        return errno = ENOMEM;
+    }
+    for (size_t i = 0; i < tree->node_count; i++) {
+        average[i] = -1.0;
+    }
+    size_t root = tree->node_count - 1;
+    qgen_tree_depth(tree, root, average, max_depth);
+
+    *info = (qgen_tree_info_t) {
+        .nodes = tree->node_count,
+        .buckets = tree->bucket_count,
+        .table_entries = tree->table_length,
+        .max_depth = max_depth[root],
+        .average_depth = average[root],
+    };
+    free(average);
+    free(max_depth);
+    for (size_t b = 0; b < tree->bucket_count; b++) {
+        info->bucket_entries += qgen_bucket_length(tree, b);
+    }
+
+    uint64_t bytes = sizeof(qgen_otree_t);
+    if (tree->flags & QGEN_TREE_MAPPED) {
+        bytes += tree->mapping_size;
+    } else {
+        bytes += tree->node_count * sizeof(qgen_otree_node_t) + tree->table_length * sizeof(uint32_t);
+        bytes += tree->bucket_count * sizeof(qgen_bucket_t) + info->bucket_entries * sizeof(size_t);
+    }
+    if (tree->flags & QGEN_TREE_OWNS_PATTERNS) {
+        bytes += tree->pattern_count * (tree->flags & QGEN_TREE_WIDE ? sizeof(qgen_wide_pattern_t) : sizeof(qgen_bitpattern_t));
+    }
+    if (tree->leaves) bytes += tree->bucket_count * sizeof(qgen_leaf_t);
+    if (tree->parents) bytes += tree->node_count * sizeof(uint32_t);
+    if (tree->fields) bytes += QGEN_ARRAY_HEADER(tree->fields)->length * sizeof(qgen_fields_t);
+    info->bytes = bytes + tree->jit_size;
+    return 0;
+}
+
+// Fletcher-64 over 32-bit words, sums are reduced lazily since the 64-bit accumulators can't overflow within a block
+static uint64_t qgen_fletcher64(const uint8_t *data, size_t length) {
+    uint64_t sum1 = 0xffffffffULL, sum2 = 0xffffffffULL;
+    size_t words = length / 4;
+    while (words) {
+        size_t block = words > 32768 ? 32768 : words;
+        words -= block;
+        while (block--) {
+            uint32_t word;
+            memcpy(&word, data, 4);
+            data += 4;
+            sum1 += word;
+            sum2 += sum1;
+        }
+        sum1 %= 0xffffffffULL;
+        sum2 %= 0xffffffffULL;
+    }
+    return (sum2 << 32) | sum1;
+}
+
+static int qgen_file_checksum(const uint8_t *file, const qgen_file_header_t *header, size_t file_size, uint8_t checksum[16]) {
+    memset(checksum, 0, 16);
+    uint64_t sum;
+    switch (QGEN_FILE_CHECKSUM_METHOD(header->flags)) {
+        case QGEN_FILE_CHECKSUM_NONE:
+            return 0;
+        case QGEN_FILE_CHECKSUM_FLETCHER:
+            sum = qgen_fletcher64(&file[header->pattern_offset], header->pattern_count * sizeof(qgen_bitpattern_t));
+            break;
+        case QGEN_FILE_CHECKSUM_FLETCHER_FULL:
+            sum = qgen_fletcher64(&file[sizeof(qgen_file_header_t)], file_size - sizeof(qgen_file_header_t));
+            break;
+        default:
+            return EINVAL;
+    }
+    memcpy(checksum, &sum, sizeof(sum));
+    return 0;
+}
+
+#define QGEN_FILE_ALIGN(x) (((x) + 7) & ~(size_t) 7)
+
+int qgen_save_tree(qgen_otree_t *tree, const char *filename, uint32_t checksum_method) {
+    if (!tree || checksum_method > QGEN_FILE_CHECKSUM_FLETCHER_FULL) return errno = EINVAL;
+    if (tree->flags & QGEN_TREE_WIDE) return errno = ENOTSUP;
+
+    size_t id_count = 0;
+    for (size_t i = 0; i < tree->bucket_count; i++) {
+        id_count += qgen_bucket_length(tree, i);
+    }
+
+    // Layout: header | nodes | patterns | buckets | node tables | pattern ID lists, every table 8-byte aligned
+    size_t node_offset = QGEN_FILE_ALIGN(sizeof(qgen_file_header_t));
+    size_t pattern_offset = QGEN_FILE_ALIGN(node_offset + tree->node_count * sizeof(qgen_otree_node_t));
+    size_t bucket_offset = QGEN_FILE_ALIGN(pattern_offset + tree->pattern_count * sizeof(qgen_bitpattern_t));
+    size_t table_offset = QGEN_FILE_ALIGN(bucket_offset + tree->bucket_count * sizeof(qgen_file_bucket_t));
+    size_t id_offset = QGEN_FILE_ALIGN(table_offset + tree->table_length * sizeof(uint32_t));
+    size_t file_size = QGEN_FILE_ALIGN(id_offset + id_count * sizeof(uint32_t));
+    if (file_size > UINT32_MAX || tree->pattern_count > UINT32_MAX) return errno = EFBIG;
+
+    uint8_t *file = calloc(1, file_size);
+    if (file == NULL) return errno = ENOMEM;
+
+    qgen_file_header_t *header = (qgen_file_header_t *) file;
+    memcpy(header->magic, QGEN_FILE_MAGIC, sizeof(header->magic));
+    // Version 1 readers only know 16-bit leaf buckets and compact binary splits
+    uint32_t version = tree->bucket_count > QGEN_NODE_COMPACT_LIMIT || qgen_tree_wide_nodes(tree) ? 2 : 1;
+    header->flags = QGEN_FILE_FLAGS(version, checksum_method);
+    header->node_count = (uint32_t) tree->node_count;
+    header->node_offset = (uint32_t) node_offset;
+    header->pattern_count = (uint32_t) tree->pattern_count;
+    header->pattern_offset = (uint32_t) pattern_offset;
+    header->bucket_count = (uint32_t) tree->bucket_count;
+    header->bucket_offset = (uint32_t) bucket_offset;
+    header->width = tree->width;
+    header->table_length = (uint32_t) tree->table_length;
+    header->table_offset = (uint32_t) table_offset;
+
+    memcpy(&file[node_offset], tree->nodes, tree->node_count * sizeof(qgen_otree_node_t));
+    memcpy(&file[pattern_offset], tree->patterns, tree->pattern_count * sizeof(qgen_bitpattern_t));
+    if (tree->table_length) memcpy(&file[table_offset], tree->tables, tree->table_length * sizeof(uint32_t));
+
+    qgen_file_bucket_t *buckets = (qgen_file_bucket_t *) &file[bucket_offset];
+    uint32_t *ids = (uint32_t *) &file[id_offset];
+    for (size_t i = 0; i < tree->bucket_count; i++) {
+        buckets[i].pattern_offset = (uint32_t) ((uint8_t *) ids - file);
+        buckets[i].pattern_count = (uint32_t) qgen_bucket_length(tree, i);
+        for (size_t j = 0; j < buckets[i].pattern_count; j++) {
+            *ids++ = (uint32_t) qgen_bucket_pattern(tree, i, j);
+        }
+    }
+
+    qgen_file_checksum(file, header, file_size, header->checksum);
+
+    int err = 0;
+    FILE *f = qgen_fopen(filename, "wb");
+    if (f == NULL) {
+        err = errno ? errno : EIO;
+    } else {
+        if (fwrite(file, 1, file_size, f) != file_size) err = EIO;
+        if (fclose(f) != 0 && err == 0) err = EIO;
+    }
+    free(file);
+    if (err) errno = err;
+    return err;
+}
+
+// Kahn's algorithm over the nodes, 0 if every node can be ordered after its children. Only needed for updated trees,
+// generated and relaid out ones store every child before its parent.
+static int qgen_validate_acyclic(const uint8_t *file) {
+    const qgen_file_header_t *header = (const qgen_file_header_t *) file;
+    const qgen_otree_node_t *nodes = (const qgen_otree_node_t *) &file[header->node_offset];
+    const uint32_t *tables = (const uint32_t *) &file[header->table_offset];
+    size_t node_count = header->node_count;
+    uint32_t *pending = calloc(node_count, sizeof(uint32_t));
+    uint32_t *ready = malloc(node_count * sizeof(uint32_t));
+    if (pending == NULL || ready == NULL) {
+        free(pending);
+        free(ready);
+        return ENOMEM;
+    }
+    // pending counts the parents of every node that haven't been ordered yet
+    for (size_t i = 0; i < node_count; i++) {
+        qgen_otree_node_t node = nodes[i];
+        if (QGEN_NODE_IS_LEAF(node)) continue;
+        if (!QGEN_NODE_IS_TABLE(node)) {
+            pending[QGEN_NODE_LEFT(node)]++;
+            pending[QGEN_NODE_RIGHT(node)]++;
+            continue;
+        }
+        for (size_t j = 0; j < ((size_t) 1 << QGEN_NODE_FIELD_BITS(node)); j++) {
+            pending[tables[QGEN_NODE_TABLE_OFFSET(node) + j]]++;
+        }
+    }
+    size_t head = 0, tail = 0;
+    for (size_t i = 0; i < node_count; i++) {
+        if (pending[i] == 0) ready[tail++] = (uint32_t) i;
+    }
+    while (head < tail) {
+        qgen_otree_node_t node = nodes[ready[head++]];
+        if (QGEN_NODE_IS_LEAF(node)) continue;
+        size_t entries = QGEN_NODE_IS_TABLE(node) ? (size_t) 1 << QGEN_NODE_FIELD_BITS(node) : 2;
+        for (size_t j = 0; j < entries; j++) {
+            size_t child = !QGEN_NODE_IS_TABLE(node) ? (j ? QGEN_NODE_RIGHT(node) : QGEN_NODE_LEFT(node)) : tables[QGEN_NODE_TABLE_OFFSET(node) + j];
+            if (--pending[child] == 0) ready[tail++] = (uint32_t) child;
+        }
+    }
+    free(pending);
+    free(ready);
+    return tail == node_count ? 0 : EILSEQ;
+}
+
+// Checks the contents of the tables, so a damaged file is rejected instead of sending dispatch out of bounds or into
+// a loop: child indices, split bits, table ranges and bucket and pattern IDs. Reads the file only, mappings stay as
+// they are.
+static int qgen_validate_contents(const uint8_t *file) {
+    const qgen_file_header_t *header = (const qgen_file_header_t *) file;
+    const qgen_otree_node_t *nodes = (const qgen_otree_node_t *) &file[header->node_offset];
+    const uint32_t *tables = (const uint32_t *) &file[header->table_offset];
+    const qgen_file_bucket_t *buckets = (const qgen_file_bucket_t *) &file[header->bucket_offset];
+    int ordered = 1;
+    for (uint32_t i = 0; i < header->node_count; i++) {
+        qgen_otree_node_t node = nodes[i];
+        if (QGEN_NODE_IS_LEAF(node)) {
+            if (QGEN_NODE_BUCKET(node) >= header->bucket_count) return EILSEQ;
+            continue;
+        }
+        uint64_t lsb = QGEN_NODE_SPLIT_BIT(node);
+        if (!QGEN_NODE_IS_TABLE(node)) {
+            if (lsb >= header->width) return EILSEQ;
+            if (QGEN_NODE_LEFT(node) >= header->node_count || QGEN_NODE_RIGHT(node) >= header->node_count) return EILSEQ;
+            if (QGEN_NODE_LEFT(node) >= i || QGEN_NODE_RIGHT(node) >= i) ordered = 0;
+            continue;
+        }
+        // Tables read a field that stays inside one key word, binary splits in the wide form have a single bit
+        uint64_t bits = QGEN_NODE_FIELD_BITS(node);
+        if (bits == 0 || bits > QGEN_TABLE_MAX_BITS) return EILSEQ;
+        if (lsb + bits > header->width || (lsb >> 6) != ((lsb + bits - 1) >> 6)) return EILSEQ;
+        uint64_t offset = QGEN_NODE_TABLE_OFFSET(node);
+        if (offset + (1ULL << bits) > header->table_length) return EILSEQ;
+        for (uint64_t j = 0; j < (1ULL << bits); j++) {
+            if (tables[offset + j] >= header->node_count) return EILSEQ;
+            if (tables[offset + j] >= i) ordered = 0;
+        }
+    }
+    for (uint32_t i = 0; i < header->bucket_count; i++) {
+        const uint32_t *ids = (const uint32_t *) &file[buckets[i].pattern_offset];
+        for (uint32_t j = 0; j < buckets[i].pattern_count; j++) {
+            if (ids[j] >= header->pattern_count) return EILSEQ;
+        }
+    }
+    return ordered ? 0 : qgen_validate_acyclic(file);
+}
+
+// Checks that every table of the file is in bounds, and the checksum if one was requested
+static int qgen_validate_file(const uint8_t *file, size_t file_size) {
+    if (file_size < sizeof(qgen_file_header_t)) return EILSEQ;
+    const qgen_file_header_t *header = (const qgen_file_header_t *) file;
+    if (memcmp(header->magic, QGEN_FILE_MAGIC, sizeof(header->magic)) != 0) return EILSEQ;
+    uint32_t version = QGEN_FILE_VERSION(header->flags);
+    if (version < QGEN_FILE_MIN_VERSION_SUPPORTED || version > QGEN_FILE_MAX_VERSION_SUPPORTED) return EILSEQ;
+    if (header->node_count == 0 || header->width > 128) return EILSEQ;
+
+    uint64_t tables[4][3] = {
+        {header->node_offset, header->node_count, sizeof(qgen_otree_node_t)},
+        {header->pattern_offset, header->pattern_count, sizeof(qgen_bitpattern_t)},
+        {header->bucket_offset, header->bucket_count, sizeof(qgen_file_bucket_t)},
+        {header->table_offset, header->table_length, sizeof(uint32_t)},
+    };
+    for (int i = 0; i < 4; i++) {
+        if (tables[i][0] % 8 != 0) return EILSEQ;
+        if (tables[i][0] + tables[i][1] * tables[i][2] > file_size) return EILSEQ;
+    }
+    const qgen_file_bucket_t *buckets = (const qgen_file_bucket_t *) &file[header->bucket_offset];
+    for (uint32_t i = 0; i < header->bucket_count; i++) {
+        if (buckets[i].pattern_offset % 4 != 0) return EILSEQ;
+        if ((uint64_t) buckets[i].pattern_offset + (uint64_t) buckets[i].pattern_count * sizeof(uint32_t) > file_size) return EILSEQ;
+    }
+
+    uint8_t checksum[16];
+    if (qgen_file_checksum(file, header, file_size, checksum) != 0) return EILSEQ;
+    if (memcmp(checksum, header->checksum, sizeof(checksum)) != 0) return EILSEQ;
+    return qgen_validate_contents(file);
+}
+
+qgen_otree_t *qgen_load_tree(const char *filename) {
+    int err = 0;
+    uint8_t *file = NULL;
+    qgen_otree_t *tree = NULL;
+
+    FILE *f = qgen_fopen(filename, "rb");
+    if (f == NULL) return NULL;
+    long file_size = -1;
+    if (fseek(f, 0, SEEK_END) == 0) file_size = ftell(f);
+    if (file_size < 0 || fseek(f, 0, SEEK_SET) != 0) {
+        err = EIO;
+        goto cleanup;
+    }
+    file = malloc(file_size ? file_size : 1);
+    if (file == NULL) {
+        err = ENOMEM;
+        goto cleanup;
+    }
+    if (fread(file, 1, file_size, f) != (size_t) file_size) {
+        err = EIO;
+        goto cleanup;
+    }
+    err = qgen_validate_file(file, file_size);
+    if (err) goto cleanup;
+
+    const qgen_file_header_t *header = (const qgen_file_header_t *) file;
+    const qgen_file_bucket_t *buckets = (const qgen_file_bucket_t *) &file[header->bucket_offset];
+    size_t id_count = 0;
+    for (uint32_t i = 0; i < header->bucket_count; i++) {
+        id_count += buckets[i].pattern_count;
+    }
+    size_t *ids = NULL;
+    tree = qgen_alloc_compact(header->node_count, header->bucket_count, header->table_length, id_count, &ids);
+    if (tree == NULL) {
+        err = ENOMEM;
+        goto cleanup;
+    }
+    tree->width = header->width;
+
+    tree->patterns = qgen_new_array_list(header->pattern_count, sizeof(qgen_bitpattern_t));
+    if (tree->patterns == NULL) {
+        err = ENOMEM;
+        goto cleanup;
+    }
+    tree->flags |= QGEN_TREE_OWNS_PATTERNS;
+    memcpy(tree->patterns, &file[header->pattern_offset], header->pattern_count * sizeof(qgen_bitpattern_t));
+    QGEN_ARRAY_HEADER(tree->patterns)->length = header->pattern_count;
+    tree->pattern_count = header->pattern_count;
+    memcpy(tree->nodes, &file[header->node_offset], header->node_count * sizeof(qgen_otree_node_t));
+    if (header->table_length) {
+        memcpy(tree->tables, &file[header->table_offset], header->table_length * sizeof(uint32_t));
+    }
+
+    for (uint32_t i = 0; i < header->bucket_count; i++) {
+        const uint32_t *file_ids = (const uint32_t *) &file[buckets[i].pattern_offset];
+        for (uint32_t j = 0; j < buckets[i].pattern_count; j++) {
+            ids[j] = file_ids[j];
+        }
+        tree->buckets[i] = (qgen_bucket_t) {
+            .pattern_count = buckets[i].pattern_count,
+            .pattern_ids = ids,
+        };
+        ids += buckets[i].pattern_count;
+    }
+
+cleanup:
+    if (f) fclose(f);
+    free(file);
+    if (err) {
+        qgen_free_tree(tree);
+        errno = err;
+        return NULL;
+    }
+    return tree;
+}
+
+static void qgen_unmap_file(uint8_t *mapping, size_t size) {
+    if (mapping == NULL) return;
+#ifdef _WIN32
+    (void) size;
+    UnmapViewOfFile(mapping);
+#else
+    munmap(mapping, size);
+#endif
+}
+
+static uint8_t *qgen_map_file(const char *filename, size_t *size) {
+#ifdef _WIN32
+    HANDLE file = CreateFileA(filename, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (file == INVALID_HANDLE_VALUE) {
+        errno = ENOENT;
+        return NULL;
+    }
+    LARGE_INTEGER file_size;
+    if (!GetFileSizeEx(file, &file_size) || file_size.QuadPart == 0) {
+        CloseHandle(file);
+        errno = EILSEQ;
+        return NULL;
+    }
+    HANDLE mapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+    CloseHandle(file);
+    if (mapping == NULL) {
+        errno = EIO;
+        return NULL;
+    }
+    // The view keeps the mapping alive
+    uint8_t *view = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+    CloseHandle(mapping);
+    if (view == NULL) {
+        errno = EIO;
+        return NULL;
+    }
+    *size = (size_t) file_size.QuadPart;
+    return view;
+#else
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0) return NULL;
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        int err = errno;
+        close(fd);
+        errno = err;
+        return NULL;
+    }
+    if (st.st_size == 0) {
+        close(fd);
+        errno = EILSEQ;
+        return NULL;
+    }
+    void *view = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (view == MAP_FAILED) return NULL;
+    *size = (size_t) st.st_size;
+    return view;
+#endif
+}
+
+qgen_otree_t *qgen_map_tree(const char *filename) {
+    size_t size = 0;
+    uint8_t *mapping = qgen_map_file(filename, &size);
+    if (mapping == NULL) return NULL;
+
+    int err = qgen_validate_file(mapping, size);
+    if (err) {
+        qgen_unmap_file(mapping, size);
+        errno = err;
+        return NULL;
+    }
+
+    qgen_otree_t *tree = calloc(1, sizeof(qgen_otree_t));
+    if (tree == NULL) {
+        qgen_unmap_file(mapping, size);
+        errno = ENOMEM;
+        return NULL;
+    }
+    const qgen_file_header_t *header = (const qgen_file_header_t *) mapping;
+    tree->width = header->width;
+    tree->flags = QGEN_TREE_MAPPED;
+    tree->node_count = header->node_count;
+    tree->nodes = (qgen_otree_node_t *) &mapping[header->node_offset];
+    tree->pattern_count = header->pattern_count;
+    tree->patterns = (qgen_bitpattern_t *) &mapping[header->pattern_offset];
+    tree->bucket_count = header->bucket_count;
+    tree->file_buckets = (const qgen_file_bucket_t *) &mapping[header->bucket_offset];
+    tree->table_length = header->table_length;
+    tree->tables = (uint32_t *) &mapping[header->table_offset];
+    tree->mapping = mapping;
+    tree->mapping_size = size;
+    return tree;
+}
+
+// ---- Tree cache ----
+
+// Bumped whenever the generator builds a different tree from the same patterns and options, so old cache files stop
+// matching instead of being loaded
+#define QGEN_GENERATOR_VERSION 1
+
+static qgen_cache_stats_t qgen_cache_counters;
+
+// Two independent 64-bit lanes, 128 bits of key for the file name
+static inline void qgen_cache_hash(uint64_t key[2], uint64_t word) {
+    key[0] = (key[0] ^ word) * 0x9E3779B97F4A7C15ULL;
+    key[0] ^= key[0] >> 32;
+    key[1] = (key[1] + word) * 0xD6E8FEB86659FD93ULL;
+    key[1] ^= key[1] >> 29;
+}
+
+static inline uint64_t qgen_cache_finish(uint64_t x) {
+    x ^= x >> 30;
+    x *= 0xBF58476D1CE4E5B9ULL;
+    x ^= x >> 27;
+    x *= 0x94D049BB133111EBULL;
+    return x ^ (x >> 31);
+}
+
+// Whether a cached tree was built from exactly these patterns, the reserved fields don't count
+static int qgen_cache_matches(const qgen_otree_t *tree, const qgen_bitpattern_t *patterns, size_t length, uint8_t width) {
+    if (tree->pattern_count != length || tree->width != width) return 0;
+    for (size_t i = 0; i < length; i++) {
+        const qgen_bitpattern_t *a = &tree->patterns[i], *b = &patterns[i];
+        if (a->width != b->width || a->shift != b->shift || a->priority != b->priority) return 0;
+        if (a->mask_low != b->mask_low || a->mask_high != b->mask_high) return 0;
+        if (a->active_low != b->active_low || a->active_high != b->active_high) return 0;
+    }
+    return 1;
+}
+
+static int qgen_cache_mkdir(const char *dir) {
+#ifdef _WIN32
+    if (!CreateDirectoryA(dir, NULL) && GetLastError() != ERROR_ALREADY_EXISTS) return errno = EIO;
+#else
+    if (mkdir(dir, 0777) != 0 && errno != EEXIST) return errno;
+#endif
+    return 0;
+}
+
+// Writes the tree under a name no other writer uses, then renames it over the final one. Concurrent writers of the
+// same key write the same tree, whichever rename comes last wins.
+static int qgen_cache_store(qgen_otree_t *tree, const char *path, const char *cache_dir) {
+    static uint64_t sequence;
+    size_t length = strlen(path) + 64;
+    char *tmp = malloc(length);
+    if (tmp == NULL) return errno = ENOMEM;
+#ifdef _WIN32
+    unsigned long pid = (unsigned long) GetCurrentProcessId();
+#else
+    unsigned long pid = (unsigned long) getpid();
+#endif
+    snprintf(tmp, length, "%s.%lu.%" PRIu64 ".tmp", path, pid, (uint64_t) qgen_atomic_inc(&sequence));
+
+    // The full checksum makes a file cut short by a crash fail to load instead of loading garbage
+    int err = qgen_save_tree(tree, tmp, QGEN_FILE_CHECKSUM_FLETCHER_FULL);
+    if (err == ENOENT && qgen_cache_mkdir(cache_dir) == 0) {
+        err = qgen_save_tree(tree, tmp, QGEN_FILE_CHECKSUM_FLETCHER_FULL);
+    }
+    if (err == 0) {
+#ifdef _WIN32
+        if (!MoveFileExA(tmp, path, MOVEFILE_REPLACE_EXISTING)) err = EIO;
+#else
+        if (rename(tmp, path) != 0) err = errno;
+#endif
+    }
+    if (err) remove(tmp);
+    free(tmp);
+    if (err) errno = err;
+    return err;
+}
+
+qgen_otree_t *qgen_generate_tree_cached(qgen_bitpattern_t *patterns, const char *cache_dir) {
+    return qgen_generate_tree_cached_ex(patterns, NULL, cache_dir);
+}
+
+qgen_otree_t *qgen_generate_tree_cached_ex(qgen_bitpattern_t *patterns, const qgen_gen_options_t *options, const char *cache_dir) {
+    if (patterns == NULL || cache_dir == NULL) {
+        errno = EINVAL;
+        return NULL;
+    }
+    size_t length = QGEN_ARRAY_HEADER(patterns)->length;
+
+    // Options are keyed after defaults and limits are applied, so equivalent settings share a file. Threads are left
+    // out, they only change how much is shared and a tree from any thread count dispatches the same. The cost model
+    // settings only matter to the cost model.
+    qgen_otree_gen_t config = {0};
+    qgen_gen_options_t plain = options ? *options : (qgen_gen_options_t) {0};
+    plain.hits = NULL;
+    config.max_table_bits = QGEN_TABLE_MAX_BITS;
+    int err = qgen_gen_configure(&config, &plain, length);
+    if (err) {
+        errno = err;
+        return NULL;
+    }
+    if (config.split == QGEN_SPLIT_GREEDY) {
+        config.lookahead = config.beam_width = 0;
+        config.duplication_penalty = config.fullness_penalty = 0;
+    }
+
+    // Same alignment as qgen_generate_tree, the key covers the patterns the tree is actually built from
+    uint8_t width = 0;
+    for (size_t i = 0; i < length; i++) {
+        width = width >= patterns[i].width ? width : patterns[i].width;
+    }
+    for (size_t i = 0; i < length; i++) {
+        qgen_align_pattern(&patterns[i], width);
+    }
+
+    uint64_t key[2] = {0x243F6A8885A308D3ULL, 0x13198A2E03707344ULL};
+    qgen_cache_hash(key, QGEN_GENERATOR_VERSION);
+    qgen_cache_hash(key, length);
+    qgen_cache_hash(key, width);
+    qgen_cache_hash(key, (uint64_t) config.split | (uint64_t) config.lookahead << 8 | (uint64_t) config.beam_width << 16 | (uint64_t) config.max_table_bits << 24);
+    qgen_cache_hash(key, (uint64_t) config.duplication_penalty | (uint64_t) config.fullness_penalty << 16);
+    qgen_cache_hash(key, options && options->hits);
+    for (size_t i = 0; i < length; i++) {
+        const qgen_bitpattern_t *pat = &patterns[i];
+        qgen_cache_hash(key, (uint64_t) pat->width | (uint64_t) pat->shift << 8 | (uint64_t) pat->priority << 16);
+        qgen_cache_hash(key, pat->mask_low);
+        qgen_cache_hash(key, pat->mask_high);
+        qgen_cache_hash(key, pat->active_low);
+        qgen_cache_hash(key, pat->active_high);
+        if (options && options->hits) qgen_cache_hash(key, options->hits[i]);
+    }
+
+    size_t path_length = strlen(cache_dir) + 48;
+    char *path = malloc(path_length);
+    if (path == NULL) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    snprintf(path, path_length, "%s/%016" PRIx64 "%016" PRIx64 ".qgt", cache_dir, qgen_cache_finish(key[0]), qgen_cache_finish(key[1]));
+
+    qgen_otree_t *tree = qgen_load_tree(path);
+    if (tree && qgen_cache_matches(tree, patterns, length, width)) {
+        // Hand the caller's patterns to the tree, the same way a generated tree references them
+        qgen_free_array_list(tree->patterns);
+        tree->patterns = patterns;
+        tree->flags &= ~QGEN_TREE_OWNS_PATTERNS;
+        qgen_atomic_inc(&qgen_cache_counters.hits);
+        free(path);
+        return tree;
+    }
+    if (tree || errno != ENOENT) qgen_atomic_inc(&qgen_cache_counters.errors);
+    qgen_free_tree(tree);
+
+    qgen_atomic_inc(&qgen_cache_counters.misses);
+    tree = qgen_generate_tree_ex(patterns, options);
+    if (tree == NULL) {
+        err = errno;
+        free(path);
+        errno = err;
+        return NULL;
+    }
+    if (qgen_cache_store(tree, path, cache_dir) == 0) {
+        qgen_atomic_inc(&qgen_cache_counters.stores);
+    } else {
+        qgen_atomic_inc(&qgen_cache_counters.errors);
+    }
+    free(path);
+    return tree;
+}
+
+void qgen_cache_stats(qgen_cache_stats_t *stats) {
+    stats->hits = qgen_load_acquire(&qgen_cache_counters.hits);
+    stats->misses = qgen_load_acquire(&qgen_cache_counters.misses);
+    stats->stores = qgen_load_acquire(&qgen_cache_counters.stores);
+    stats->errors = qgen_load_acquire(&qgen_cache_counters.errors);
 }
@@ -5,6 +5,10 @@
 #include <inttypes.h>
 #include <stddef.h>
 
+#ifdef __cplusplus
+extern "C" {
+#endif
+
 /*
     About impl flags:
     - QGEN_NON_OPAQUE: use open struct definitions
@@ -12,6 +16,7 @@
 
     - QGEN_SHARED: Use as a shared library.
     - QGEN_BUILD: Library is being compiled.
+    - QGEN_STATS: Library records dispatch statistics, see qgen_stats_new (make STATS=1).
 */
 
 #ifndef QGEN_SHARED
@@ -41,6 +46,30 @@
 #endif
 
 #define QGEN_DEFAULT_ARRAY_LIST_CAP 0x1000
+// Number of keys qgen_tree_dispatch_batch walks through the tree at the same time
+#define QGEN_BATCH_LANES 8
+// Maximum number of patterns in a leaf bucket
+#define QGEN_BUCKET_MAX_LENGTH 16
+// Scan length histogram slots of every bucket in qgen_stats_t, 0 to QGEN_BUCKET_MAX_LENGTH compares
+#define QGEN_STATS_SCAN_SLOTS (QGEN_BUCKET_MAX_LENGTH + 1)
+// qgen_tree_scan flags. The stream can be made of little-endian units of 2, 4 or 8 bytes, the first unit is the most
+// significant and the buffer length is cut to whole units. Bits of every byte can be taken least significant first.
+#define QGEN_SCAN_LSB_FIRST 0x1
+#define QGEN_SCAN_LE16 0x2
+#define QGEN_SCAN_LE32 0x4
+#define QGEN_SCAN_LE64 0x6
+#define QGEN_SCAN_UNIT_MASK 0x6
+
+#ifdef QGEN_INTERNAL
+#if defined(__GNUC__) || defined(__clang__)
+    #define QGEN_PREFETCH(addr) __builtin_prefetch((addr), 0, 3)
+#elif defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+    #include <xmmintrin.h>
+    #define QGEN_PREFETCH(addr) _mm_prefetch((const char *) (addr), _MM_HINT_T0)
+#else
+    #define QGEN_PREFETCH(addr) ((void) (addr))
+#endif
+#endif
 
 #define __QGEN_STR(x) #x
 #define QGEN_STR(x) __QGEN_STR(x)
@@ -49,15 +78,75 @@
 
 typedef struct qgen_bucket qgen_bucket_t;
 typedef struct qgen_otree qgen_otree_t;
+typedef struct qgen_file_bucket qgen_file_bucket_t;
+typedef struct qgen_leaf qgen_leaf_t;
+typedef struct qgen_stats qgen_stats_t;
+typedef struct qgen_tree_handle qgen_tree_handle_t;
+typedef struct qgen_reader qgen_reader_t;
 
 typedef struct qgen_bitpattern {
     uint8_t width;
-    uint8_t __Reserved0[7];
+    uint8_t shift; // how far the pattern has been shifted left to align it to the width of its tree
+    uint16_t priority; // among patterns matching a key the highest priority wins, then the lowest index
+    uint8_t __Reserved0[4];
     uint64_t __Reserved1;
     uint64_t mask_low, mask_high;
     uint64_t active_low, active_high;
 } qgen_bitpattern_t;
 
+// Keys wider than 128 bits use the wide pattern type and their own generator and dispatch, up to QGEN_KEY_MAX_BITS.
+// Word 0 holds the lowest 64 bits, the key passed to dispatch has the same layout.
+#define QGEN_KEY_MAX_BITS 512
+#define QGEN_KEY_MAX_WORDS (QGEN_KEY_MAX_BITS / 64)
+
+typedef struct qgen_wide_pattern {
+    uint16_t width;
+    uint16_t shift; // how far the pattern has been shifted left to align it to the width of its tree
+    uint16_t priority; // same as in qgen_bitpattern_t
+    uint8_t __Reserved0[2];
+    uint64_t mask[QGEN_KEY_MAX_WORDS];
+    uint64_t active[QGEN_KEY_MAX_WORDS];
+} qgen_wide_pattern_t;
+
+// Named operand fields of a pattern, written as name:bits in the pattern string (e.g. `0000000 rs2:5 rs1:5 000 rd:5
+// 0110011`). Field bits are wildcards as far as matching goes. A name used more than once is one field, its parts are
+// concatenated with the first part as the most significant, so split immediates come out whole. A name needs a
+// character other than 0, 1, x and X, `xxxx:0101` is eight bits and not a field.
+#define QGEN_FIELD_NAME_MAX 16
+#define QGEN_MAX_FIELDS 8
+
+typedef struct qgen_field {
+    char name[QGEN_FIELD_NAME_MAX]; // NUL terminated, longer names are cut
+    uint64_t mask_low, mask_high; // bits of the field, at most 64 of them
+} qgen_field_t;
+
+typedef struct qgen_fields {
+    uint32_t count;
+    uint8_t __Reserved0[4];
+    qgen_field_t fields[QGEN_MAX_FIELDS]; // in order of first appearance, further fields stay plain wildcards
+} qgen_fields_t;
+
+// Split strategies of qgen_generate_tree_ex. The greedy split takes the bit with the best (n0 + n1) / (n0 * n1) score,
+// which only counts patterns that care about the bit. The cost model estimates the depth below every candidate and
+// also charges for patterns copied into both children and for partly empty buckets. It can look several levels
+// ahead, keeping the beam_width cheapest bits of every level.
+#define QGEN_SPLIT_GREEDY 0
+#define QGEN_SPLIT_COST 1
+#define QGEN_LOOKAHEAD_MAX 4
+#define QGEN_BEAM_MAX 16
+
+// Generation settings, all zeros gives the same tree as qgen_generate_tree
+typedef struct qgen_gen_options {
+    uint8_t split; // QGEN_SPLIT_ strategy
+    uint8_t lookahead; // levels the cost model looks ahead, 0 means 1, at most QGEN_LOOKAHEAD_MAX
+    uint8_t beam_width; // candidate bits kept per level when looking ahead, 0 means 4, at most QGEN_BEAM_MAX
+    uint8_t max_table_bits; // widest table node, 0 means QGEN_TABLE_MAX_BITS and 1 disables table nodes
+    uint16_t duplication_penalty; // 1/256 hops for copying every pattern of a set into both children, 0 means 256
+    uint16_t fullness_penalty; // 1/256 hops for an empty bucket, less for fuller ones, 0 means 64
+    size_t nthreads; // threads building independent subtrees, 0 and 1 mean the calling thread only
+    const uint64_t *hits; // how often each pattern matched, as in qgen_generate_tree_weighted, or NULL
+} qgen_gen_options_t;
+
 inline static size_t qgen_get_bitpattern_size() {
     return sizeof(qgen_bitpattern_t);
 }
@@ -71,18 +160,43 @@ inline static size_t qgen_get_bitpattern_size() {
 
 typedef uint64_t qgen_otree_node_t;
 
-#define QGEN_NODE_INTERMEDIATE(split_bit_index, weight, left_child, right_child) (uint64_t) ((((uint64_t) (split_bit_index) & 0x7fULL) << 56ULL) | (((uint64_t) (weight) & 0xffffULL) << 32ULL) | (((uint64_t) (left_child) & 0xffffULL) << 16) | ((uint64_t) (right_child) & 0xffffULL))
-#define QGEN_NODE_LEAF(weight, bucket_index) (uint64_t) ((1ULL << 63ULL) | (((uint64_t) (weight) & 0xffffULL) << 32ULL) | ((uint64_t) (bucket_index) & 0xffffULL))
+// Split bit indices have 9 bits, the low 7 at 62:56 and the top 2 at 53:52, which 128-bit trees leave at zero
+#define QGEN_NODE_INDEX_BITS(split_bit_index) ((((uint64_t) (split_bit_index) & 0x7fULL) << 56ULL) | ((((uint64_t) (split_bit_index) >> 7) & 0x3ULL) << 52ULL))
+#define QGEN_NODE_INTERMEDIATE(split_bit_index, weight, left_child, right_child) (uint64_t) (QGEN_NODE_INDEX_BITS(split_bit_index) | (((uint64_t) (weight) & 0xffffULL) << 32ULL) | (((uint64_t) (left_child) & 0xffffULL) << 16) | ((uint64_t) (right_child) & 0xffffULL))
+#define QGEN_NODE_LEAF(weight, bucket_index) (uint64_t) ((1ULL << 63ULL) | (((uint64_t) (weight) & 0xffffULL) << 32ULL) | ((uint64_t) (bucket_index) & 0xffffffffULL))
+
+// Table nodes extract a contiguous field of 2 to QGEN_TABLE_MAX_BITS bits starting at field_lsb, and use it as an index
+// into a table of 2^field_bits child node indices stored at table_offset in the tree's tables array.
+#define QGEN_NODE_TABLE(field_lsb, field_bits, weight, table_offset) (uint64_t) (QGEN_NODE_INDEX_BITS(field_lsb) | QGEN_NODE_TABLE_FLAG | (((uint64_t) (field_bits) & 0xfULL) << 48ULL) | (((uint64_t) (weight) & 0xffffULL) << 32ULL) | ((uint64_t) (table_offset) & 0xffffffffULL))
+
+#define QGEN_TABLE_MAX_BITS 8
+
+// Intermediate nodes address their children with 16 bits. A split whose children don't fit is stored in the wide form
+// instead, a table node with a single field bit and two 32-bit entries. The form is picked node by node, so trees of
+// up to QGEN_NODE_COMPACT_LIMIT nodes never contain wide nodes.
+#define QGEN_NODE_COMPACT_LIMIT 0x10000
+#define QGEN_NODE_INDEX_LIMIT 0x100000000ULL
 
 #define QGEN_NODE_TYPE_MASK (1ULL << 63ULL)
+#define QGEN_NODE_TABLE_FLAG (1ULL << 55ULL)
 #define QGEN_NODE_IS_LEAF(node) ((node) & QGEN_NODE_TYPE_MASK)
 #define QGEN_NODE_IS_INTERMEDIATE(node) (!QGEN_NODE_IS_LEAF(node))
+#define QGEN_NODE_IS_TABLE(node) (((node) & (QGEN_NODE_TYPE_MASK | QGEN_NODE_TABLE_FLAG)) == QGEN_NODE_TABLE_FLAG)
 
-#define QGEN_NODE_SPLIT_BIT(node) (((node) >> 56ULL) & 0x7fULL)
+#define QGEN_NODE_SPLIT_BIT(node) ((((node) >> 56ULL) & 0x7fULL) | ((((node) >> 52ULL) & 0x3ULL) << 7))
 #define QGEN_NODE_LEFT(node) (((node) >> 16ULL) & 0xffffULL)
 #define QGEN_NODE_RIGHT(node) ((node) & 0xffffULL)
 #define QGEN_NODE_WEIGHT(node) (((node) >> 32ULL) & 0xffffULL)
-#define QGEN_NODE_BUCKET(node) ((node) & 0xffffULL)
+#define QGEN_NODE_BUCKET(node) ((node) & 0xffffffffULL)
+#define QGEN_NODE_FIELD_LSB(node) QGEN_NODE_SPLIT_BIT(node)
+#define QGEN_NODE_FIELD_BITS(node) (((node) >> 48ULL) & 0xfULL)
+#define QGEN_NODE_TABLE_OFFSET(node) ((node) & 0xffffffffULL)
+
+// Tree flags
+#define QGEN_TREE_OWNS_PATTERNS (1 << 0) // patterns array list is freed with the tree
+#define QGEN_TREE_MAPPED (1 << 1) // tables live in a read-only file mapping, see qgen_map_tree
+#define QGEN_TREE_COMPACT (1 << 2) // nodes, buckets, tables and pattern ID lists share the allocation of the tree
+#define QGEN_TREE_WIDE (1 << 3) // generated from wide patterns, see qgen_generate_tree_wide
 
 #ifdef QGEN_NON_OPAQUE
 struct qgen_bucket {
@@ -90,15 +204,71 @@ struct qgen_bucket {
     size_t *pattern_ids;
 };
 
+// Frozen bucket, the patterns are stored as a structure of arrays so all of them can be compared at once.
+// Unused slots have a zero mask and all ones as value so they never match.
+struct qgen_leaf {
+    uint64_t mask_low[QGEN_BUCKET_MAX_LENGTH];
+    uint64_t mask_high[QGEN_BUCKET_MAX_LENGTH];
+    uint64_t active_low[QGEN_BUCKET_MAX_LENGTH];
+    uint64_t active_high[QGEN_BUCKET_MAX_LENGTH];
+    uint32_t pattern_ids[QGEN_BUCKET_MAX_LENGTH];
+    uint32_t pattern_count;
+    uint8_t __Reserved0[60];
+};
+
+// On-disk bucket, the pattern ID list is an array of uint32_t at pattern_offset bytes from the start of the file
+struct qgen_file_bucket {
+    uint32_t pattern_count;
+    uint32_t pattern_offset;
+};
+
 struct qgen_otree {
-    uint8_t width;
-    uint8_t __Reserved0[7];
+    uint16_t width;
+    uint8_t flags;
+    uint8_t leaf_isa;
+    uint8_t __Reserved0[4];
     size_t node_count;
     qgen_otree_node_t *nodes;
     size_t pattern_count;
-    qgen_bitpattern_t *patterns;
+    qgen_bitpattern_t *patterns; // NULL for wide trees
+    qgen_wide_pattern_t *wide_patterns; // only set for wide trees
     size_t bucket_count;
     qgen_bucket_t *buckets;
+    // Child indices of table nodes
+    size_t table_length;
+    uint32_t *tables;
+    // Only used by mapped trees, buckets is NULL then
+    const qgen_file_bucket_t *file_buckets;
+    uint8_t *mapping;
+    size_t mapping_size;
+    // Set by qgen_tree_freeze, one per bucket, 64-byte aligned
+    qgen_leaf_t *leaves;
+    intptr_t (*leaf_match)(const qgen_leaf_t *leaf, uint64_t high, uint64_t low);
+    // Left behind by qgen_tree_insert and qgen_tree_remove, unreachable but still stored
+    size_t dead_nodes;
+    size_t dead_buckets;
+    double base_cost; // expected dispatch cost before the first update, 0 if there was none
+    uint32_t *parents; // edges into every node, counted on the first update since subtrees can be shared
+    // Set by qgen_tree_jit, executable code compiled from the tree
+    uint8_t *jit_code;
+    size_t jit_size;
+    // Set by qgen_tree_set_fields, aligned like the patterns
+    qgen_fields_t *fields;
+    void (*extract_fields)(const qgen_fields_t *fields, uint64_t high, uint64_t low, uint64_t *values);
+};
+
+// Dispatch statistics of one tree, filled by the threads it is bound to
+struct qgen_stats {
+    const qgen_otree_t *tree;
+    uint64_t dispatches;
+    uint64_t misses;
+    size_t node_count;
+    uint64_t *node_visits;
+    size_t bucket_count;
+    uint64_t *bucket_misses;
+    // bucket_scans[bucket][n] counts the dispatches that ended after comparing n patterns of the bucket. Leaves no bit
+    // can split are longer than QGEN_BUCKET_MAX_LENGTH, the last slot counts every scan of that many patterns or more.
+    uint64_t (*bucket_scans)[QGEN_STATS_SCAN_SLOTS];
 };
 #endif
 
@@ -106,13 +276,18 @@ extern const uint8_t QGEN_FILE_MAGIC[];
 
 #ifdef QGEN_INTERNAL
 #define QGEN_FILE_MIN_VERSION_SUPPORTED 0
-#define QGEN_FILE_MAX_VERSION_SUPPORTED 0
+#define QGEN_FILE_MAX_VERSION_SUPPORTED 2
 
 const uint8_t QGEN_FILE_MAGIC[] = {0x07, 0x12, 0xEE, 0x2E};
 #endif
 
 #define QGEN_FILE_VERSION(flags) (flags >> 24)
 #define QGEN_FILE_CHECKSUM_METHOD(flags) (flags & 3)
+#define QGEN_FILE_FLAGS(version, checksum_method) ((((uint32_t) (version)) << 24) | ((uint32_t) (checksum_method) & 3))
+
+#define QGEN_FILE_CHECKSUM_NONE 0
+#define QGEN_FILE_CHECKSUM_FLETCHER 1 // fletcher-64 over the pattern table
+#define QGEN_FILE_CHECKSUM_FLETCHER_FULL 2 // fletcher-64 over everything after the header
 
 typedef struct qgen_file_header {
     uint8_t magic[4]; // Magic number: 0x07, 0x12, 0xEE, 0x2E, 0 712EE part is hexspeak for O TREE, 2E is just an ascii dot
@@ -124,12 +299,24 @@ typedef struct qgen_file_header {
     uint32_t pattern_offset;
     uint32_t bucket_count;
     uint32_t bucket_offset;
-    uint8_t __Reserved0[16];
+    uint8_t width;
+    uint8_t __Reserved0[3];
+    uint32_t table_length; // since version 1, child index tables of table nodes as uint32_t
+    uint32_t table_offset;
+    uint8_t __Reserved1[4];
 } qgen_file_header_t;
 
 #define qgen_pat(lit) qgen_str2bp(sizeof(QGEN_STR(lit)) / sizeof(char), QGEN_STR(lit))
 QGEN_EXPORT qgen_bitpattern_t qgen_str2bp(size_t length, const char *pattern);
 QGEN_EXPORT qgen_bitpattern_t qgen_strz2bp(const char *pattern);
+// Same as qgen_str2bp, also returns the named fields of the pattern
+QGEN_EXPORT qgen_bitpattern_t qgen_str2bp_fields(size_t length, const char *pattern, qgen_fields_t *fields);
+QGEN_EXPORT qgen_bitpattern_t qgen_strz2bp_fields(const char *pattern, qgen_fields_t *fields);
+// Same syntax as qgen_str2bp, up to QGEN_KEY_MAX_BITS bits
+QGEN_EXPORT qgen_wide_pattern_t qgen_str2wp(size_t length, const char *pattern);
+QGEN_EXPORT qgen_wide_pattern_t qgen_strz2wp(const char *pattern);
+// Sets the priority of every pattern to its number of fixed bits, so the most specific match wins
+QGEN_EXPORT void qgen_prioritize_specific(qgen_bitpattern_t *patterns);
 
 typedef struct qgen_array_list qgen_array_list_t;
 
@@ -152,23 +339,241 @@ QGEN_EXPORT void qgen_free_array_list(void *arr);
 
 #ifdef QGEN_INTERNAL
 typedef struct qgen_otree_gen qgen_otree_gen_t;
+typedef struct qgen_arena_chunk qgen_arena_chunk_t;
+
+// Bump allocator, chunks are only given back wholesale by releasing to a mark
+struct qgen_arena_chunk {
+    qgen_arena_chunk_t *prev;
+    size_t size;
+    size_t used;
+};
+
+typedef struct qgen_arena {
+    qgen_arena_chunk_t *head;
+    qgen_arena_chunk_t *spare; // last released chunk, kept to avoid malloc churn between siblings
+} qgen_arena_t;
+
+typedef struct qgen_arena_mark {
+    qgen_arena_chunk_t *chunk;
+    size_t used;
+} qgen_arena_mark_t;
+
+// Subtree already built for a pattern index set
+typedef struct qgen_memo_entry {
+    uint64_t hash; // 0 marks a free slot
+    const size_t *patterns;
+    size_t length;
+    size_t node;
+} qgen_memo_entry_t;
 
 struct qgen_otree_gen {
-    uint8_t __Reserved0[8];
-    size_t node_capacity, bucket_capacity;
-    uint64_t mask_low, mask_high;
+    uint8_t max_table_bits; // 0 disables table nodes
+    uint8_t split, lookahead, beam_width; // split strategy, see qgen_gen_options_t
+    uint16_t duplication_penalty, fullness_penalty;
+    size_t node_capacity, bucket_capacity, table_capacity;
+    uint64_t mask[QGEN_KEY_MAX_WORDS]; // bits any pattern cares about, word 0 is the lowest
+    uint16_t *weights; // traffic weight of every pattern, NULL splits by pattern counts
+    uint64_t weight_total;
+    qgen_arena_t scratch; // pattern index lists of the sets being split, released level by level
+    qgen_arena_t ids; // pattern ID lists of the buckets, until the tree is compacted
+    // Open addressing table of the sets built so far, keys are copied into memo_keys
+    qgen_memo_entry_t *memo;
+    size_t memo_capacity, memo_count;
+    qgen_arena_t memo_keys;
     qgen_otree_t tree;
 };
 
 void qgen_discard_partial_tree(qgen_otree_t *tree);
-int qgen_generate_tree_helper(qgen_otree_gen_t *gentree, size_t *patterns);
+// Builds the subtree of a pattern index set, node is its root. The root is the last node pushed unless an identical
+// set was built before and its subtree is shared instead.
+int qgen_generate_tree_helper(qgen_otree_gen_t *gentree, const size_t *patterns, size_t length, size_t *node);
 void qgen_find_cared_bits(qgen_otree_gen_t *tree);
 #endif
 
+// Identical subtrees are only stored once, so the tree is a DAG. qgen_tree_sharing reports how much that saves.
 QGEN_EXPORT qgen_otree_t *qgen_generate_tree(qgen_bitpattern_t *patterns);
+// An equivalent tree to qgen_generate_tree, with independent subtrees built on nthreads threads (0 means one per
+// CPU). Identical sets are only shared inside the subtree of every thread, so the tree can have more nodes.
+QGEN_EXPORT qgen_otree_t *qgen_generate_tree_parallel(qgen_bitpattern_t *patterns, size_t nthreads);
+// qgen_generate_tree with every setting exposed, options may be NULL for the defaults. Threads and profile weights
+// combine with any split strategy.
+QGEN_EXPORT qgen_otree_t *qgen_generate_tree_ex(qgen_bitpattern_t *patterns, const qgen_gen_options_t *options);
+// Profile-guided generation, splits balance traffic instead of pattern counts. hits[i] is how often pattern i matched,
+// node weights then hold the traffic share of their subtree scaled to 16 bits, and hot patterns go first in buckets
+// wherever that can't change the result.
+QGEN_EXPORT qgen_otree_t *qgen_generate_tree_weighted(qgen_bitpattern_t *patterns, const uint64_t *hits);
+// Tree over keys of up to QGEN_KEY_MAX_BITS bits, the width is the widest pattern. Wide trees are dispatched with
+// qgen_tree_dispatch_wide only. Relayout, statistics and the dot export work on them, updates, frozen leaves, the JIT,
+// C export and serialization don't (ENOTSUP).
+QGEN_EXPORT qgen_otree_t *qgen_generate_tree_wide(qgen_wide_pattern_t *patterns);
+// key holds (width + 63) / 64 words, word 0 is the lowest
+QGEN_EXPORT intptr_t qgen_tree_dispatch_wide(qgen_otree_t *tree, const uint64_t *key);
+// Adds up how often each pattern is the match of a sample of keys, hits must have room for every pattern of the tree
+QGEN_EXPORT void qgen_tree_count_hits(qgen_otree_t *tree, const uint64_t *high, const uint64_t *low, size_t n, uint64_t *hits);
 QGEN_EXPORT intptr_t qgen_tree_dispatch(qgen_otree_t *tree, uint64_t high, uint64_t low);
+// Same as calling qgen_tree_dispatch for every key, but the keys are walked in an interleaved manner to overlap cache misses
+QGEN_EXPORT void qgen_tree_dispatch_batch(qgen_otree_t *tree, const uint64_t *high, const uint64_t *low, intptr_t *out, size_t n);
+// Decodes back-to-back records of buf, each one is the next tree width bits of the stream dispatched as a key, and
+// the width of the pattern it matches is how far the stream advances. Stores up to capacity pattern indices in out and
+// returns how many. Scanning stops early at a record matching nothing or running past the end; *consumed gets the
+// bit offset it stopped at. flags are QGEN_SCAN_ values, by default bytes are taken in order, most significant bit
+// first. ENOTSUP for wide trees.
+QGEN_EXPORT size_t qgen_tree_scan(qgen_otree_t *tree, const uint8_t *buf, size_t length, int flags, intptr_t *out, size_t capacity, size_t *consumed);
+// Every pattern matching the key, in the order they resolve. Stores up to capacity indices in out and returns how
+// many patterns match, which may be more.
+QGEN_EXPORT size_t qgen_tree_dispatch_all(qgen_otree_t *tree, uint64_t high, uint64_t low, size_t *out, size_t capacity);
+// Gives the patterns of tree their fields, fields is an array list with one entry per pattern as returned by
+// qgen_str2bp_fields. Fields are extracted with BMI2 pext where the CPU has it. ENOTSUP for wide trees.
+QGEN_EXPORT int qgen_tree_set_fields(qgen_otree_t *tree, const qgen_fields_t *fields);
+// Fields of a pattern, NULL if it has none
+QGEN_EXPORT const qgen_fields_t *qgen_tree_fields(qgen_otree_t *tree, size_t pattern_index);
+// Dispatches the key and stores the fields of the matching pattern in values, which needs room for QGEN_MAX_FIELDS.
+// values[i] belongs to fields[i] of the pattern, patterns without fields leave values alone.
+QGEN_EXPORT intptr_t qgen_tree_decode(qgen_otree_t *tree, uint64_t high, uint64_t low, uint64_t *values);
 QGEN_EXPORT void qgen_export_to_dot(qgen_otree_t *tree, const char *filename);
-QGEN_EXPORT uint8_t qgen_tree_max_width(qgen_otree_t *tree);
+// Emits a self-contained C function `intptr_t fn_name(uint64_t high, uint64_t low)` equivalent to qgen_tree_dispatch on tree
+QGEN_EXPORT int qgen_export_to_c(qgen_otree_t *tree, const char *filename, const char *fn_name);
+
+typedef intptr_t (*qgen_dispatch_fn_t)(qgen_otree_t *tree, uint64_t high, uint64_t low);
+// Compiles tree to x86-64 machine code dispatching like qgen_tree_dispatch, and returns it. Other architectures get
+// qgen_tree_dispatch itself. The code belongs to the tree and is freed with it or replaced by the next call, it
+// doesn't follow updates made afterwards and doesn't record statistics. Every bucket entry becomes immediates in the
+// code, so very large trees can end up slower than the interpreter once the code outgrows the instruction cache.
+// Returns NULL and sets errno on failure.
+QGEN_EXPORT qgen_dispatch_fn_t qgen_tree_jit(qgen_otree_t *tree);
+QGEN_EXPORT uint16_t qgen_tree_max_width(qgen_otree_t *tree);
+
+// Stored node and bucket counts against the ones the same tree would need with every shared subtree copied out
+typedef struct qgen_sharing {
+    uint64_t nodes;
+    uint64_t buckets;
+    uint64_t unshared_nodes;
+    uint64_t unshared_buckets;
+} qgen_sharing_t;
+
+QGEN_EXPORT int qgen_tree_sharing(qgen_otree_t *tree, qgen_sharing_t *sharing);
+// Binary splits stored in the wide form because a child index didn't fit 16 bits
+QGEN_EXPORT size_t qgen_tree_wide_nodes(qgen_otree_t *tree);
+
+// Size and shape of a tree. Depths count the inner nodes walked through before the leaf, the average is the expected
+// depth for uniformly random keys.
+typedef struct qgen_tree_info {
+    uint64_t nodes;
+    uint64_t buckets;
+    uint64_t table_entries;
+    uint64_t bucket_entries; // pattern IDs over all buckets
+    uint64_t bytes; // held by the tree: nodes, tables, buckets, frozen leaves, JIT code and owned patterns
+    uint32_t max_depth;
+    double average_depth;
+} qgen_tree_info_t;
+
+QGEN_EXPORT int qgen_tree_info(qgen_otree_t *tree, qgen_tree_info_t *info);
 QGEN_EXPORT void qgen_free_tree(qgen_otree_t *tree);
 
+// Instruction sets for the frozen leaf kernels
+#define QGEN_ISA_AUTO 0 // best one supported by the CPU
+#define QGEN_ISA_SCALAR 1
+#define QGEN_ISA_SSE2 2
+#define QGEN_ISA_AVX2 3
+#define QGEN_ISA_AVX512 4
+
+// Copies every bucket into the SIMD-friendly qgen_leaf_t layout, dispatch uses it from then on.
+// Returns ENOTSUP if the requested instruction set isn't available, EINVAL if a bucket is longer than
+// QGEN_BUCKET_MAX_LENGTH, which only happens when more patterns than that all overlap.
+QGEN_EXPORT int qgen_tree_freeze(qgen_otree_t *tree, int isa);
+// Instruction set the leaves of tree are matched with, QGEN_ISA_AUTO if the tree isn't frozen
+QGEN_EXPORT int qgen_tree_leaf_isa(qgen_otree_t *tree);
+
+// Node orders for qgen_tree_relayout
+#define QGEN_LAYOUT_BREADTH_FIRST 0 // level by level, the hot top levels take the fewest cache lines
+#define QGEN_LAYOUT_BLOCKED 1 // cache line sized subtrees in breadth-first order, walks touch fewer lines overall
+
+// Renumbers the nodes of a tree for the cache, generation appends them in post-order. The root stays the last node
+// with the first levels right before it. Unreachable nodes left by updates are dropped. Statistics collected so far
+// refer to the old numbering. Mapped trees can't be changed (EROFS).
+QGEN_EXPORT int qgen_tree_relayout(qgen_otree_t *tree, int layout);
+
+// Incremental updates. The first update makes the tree copy its patterns and arrays, so it no longer depends on the
+// pattern array it was generated from. Mapped trees can't be updated (EROFS).
+// qgen_tree_insert adds a pattern to every leaf it can reach, leaves that overflow are regenerated into subtrees.
+// Returns the index of the new pattern, or -1 and sets errno, EINVAL if the pattern is wider than the tree.
+QGEN_EXPORT intptr_t qgen_tree_insert(qgen_otree_t *tree, qgen_bitpattern_t pattern);
+// Takes a pattern out of every leaf, its index isn't reused. Sibling leaves that fit one bucket afterwards are merged.
+QGEN_EXPORT int qgen_tree_remove(qgen_otree_t *tree, size_t pattern_index);
+// How far updates have degraded the tree: growth of the expected dispatch cost for uniform keys since the first
+// update, plus the fraction of dead nodes. 0 for untouched trees, above QGEN_REBUILD_THRESHOLD regenerating pays off.
+QGEN_EXPORT double qgen_tree_degradation(qgen_otree_t *tree);
+#define QGEN_REBUILD_THRESHOLD 0.25
+
+// Tree handles publish a new tree to concurrent readers without locking them out. Readers dispatch with plain loads
+// and stores, the tree they replaced is freed once every reader has moved past it.
+// Each reading thread registers once. Every reader call is a quiescent state: the tree returned by the previous call
+// may be freed from then on. Readers that stop dispatching for a while go offline so they don't hold back reclamation.
+// Published trees belong to the handle and must not be updated in place, publish a new tree instead.
+QGEN_EXPORT qgen_tree_handle_t *qgen_new_tree_handle(qgen_otree_t *tree);
+// Frees the handle, its trees and any reader still registered. No reader may be running.
+QGEN_EXPORT void qgen_free_tree_handle(qgen_tree_handle_t *handle);
+// Makes tree current, the old one is freed as soon as no reader can still be using it. Safe to call from several
+// writers, EINVAL if tree is already current.
+QGEN_EXPORT int qgen_handle_publish(qgen_tree_handle_t *handle, qgen_otree_t *tree);
+// Frees retired trees readers have moved past, returns how many are still waiting
+QGEN_EXPORT size_t qgen_handle_reclaim(qgen_tree_handle_t *handle);
+// The reader starts out online
+QGEN_EXPORT qgen_reader_t *qgen_handle_register(qgen_tree_handle_t *handle);
+QGEN_EXPORT void qgen_handle_unregister(qgen_reader_t *reader);
+QGEN_EXPORT void qgen_reader_online(qgen_reader_t *reader);
+QGEN_EXPORT void qgen_reader_offline(qgen_reader_t *reader);
+// Announces that the reader holds no tree, without fetching one
+QGEN_EXPORT void qgen_reader_quiescent(qgen_reader_t *reader);
+// Current tree, usable with every dispatch function until the next call on reader
+QGEN_EXPORT qgen_otree_t *qgen_reader_tree(qgen_reader_t *reader);
+QGEN_EXPORT intptr_t qgen_reader_dispatch(qgen_reader_t *reader, uint64_t high, uint64_t low);
+
+// Instrumentation, only available when the library is built with QGEN_STATS, ENOSYS otherwise.
+// Dispatches record into the stats block bound to the calling thread, as long as it belongs to the tree being walked.
+QGEN_EXPORT qgen_stats_t *qgen_stats_new(qgen_otree_t *tree);
+QGEN_EXPORT void qgen_stats_free(qgen_stats_t *stats);
+// Binds stats to the calling thread, NULL unbinds
+QGEN_EXPORT int qgen_stats_bind(qgen_stats_t *stats);
+QGEN_EXPORT void qgen_stats_reset(qgen_stats_t *stats);
+// Adds the counters of from to into, both have to belong to the same tree
+QGEN_EXPORT int qgen_stats_merge(qgen_stats_t *into, const qgen_stats_t *from);
+// Text dump with one counter per line: `dispatches <n>`, `misses <n>`, `node <id> visits <n>` and
+// `bucket <id> length <n> misses <n> scans <h0> .. <h16>`, h16 includes longer scans
+QGEN_EXPORT int qgen_stats_export(const qgen_stats_t *stats, const char *filename);
+// Same as qgen_export_to_dot, with nodes shaded by how often they were visited
+QGEN_EXPORT int qgen_stats_export_dot(const qgen_stats_t *stats, const char *filename);
+
+// Serialization, all tables are written in native byte order.
+// qgen_load_tree copies the file into a regular tree, qgen_map_tree dispatches straight out of a read-only mapping.
+// Both return NULL and set errno on failure, EILSEQ is used for bad magic/version/checksum and for tables that don't
+// form a valid tree (indices out of range, split bits outside the width, cycles).
+// Trees with wide nodes or more than QGEN_NODE_COMPACT_LIMIT buckets are written as version 2, so older readers
+// reject them instead of truncating indices. Anything else is still written as version 1.
+QGEN_EXPORT int qgen_save_tree(qgen_otree_t *tree, const char *filename, uint32_t checksum_method);
+QGEN_EXPORT qgen_otree_t *qgen_load_tree(const char *filename);
+QGEN_EXPORT qgen_otree_t *qgen_map_tree(const char *filename);
+
+// Tree cache shared by processes through a directory. The file name is a hash of the aligned patterns, the options
+// and the generator version, a cached tree is loaded instead of generated when its patterns match. New trees are
+// written to a temporary file and renamed into place, so readers only ever see complete files. Failing to read or
+// write the cache never fails generation. The directory is created if it doesn't exist, its parent has to.
+// The tree uses patterns like one from qgen_generate_tree does.
+QGEN_EXPORT qgen_otree_t *qgen_generate_tree_cached(qgen_bitpattern_t *patterns, const char *cache_dir);
+QGEN_EXPORT qgen_otree_t *qgen_generate_tree_cached_ex(qgen_bitpattern_t *patterns, const qgen_gen_options_t *options, const char *cache_dir);
+
+// Process wide cache counters
+typedef struct qgen_cache_stats {
+    uint64_t hits; // trees loaded from the cache
+    uint64_t misses; // trees generated
+    uint64_t stores; // generated trees written to the cache
+    uint64_t errors; // unreadable or mismatching cache files and failed writes
+} qgen_cache_stats_t;
+
+QGEN_EXPORT void qgen_cache_stats(qgen_cache_stats_t *stats);
+
+#ifdef __cplusplus
+}
+#endif
+
 #endif // QGEN_H
\ No newline at end of file
@@ -0,0 +1,492 @@
+#ifndef QGEN_HPP
+#define QGEN_HPP
+
+// Compile time front end, C++20 and header only.
+// Patterns known when building are parsed and split by the compiler, the tree comes out as static constexpr tables in
+// the layout of qgen_generate_tree, node for node, and dispatch is a template per node that can be inlined whole:
+//
+//     static constexpr std::array<std::string_view, 2> rv_ops = {
+//         "0000000 rs2:5 rs1:5 000 rd:5 0110011", // add
+//         "0100000 rs2:5 rs1:5 000 rd:5 0110011", // sub
+//     };
+//     using rv_tree = qgen::tree<rv_ops>;
+//     intptr_t op = rv_tree::dispatch(0, insn);
+//
+// Patterns are strings in the syntax of qgen_pat or qgen_bitpattern_t values, field names only count as wildcards.
+// The split is the default one of qgen_generate_tree: greedy bits, table nodes of up to QGEN_TABLE_MAX_BITS bits and
+// shared subtrees. Large pattern sets can run into the constant evaluation limit of the compiler, raise it with
+// -fconstexpr-ops-limit (GCC) or -fconstexpr-steps (clang). `make bench-cpp` compares the tree of the RV64 set with
+// qgen_generate_tree and times the inlined dispatch.
+
+#if defined(QGEN_H) && !defined(QGEN_NON_OPAQUE)
+#error "qgen.hpp needs QGEN_NON_OPAQUE, include it before qgen.h or define QGEN_NON_OPAQUE first"
+#endif
+#ifndef QGEN_NON_OPAQUE
+#define QGEN_NON_OPAQUE
+#endif
+#include "qgen.h"
+
+#include <array>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+namespace qgen {
+
+// Same as qgen_str2bp
+constexpr qgen_bitpattern_t parse(std::string_view pattern) {
+    constexpr size_t max_width = 128;
+    auto is_bit = [](char c) { return c == '0' || c == '1' || c == 'x' || c == 'X' || c == '*'; };
+    auto is_name = [](char c, bool first) {
+        return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || c == '_' || (!first && c >= '0' && c <= '9');
+    };
+    // Length of the field token at i, 0 if there is none there, bits gets its width. Names of bit characters only
+    // are bits.
+    auto field_token = [&](size_t i, size_t &bits) -> size_t {
+        size_t j = i;
+        bool named = false;
+        for (; j < pattern.size() && is_name(pattern[j], j == i); j++) named |= !is_bit(pattern[j]);
+        if (!named || j >= pattern.size() || pattern[j] != ':') return 0;
+        size_t k = j + 1, n = 0;
+        while (k < pattern.size() && pattern[k] >= '0' && pattern[k] <= '9') {
+            if (n <= QGEN_KEY_MAX_BITS) n = n * 10 + (size_t) (pattern[k] - '0');
+            k++;
+        }
+        if (k == j + 1 || n == 0) return 0;
+        bits = n;
+        return k - i;
+    };
+
+    size_t width = 0, bits = 0;
+    for (size_t i = 0; i < pattern.size() && width < max_width; ) {
+        if (size_t token = field_token(i, bits)) {
+            width += bits < max_width - width ? bits : max_width - width;
+            i += token;
+            continue;
+        }
+        if (is_bit(pattern[i])) width++;
+        i++;
+    }
+
+    uint64_t mask[2] = {}, active[2] = {};
+    size_t bit = width;
+    for (size_t i = 0; i < pattern.size() && bit > 0; ) {
+        if (size_t token = field_token(i, bits)) {
+            bit -= bits < bit ? bits : bit;
+            i += token;
+            continue;
+        }
+        char c = pattern[i++];
+        if (!is_bit(c)) continue;
+        bit--;
+        if (c == '0' || c == '1') mask[bit >> 6] |= 1ULL << (bit & 63);
+        if (c == '1') active[bit >> 6] |= 1ULL << (bit & 63);
+    }
+
+    qgen_bitpattern_t bp{};
+    bp.width = (uint8_t) width;
+    bp.mask_low = mask[0];
+    bp.mask_high = mask[1];
+    bp.active_low = active[0];
+    bp.active_high = active[1];
+    return bp;
+}
+
+namespace detail {
+
+constexpr qgen_bitpattern_t to_pattern(std::string_view pattern) {
+    return parse(pattern);
+}
+
+constexpr qgen_bitpattern_t to_pattern(const qgen_bitpattern_t &pattern) {
+    return pattern;
+}
+
+constexpr unsigned log2_floor64(uint64_t x) {
+    unsigned n = 0;
+    while (x >>= 1) n++;
+    return n;
+}
+
+// The cost model helpers of qgen.c, they have to agree bit for bit so the trees come out the same
+constexpr uint64_t log2_fixed(uint64_t n) {
+    if (n <= 1) return 0;
+    uint64_t floor_log = log2_floor64(n);
+    uint64_t frac = floor_log >= 8 ? (n >> (floor_log - 8)) & 0xff : (n << (8 - floor_log)) & 0xff;
+    return (floor_log << 8) | frac;
+}
+
+constexpr uint64_t depth_estimate(uint64_t n) {
+    if (n <= QGEN_BUCKET_MAX_LENGTH) return 0;
+    return log2_fixed(n) - log2_fixed(QGEN_BUCKET_MAX_LENGTH);
+}
+
+// Same as qgen_align_pattern
+constexpr void align_pattern(qgen_bitpattern_t &bp, uint8_t width) {
+    int delta = (int) (width - bp.width) - (int) bp.shift;
+    bp.shift = (uint8_t) (width - bp.width);
+    auto shift_left = [](uint64_t &high, uint64_t &low, unsigned shift) {
+        if (shift >= 64) {
+            high = low << (shift - 64);
+            low = 0;
+            return;
+        }
+        high = (high << shift) | (low >> (64 - shift));
+        low <<= shift;
+    };
+    auto shift_right = [](uint64_t &high, uint64_t &low, unsigned shift) {
+        if (shift >= 64) {
+            low = high >> (shift - 64);
+            high = 0;
+            return;
+        }
+        low = (low >> shift) | (high << (64 - shift));
+        high >>= shift;
+    };
+    if (delta > 0) {
+        shift_left(bp.active_high, bp.active_low, (unsigned) delta);
+        shift_left(bp.mask_high, bp.mask_low, (unsigned) delta);
+    } else if (delta < 0) {
+        shift_right(bp.active_high, bp.active_low, (unsigned) -delta);
+        shift_right(bp.mask_high, bp.mask_low, (unsigned) -delta);
+    }
+}
+
+// Sizes of the generated tables, known after a first generation pass
+struct shape {
+    size_t node_count, table_length, bucket_count, id_count, pattern_count;
+};
+
+template <shape Shape>
+struct tree_tables {
+    uint16_t width;
+    std::array<qgen_otree_node_t, Shape.node_count> nodes;
+    std::array<uint32_t, Shape.table_length> tables;
+    std::array<size_t, Shape.bucket_count + 1> bucket_offsets; // bucket i holds ids[bucket_offsets[i]..bucket_offsets[i + 1])
+    std::array<size_t, Shape.id_count> ids;
+    std::array<qgen_bitpattern_t, Shape.pattern_count> patterns; // aligned to the width of the tree
+};
+
+// qgen_generate_tree_helper and the greedy qgen_choose_split, without weights, options or threads.
+// Sets are built in the same order, so node, table and bucket indices match the runtime generator.
+struct generator {
+    struct split {
+        uint64_t lsb, bits;
+    };
+    struct memo_entry {
+        uint64_t hash;
+        std::vector<size_t> patterns;
+        size_t node;
+    };
+
+    uint16_t width = 0;
+    uint64_t mask[2] = {};
+    std::vector<qgen_bitpattern_t> patterns;
+    std::vector<qgen_otree_node_t> nodes;
+    std::vector<uint32_t> tables;
+    std::vector<size_t> bucket_offsets{0};
+    std::vector<size_t> ids;
+    std::vector<memo_entry> memo;
+
+    constexpr void pattern_field(size_t id, uint64_t lsb, uint64_t bits, uint64_t &cares, uint64_t &value) const {
+        const qgen_bitpattern_t &pat = patterns[id];
+        uint64_t field_mask = (1ULL << bits) - 1;
+        cares = ((lsb >= 64 ? pat.mask_high : pat.mask_low) >> (lsb & 63)) & field_mask;
+        value = ((lsb >= 64 ? pat.active_high : pat.active_low) >> (lsb & 63)) & field_mask;
+    }
+
+    constexpr uint64_t table_counts(const std::vector<size_t> &set, uint64_t lsb, uint64_t bits, uint32_t *counts) const {
+        uint64_t field_mask = (1ULL << bits) - 1;
+        uint64_t total = 0;
+        uint32_t everywhere = 0;
+        for (size_t j = 0; j < ((size_t) 1 << bits); j++) counts[j] = 0;
+        for (size_t id : set) {
+            uint64_t cares = 0, value = 0;
+            pattern_field(id, lsb, bits, cares, value);
+            // Operand fields ignore the whole window, they are added to every entry at the end instead of one by one,
+            // which keeps the evaluation well inside the compiler's step limit
+            if (cares == 0) {
+                everywhere++;
+                continue;
+            }
+            uint64_t free_bits = ~cares & field_mask;
+            for (uint64_t sub = free_bits; ; sub = (sub - 1) & free_bits) {
+                counts[value | sub]++;
+                total++;
+                if (sub == 0) break;
+            }
+        }
+        for (size_t j = 0; j < ((size_t) 1 << bits); j++) counts[j] += everywhere;
+        return total + ((uint64_t) everywhere << bits);
+    }
+
+    // Same as qgen_choose_table
+    constexpr void choose_table(const std::vector<size_t> &set, uint64_t split_bit, uint64_t n0, uint64_t n1, split &result) const {
+        constexpr uint64_t dup_penalty = 512, empty_penalty = 256;
+        uint64_t length = set.size();
+        uint64_t nx = length - n0 - n1;
+        uint64_t s0 = n0 + nx, s1 = n1 + nx;
+        uint64_t best_cost = 256 + (s0 * depth_estimate(s0) + s1 * depth_estimate(s1)) / (s0 + s1);
+        uint32_t counts[1 << QGEN_TABLE_MAX_BITS] = {};
+
+        for (uint64_t bits = 2; bits <= QGEN_TABLE_MAX_BITS; bits++) {
+            for (uint64_t lsb = split_bit >= bits - 1 ? split_bit - (bits - 1) : 0; lsb <= split_bit; lsb++) {
+                if (lsb + bits > width || (lsb >> 6) != ((lsb + bits - 1) >> 6)) continue;
+
+                uint64_t total = table_counts(set, lsb, bits, counts);
+                uint64_t depth = 0, empty = 0;
+                bool progress = true;
+                for (uint64_t j = 0; j < (1ULL << bits); j++) {
+                    if (counts[j] == 0) empty++;
+                    if (counts[j] >= length) progress = false;
+                    depth += counts[j] * depth_estimate(counts[j]);
+                }
+                if (!progress) continue;
+
+                uint64_t cost = 256 + depth / total
+                    + dup_penalty * (total - length) / length
+                    + empty_penalty * empty / (1ULL << bits);
+                if (cost < best_cost) {
+                    best_cost = cost;
+                    result = {lsb, bits};
+                }
+            }
+        }
+    }
+
+    // Same as the greedy qgen_choose_split, false if no bit splits the set
+    constexpr bool choose_split(const std::vector<size_t> &set, split &result) const {
+        uint64_t best_bit = UINT64_MAX, best_n0 = 0, best_n1 = 0;
+        uint64_t gini_nom = UINT64_MAX, gini_denom = 1;
+        for (uint64_t bit = 0; bit < width; bit++) {
+            if (!(mask[bit >> 6] & (1ULL << (bit & 63)))) continue;
+            uint64_t n0 = 0, n1 = 0;
+            for (size_t id : set) {
+                uint64_t cares = 0, value = 0;
+                pattern_field(id, bit, 1, cares, value);
+                n0 += cares & ~value;
+                n1 += cares & value;
+            }
+            uint64_t cur_nom = n0 + n1;
+            if (cur_nom == 0) continue;
+            uint64_t cur_denom = n0 * n1;
+            if (cur_nom * gini_denom < gini_nom * cur_denom) {
+                gini_nom = cur_nom;
+                gini_denom = cur_denom;
+                best_bit = bit;
+                best_n0 = n0;
+                best_n1 = n1;
+            }
+        }
+        if (best_bit == UINT64_MAX) return false;
+        result = {best_bit, 1};
+        choose_table(set, best_bit, best_n0, best_n1, result);
+        return true;
+    }
+
+    static constexpr uint64_t memo_hash(const std::vector<size_t> &set) {
+        uint64_t hash = 0x9E3779B97F4A7C15ULL ^ set.size();
+        for (size_t id : set) {
+            hash = (hash ^ id) * 0xFF51AFD7ED558CCDULL;
+            hash ^= hash >> 32;
+        }
+        return hash | 1;
+    }
+
+    constexpr void push_split(split s, const std::vector<size_t> &child_nodes) {
+        uint64_t weight = 0;
+        for (size_t child : child_nodes) {
+            weight += QGEN_NODE_WEIGHT(nodes[child]);
+        }
+        if (weight > 0xffff) weight = 0xffff;
+        if (s.bits == 1 && child_nodes[0] < QGEN_NODE_COMPACT_LIMIT && child_nodes[1] < QGEN_NODE_COMPACT_LIMIT) {
+            nodes.push_back(QGEN_NODE_INTERMEDIATE(s.lsb, weight, child_nodes[0], child_nodes[1]));
+            return;
+        }
+        // Tables and wide binary nodes
+        size_t table_offset = tables.size();
+        for (size_t child : child_nodes) {
+            tables.push_back((uint32_t) child);
+        }
+        nodes.push_back(QGEN_NODE_TABLE(s.lsb, s.bits, weight, table_offset));
+    }
+
+    constexpr size_t build(const std::vector<size_t> &set) {
+        uint64_t hash = memo_hash(set);
+        for (const memo_entry &entry : memo) {
+            if (entry.hash == hash && entry.patterns == set) return entry.node;
+        }
+
+        split s{};
+        if (set.size() <= QGEN_BUCKET_MAX_LENGTH || !choose_split(set, s)) {
+            ids.insert(ids.end(), set.begin(), set.end());
+            bucket_offsets.push_back(ids.size());
+            uint64_t weight = set.size() > 0xffff ? 0xffff : set.size();
+            nodes.push_back(QGEN_NODE_LEAF(weight, bucket_offsets.size() - 2));
+        } else {
+            // Distributes the set like qgen_partition, don't cares go down every path they match
+            size_t entries = (size_t) 1 << s.bits;
+            std::vector<std::vector<size_t>> children(entries);
+            uint64_t field_mask = entries - 1;
+            for (size_t id : set) {
+                uint64_t cares = 0, value = 0;
+                pattern_field(id, s.lsb, s.bits, cares, value);
+                uint64_t free_bits = ~cares & field_mask;
+                for (uint64_t sub = free_bits; ; sub = (sub - 1) & free_bits) {
+                    children[value | sub].push_back(id);
+                    if (sub == 0) break;
+                }
+            }
+            std::vector<size_t> child_nodes(entries);
+            for (size_t j = 0; j < entries; j++) {
+                child_nodes[j] = build(children[j]);
+            }
+            push_split(s, child_nodes);
+        }
+        memo.push_back({hash, set, nodes.size() - 1});
+        return nodes.size() - 1;
+    }
+
+    template <typename Patterns>
+    constexpr generator(const Patterns &source) {
+        for (const auto &pattern : source) {
+            patterns.push_back(to_pattern(pattern));
+        }
+        for (const qgen_bitpattern_t &bp : patterns) {
+            width = width >= bp.width ? width : bp.width;
+        }
+        bool prioritized = false;
+        for (qgen_bitpattern_t &bp : patterns) {
+            align_pattern(bp, (uint8_t) width);
+            mask[0] |= bp.mask_low;
+            mask[1] |= bp.mask_high;
+            prioritized = prioritized || bp.priority;
+        }
+
+        // Highest priority first, then the lowest index, like qgen_gen_root
+        std::vector<size_t> root;
+        for (size_t i = 0; i < patterns.size(); i++) {
+            size_t j = root.size();
+            root.push_back(i);
+            while (prioritized && j > 0 && patterns[root[j - 1]].priority < patterns[i].priority) {
+                root[j] = root[j - 1];
+                j--;
+            }
+            root[j] = i;
+        }
+        build(root);
+    }
+
+    constexpr shape sizes() const {
+        return {nodes.size(), tables.size(), bucket_offsets.size() - 1, ids.size(), patterns.size()};
+    }
+
+    template <shape Shape>
+    constexpr tree_tables<Shape> emit() const {
+        tree_tables<Shape> out{};
+        out.width = width;
+        for (size_t i = 0; i < Shape.node_count; i++) out.nodes[i] = nodes[i];
+        for (size_t i = 0; i < Shape.table_length; i++) out.tables[i] = tables[i];
+        for (size_t i = 0; i <= Shape.bucket_count; i++) out.bucket_offsets[i] = bucket_offsets[i];
+        for (size_t i = 0; i < Shape.id_count; i++) out.ids[i] = ids[i];
+        for (size_t i = 0; i < Shape.pattern_count; i++) out.patterns[i] = patterns[i];
+        return out;
+    }
+};
+
+} // namespace detail
+
+// Tree of a constexpr range of patterns with static storage, e.g. a std::array of std::string_view.
+// Indices returned by dispatch are positions in that range, -1 means no match, same as qgen_tree_dispatch.
+template <const auto &Patterns>
+class tree {
+    static constexpr detail::shape shape = detail::generator(Patterns).sizes();
+
+public:
+    static constexpr detail::tree_tables<shape> data = detail::generator(Patterns).template emit<shape>();
+
+    static constexpr size_t root = shape.node_count - 1;
+
+private:
+    template <size_t Id>
+    static constexpr bool matches(uint64_t high, uint64_t low) {
+        constexpr qgen_bitpattern_t pat = data.patterns[Id];
+        return (low & pat.mask_low) == pat.active_low && (high & pat.mask_high) == pat.active_high;
+    }
+
+    template <size_t Bucket, size_t... I>
+    static constexpr intptr_t match(uint64_t high, uint64_t low, std::index_sequence<I...>) {
+        constexpr size_t first = data.bucket_offsets[Bucket];
+        intptr_t result = -1;
+        (void) ((matches<data.ids[first + I]>(high, low) && (result = (intptr_t) data.ids[first + I], true)) || ...);
+        return result;
+    }
+
+    template <size_t Node, size_t... J>
+    static constexpr intptr_t walk_table(uint64_t field, uint64_t high, uint64_t low, std::index_sequence<J...>) {
+        constexpr size_t offset = QGEN_NODE_TABLE_OFFSET(data.nodes[Node]);
+        intptr_t result = -1;
+        (void) ((field == J && (result = walk<data.tables[offset + J]>(high, low), true)) || ...);
+        return result;
+    }
+
+public:
+    // Walks the subtree of Node, every node is its own instantiation with the tested bits and the patterns as constants
+    template <size_t Node = root>
+    static constexpr intptr_t walk(uint64_t high, uint64_t low) {
+        constexpr qgen_otree_node_t node = data.nodes[Node];
+        if constexpr (QGEN_NODE_IS_LEAF(node)) {
+            constexpr size_t bucket = QGEN_NODE_BUCKET(node);
+            constexpr size_t length = data.bucket_offsets[bucket + 1] - data.bucket_offsets[bucket];
+            return match<bucket>(high, low, std::make_index_sequence<length>{});
+        } else {
+            constexpr uint64_t split_bit = QGEN_NODE_SPLIT_BIT(node);
+            uint64_t word = split_bit >= 64 ? high : low;
+            if constexpr (QGEN_NODE_IS_TABLE(node)) {
+                constexpr uint64_t bits = QGEN_NODE_FIELD_BITS(node);
+                uint64_t field = (word >> (split_bit & 63)) & ((1ULL << bits) - 1);
+                return walk_table<Node>(field, high, low, std::make_index_sequence<(size_t) 1 << bits>{});
+            } else if ((word >> (split_bit & 63)) & 1) {
+                return walk<QGEN_NODE_RIGHT(node)>(high, low);
+            } else {
+                return walk<QGEN_NODE_LEFT(node)>(high, low);
+            }
+        }
+    }
+
+    static constexpr intptr_t dispatch(uint64_t high, uint64_t low) {
+        return walk<root>(high, low);
+    }
+
+private:
+    template <size_t... I>
+    static constexpr std::array<qgen_bucket_t, shape.bucket_count> make_buckets(std::index_sequence<I...>) {
+        return {qgen_bucket_t{
+            data.bucket_offsets[I + 1] - data.bucket_offsets[I],
+            const_cast<size_t *>(data.ids.data() + data.bucket_offsets[I]),
+        }...};
+    }
+
+public:
+    static constexpr std::array<qgen_bucket_t, shape.bucket_count> buckets = make_buckets(std::make_index_sequence<shape.bucket_count>{});
+
+    // The tables as a qgen_otree_t for the C API. The tree is read-only: dispatch, export, info and save work on it,
+    // it must not be updated, frozen in place or passed to qgen_free_tree.
+    static constexpr qgen_otree_t view() {
+        qgen_otree_t t{};
+        t.width = data.width;
+        t.node_count = shape.node_count;
+        t.nodes = const_cast<qgen_otree_node_t *>(data.nodes.data());
+        t.pattern_count = shape.pattern_count;
+        t.patterns = shape.pattern_count ? const_cast<qgen_bitpattern_t *>(data.patterns.data()) : nullptr;
+        t.bucket_count = shape.bucket_count;
+        t.buckets = const_cast<qgen_bucket_t *>(buckets.data());
+        t.table_length = shape.table_length;
+        t.tables = shape.table_length ? const_cast<uint32_t *>(data.tables.data()) : nullptr;
+        return t;
+    }
+};
+
+} // namespace qgen
+
+#endif // QGEN_HPP